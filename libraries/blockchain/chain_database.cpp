@@ -67,6 +67,7 @@ namespace bts { namespace blockchain {
 
             //std::unique_ptr<ldb::DB> blk_id2num;  // maps blocks to unique IDs
             bts::db::level_map<block_id_type,uint32_t>          blk_id2num;
+            bts::db::level_map<uint32_t,block_id_type>          blk_num2id;
             bts::db::level_map<uint160,trx_num>                 trx_id2num;
             bts::db::level_map<trx_num,meta_trx>                meta_trxs;
             bts::db::level_map<uint32_t,signed_block_header>    blocks;
@@ -84,8 +85,15 @@ namespace bts { namespace blockchain {
             pow_validator_ptr                                   _pow_validator;
             transaction_validator_ptr                           _trx_validator;
             address                                             _trustee;
+            fee_estimator                                       _fee_estimator;
 
 
+            /**
+             *  dense block_num -> block_id index mirroring blk_num2id, so that a range of
+             *  ids can be returned without loading and hashing every block header
+             */
+            std::vector<block_id_type>                          _block_ids;
+
             /** cache this information because it is required in many calculations  */
             trx_block                                           head_block;
             block_id_type                                       head_block_id;
@@ -106,6 +114,40 @@ namespace bts { namespace blockchain {
                 _delegate_records.store( rec.delegate_id, rec );
             }
 
+            void store_block_id( uint32_t block_num, const block_id_type& block_id )
+            {
+                blk_num2id.store( block_num, block_id );
+                if( _block_ids.size() <= block_num )
+                   _block_ids.resize( block_num + 1 );
+                _block_ids[block_num] = block_id;
+            }
+
+            /**
+             *  Loads the block id index into memory, rebuilding it from the block headers
+             *  if it is missing entries (e.g. the database predates the index).
+             */
+            void load_block_ids()
+            { try {
+                _block_ids.clear();
+                if( head_block.block_num == uint32_t(-1) )
+                   return;
+                _block_ids.reserve( head_block.block_num + 1 );
+
+                auto itr = blk_num2id.begin();
+                while( itr.valid() && itr.key() == _block_ids.size() && _block_ids.size() <= head_block.block_num )
+                {
+                   _block_ids.push_back( itr.value() );
+                   ++itr;
+                }
+
+                if( _block_ids.size() <= head_block.block_num )
+                {
+                   wlog( "rebuilding block id index from block ${n}", ("n",_block_ids.size()) );
+                   for( uint32_t block_num = _block_ids.size(); block_num <= head_block.block_num; ++block_num )
+                      store_block_id( block_num, blocks.fetch( block_num ).id() );
+                }
+            } FC_RETHROW_EXCEPTIONS( warn, "error loading block id index" ) }
+
             void mark_spent( const output_reference& o, const trx_num& intrx, uint16_t in )
             {
                auto tid    = trx_id2num.fetch( o.trx_hash );
@@ -208,6 +250,7 @@ namespace bts { namespace blockchain {
                 block_trxs.store( b.block_num, trxs_ids );
 
                 blk_id2num.store( b.id(), b.block_num );
+                store_block_id( b.block_num, head_block_id );
 
                 for( auto item : state->_name_outputs )
                 {
@@ -232,6 +275,9 @@ namespace bts { namespace blockchain {
                    update_delegate( rec );
                 }
 
+                if( state->_trx_fees.size() == b.trxs.size() )
+                   _fee_estimator.record_block( b, state->_trx_fees );
+
             } FC_RETHROW_EXCEPTIONS( warn, "" ) }
 
             void update_name_record( const std::string& name, const claim_name_output& out )
@@ -315,6 +361,7 @@ namespace bts { namespace blockchain {
               fc::create_directories( dir );
          }
          my->blk_id2num.open( dir / "blk_id2num", create );
+         my->blk_num2id.open( dir / "blk_num2id", create );
          my->trx_id2num.open( dir / "trx_id2num", create );
          my->meta_trxs.open(  dir / "meta_trxs",  create );
          my->blocks.open(     dir / "blocks",     create );
@@ -328,6 +375,7 @@ namespace bts { namespace blockchain {
          if( my->head_block.block_num != uint32_t(-1) )
          {
             my->head_block_id = my->head_block.id();
+            my->load_block_ids();
          }
          else // initialize initial delegates
          {
@@ -351,10 +399,14 @@ namespace bts { namespace blockchain {
      void chain_database::close()
      {
         my->blk_id2num.close();
+        my->blk_num2id.close();
+        my->_block_ids.clear();
         my->trx_id2num.close();
         my->blocks.close();
         my->block_trxs.close();
         my->meta_trxs.close();
+        my->_delegate_records.close();
+        my->_name_records.close();
      }
 
     uint32_t chain_database::head_block_num()const
@@ -381,6 +433,24 @@ namespace bts { namespace blockchain {
        return my->blk_id2num.fetch( block_id );
     } FC_RETHROW_EXCEPTIONS( warn, "block id: ${block_id}", ("block_id",block_id) ) }
 
+    block_id_type chain_database::fetch_block_id( uint32_t block_num )const
+    {
+       if( block_num >= my->_block_ids.size() )
+          FC_THROW_EXCEPTION( key_not_found_exception, "block ${block_num} not found", ("block_num",block_num) );
+       return my->_block_ids[block_num];
+    }
+
+    std::vector<block_id_type> chain_database::fetch_block_ids( uint32_t first_block_num, uint32_t count )const
+    {
+       std::vector<block_id_type> result;
+       if( first_block_num >= my->_block_ids.size() )
+          return result;
+       auto first = my->_block_ids.begin() + first_block_num;
+       auto last  = first + std::min<size_t>( count, my->_block_ids.size() - first_block_num );
+       result.assign( first, last );
+       return result;
+    }
+
     signed_block_header chain_database::fetch_block( uint32_t block_num )
     {
        return my->blocks.fetch(block_num);
@@ -405,6 +475,34 @@ namespace bts { namespace blockchain {
        return fb;
     } FC_RETHROW_EXCEPTIONS( warn, "block ${block}", ("block",block_num) ) }
 
+    std::vector<trx_block> chain_database::fetch_trx_blocks( uint32_t first_block_num, uint32_t count )
+    { try {
+       std::vector<trx_block> result;
+       if( head_block_num() == uint32_t(-1) || first_block_num > head_block_num() )
+          return result;
+       result.reserve( std::min<uint32_t>( count, head_block_num() - first_block_num + 1 ) );
+
+       auto block_itr = my->blocks.lower_bound( first_block_num );
+       auto trxs_itr  = my->block_trxs.lower_bound( first_block_num );
+       while( result.size() < count && block_itr.valid() )
+       {
+          uint32_t block_num = first_block_num + result.size();
+          FC_ASSERT( block_itr.key() == block_num, "missing block ${block}", ("block",block_num) );
+          FC_ASSERT( trxs_itr.valid() && trxs_itr.key() == block_num, "missing trxs for block ${block}", ("block",block_num) );
+
+          trx_block fb = block_itr.value();
+          auto trx_ids = trxs_itr.value();
+          fb.trxs.reserve( trx_ids.size() );
+          for( uint32_t i = 0; i < trx_ids.size(); ++i )
+             fb.trxs.push_back( fetch_trx( fetch_trx_num( trx_ids[i] ) ) );
+          result.push_back( std::move(fb) );
+
+          ++block_itr;
+          ++trxs_itr;
+       }
+       return result;
+    } FC_RETHROW_EXCEPTIONS( warn, "blocks ${first} to ${last}", ("first",first_block_num)("last",first_block_num+count-1) ) }
+
     signed_transaction chain_database::fetch_transaction( const transaction_id_type& id )
     { try {
           auto trx_num = fetch_trx_num(id);
@@ -522,6 +620,7 @@ namespace bts { namespace blockchain {
             trx_summary = my->_trx_validator->evaluate( b.trxs[i], block_state );
             FC_ASSERT( b.trxs[i].version == 0 );
             FC_ASSERT( trx_summary.fees >= (b.trxs[i].size() * fee_rate)/1000 );
+            block_state->_trx_fees.push_back( trx_summary.fees );
             summary += trx_summary;
         }
 
@@ -583,6 +682,16 @@ namespace bts { namespace blockchain {
        return my->head_block.next_fee;
     }
 
+    uint64_t chain_database::estimate_fee_rate( uint32_t target_blocks )const
+    {
+       return std::max( my->_fee_estimator.estimate_fee_rate( target_blocks ), get_fee_rate() );
+    }
+
+    const fee_statistics& chain_database::get_fee_statistics()const
+    {
+       return my->_fee_estimator.get_statistics();
+    }
+
     void chain_database::set_pow_validator( const pow_validator_ptr& v )
     {
        my->_pow_validator = v;
@@ -606,6 +715,37 @@ namespace bts { namespace blockchain {
     void chain_database::evaluate_transaction( const signed_transaction& trx )
     {
        get_transaction_validator()->evaluate( trx, get_transaction_validator()->create_block_state() );
+       my->_fee_estimator.observe_transaction( trx.id(), head_block_num() );
+    }
+
+    std::vector<fc::optional<fc::exception> > chain_database::evaluate_transactions( const signed_transactions& trxs )
+    {
+       std::vector<fc::optional<fc::exception> > errors( trxs.size() );
+       auto validator   = get_transaction_validator();
+       auto block_state = validator->create_block_state();
+       // the block state doesn't track spent outputs, validate_unique_inputs() does that for blocks
+       std::unordered_set<output_reference> spent_outputs;
+       for( uint32_t i = 0; i < trxs.size(); ++i )
+       {
+          try {
+             for( const trx_input& in : trxs[i].inputs )
+             {
+                FC_ASSERT( spent_outputs.find( in.output_ref ) == spent_outputs.end(),
+                           "input already spent by an earlier transaction", ("output_ref",in.output_ref) );
+             }
+             auto trx_state = block_state->clone();
+             validator->evaluate( trxs[i], trx_state );
+             block_state = trx_state;
+             for( const trx_input& in : trxs[i].inputs )
+                spent_outputs.insert( in.output_ref );
+             my->_fee_estimator.observe_transaction( trxs[i].id(), head_block_num() );
+          }
+          catch ( const fc::exception& e )
+          {
+             errors[i] = e;
+          }
+       }
+       return errors;
     }
     uint32_t  chain_database::get_new_delegate_id()const
     {
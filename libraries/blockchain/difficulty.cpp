@@ -1,6 +1,10 @@
 #include <bts/blockchain/difficulty.hpp>
 #include <fc/exception/exception.hpp>
 #include <string.h>
+#include <mutex>
+
+/** number of recently used targets remembered by target_from_difficulty */
+#define TARGET_CACHE_SIZE 16
 
 namespace bts { namespace blockchain {
 
@@ -70,4 +74,92 @@ namespace bts { namespace blockchain {
       return tmp;
   }
 
+  namespace detail
+  {
+     /**
+      *  Long division of 2^hash_bits - 1 by divisor one bit at a time.  The
+      *  remainder is always less than the divisor, so it only overflows 64 bits
+      *  for one shift which is tracked by carry.
+      */
+     pow_target compute_target( uint64_t divisor, uint32_t hash_bits )
+     {
+        pow_target target;
+        target.hash_bits = hash_bits;
+        if( divisor <= 1 )
+        {
+           for( uint32_t w = 0; w < hash_bits / 32; ++w )
+              target.words[w] = 0xffffffff;
+           return target;
+        }
+
+        uint64_t remainder = 0;
+        for( uint32_t bit = 0; bit < hash_bits; ++bit )
+        {
+           bool carry = (remainder >> 63) != 0;
+           remainder  = (remainder << 1) | 1;
+           if( carry || remainder >= divisor )
+           {
+              remainder -= divisor;
+              target.words[bit/32] |= 0x80000000u >> (bit%32);
+           }
+        }
+        return target;
+     }
+
+     template<typename HashType>
+     bool meets_target( const HashType& hash_value, const pow_target& target )
+     {
+        static_assert( sizeof(HashType) % 4 == 0, "hash must be a whole number of words" );
+        FC_ASSERT( target.hash_bits == sizeof(HashType) * 8 );
+
+        const unsigned char* bytes = (const unsigned char*)&hash_value;
+        for( uint32_t w = 0; w < sizeof(HashType) / 4; ++w )
+        {
+           uint32_t word = (uint32_t(bytes[4*w]) << 24) | (uint32_t(bytes[4*w+1]) << 16) |
+                           (uint32_t(bytes[4*w+2]) << 8) | uint32_t(bytes[4*w+3]);
+           if( word != target.words[w] )
+              return word < target.words[w];
+        }
+        return true;
+     }
+  }
+
+  pow_target target_from_difficulty( uint64_t difficulty, uint32_t hash_bits )
+  {
+     FC_ASSERT( hash_bits == 160 || hash_bits == 224 || hash_bits == 256, "", ("hash_bits",hash_bits) );
+
+     static std::mutex  cache_lock;
+     static pow_target  cache[TARGET_CACHE_SIZE];
+     static uint64_t    cache_difficulty[TARGET_CACHE_SIZE];
+
+     uint32_t slot = uint32_t( (difficulty * 31 + hash_bits) % TARGET_CACHE_SIZE );
+     {
+        std::lock_guard<std::mutex> lock( cache_lock );
+        if( cache[slot].hash_bits == hash_bits && cache_difficulty[slot] == difficulty )
+           return cache[slot];
+     }
+
+     pow_target target = detail::compute_target( difficulty, hash_bits );
+
+     std::lock_guard<std::mutex> lock( cache_lock );
+     cache[slot]            = target;
+     cache_difficulty[slot] = difficulty;
+     return target;
+  }
+
+  bool meets_target( const fc::sha224& hash_value, const pow_target& target )
+  {
+     return detail::meets_target( hash_value, target );
+  }
+
+  bool meets_target( const fc::sha256& hash_value, const pow_target& target )
+  {
+     return detail::meets_target( hash_value, target );
+  }
+
+  bool meets_target( const fc::uint160& hash_value, const pow_target& target )
+  {
+     return detail::meets_target( hash_value, target );
+  }
+
 } } // bts::blockchain
@@ -0,0 +1,172 @@
+#include <bts/blockchain/fee_estimator.hpp>
+#include <bts/blockchain/config.hpp>
+#include <fc/reflect/variant.hpp>
+
+#include <algorithm>
+
+/** fraction (in percent) of transactions in a bucket that must confirm within the target */
+#define FEE_ESTIMATOR_SUCCESS_PERCENT  85
+/** minimum number of transactions required before a bucket is considered */
+#define FEE_ESTIMATOR_MIN_SAMPLES      4
+/** number of exponentially spaced fee buckets, each 25% larger than the last */
+#define FEE_ESTIMATOR_BUCKETS          48
+
+namespace bts { namespace blockchain {
+
+   fee_estimator::fee_estimator( uint32_t window_blocks )
+   :_window( std::max<uint32_t>(window_blocks,1) ),
+    _total_block_size(0),
+    _total_delay(0),
+    _delay_samples(0),
+    _estimates( BTS_BLOCKCHAIN_FEE_ESTIMATOR_MAX_TARGET, 0 )
+   {
+      uint64_t bound = block_header::min_fee();
+      _bucket_bounds.reserve( FEE_ESTIMATOR_BUCKETS );
+      _bucket_bounds.push_back( 0 );
+      for( uint32_t i = 1; i < FEE_ESTIMATOR_BUCKETS; ++i )
+      {
+         _bucket_bounds.push_back( bound );
+         bound += bound / 4;
+      }
+      // delay 0 is unknown, MAX_TARGET+1 is anything slower than the max target
+      _confirmed.resize( FEE_ESTIMATOR_BUCKETS, std::vector<uint32_t>( BTS_BLOCKCHAIN_FEE_ESTIMATOR_MAX_TARGET+2, 0 ) );
+      _stats.estimates = _estimates;
+   }
+
+   void fee_estimator::observe_transaction( const transaction_id_type& trx_id, uint32_t head_block_num )
+   {
+      if( !_pending.insert( std::make_pair( trx_id, head_block_num ) ).second )
+         return;
+
+      _pending_order.push_back( trx_id );
+      while( _pending_order.size() > BTS_BLOCKCHAIN_FEE_ESTIMATOR_MAX_PENDING )
+      {
+         _pending.erase( _pending_order.front() );
+         _pending_order.pop_front();
+      }
+   }
+
+   uint16_t fee_estimator::bucket_for( uint64_t fee_rate )const
+   {
+      auto itr = std::upper_bound( _bucket_bounds.begin(), _bucket_bounds.end(), fee_rate );
+      return uint16_t( (itr - _bucket_bounds.begin()) - 1 );
+   }
+
+   void fee_estimator::record_block( const trx_block& b, const std::vector<int64_t>& fees )
+   {
+      FC_ASSERT( fees.size() == b.trxs.size(), "", ("fees",fees.size())("trxs",b.trxs.size()) );
+
+      block_sample sample;
+      sample.block_size = b.block_size();
+      sample.trxs.reserve( b.trxs.size() );
+      sample.fee_rates.reserve( b.trxs.size() );
+
+      for( uint32_t i = 0; i < b.trxs.size(); ++i )
+      {
+         uint64_t trx_size = b.trxs[i].size();
+         if( trx_size == 0 || fees[i] < 0 ) continue;
+
+         uint64_t fee_rate = (uint64_t(fees[i]) * 1000) / trx_size;
+         uint16_t delay    = 0;
+
+         auto itr = _pending.find( b.trxs[i].id() );
+         if( itr != _pending.end() )
+         {
+            if( b.block_num > itr->second )
+               delay = uint16_t( std::min<uint32_t>( b.block_num - itr->second, BTS_BLOCKCHAIN_FEE_ESTIMATOR_MAX_TARGET+1 ) );
+            _pending.erase( itr );
+         }
+
+         sample.trxs.push_back( std::make_pair( bucket_for( fee_rate ), delay ) );
+         sample.fee_rates.push_back( fee_rate );
+      }
+
+      // the pending order queue is only used to bound memory, lazily drop
+      // ids that have already been confirmed.
+      while( _pending_order.size() && _pending.find( _pending_order.front() ) == _pending.end() )
+         _pending_order.pop_front();
+
+      apply_sample( sample, 1 );
+      _samples.push_back( std::move(sample) );
+      while( _samples.size() > _window )
+      {
+         apply_sample( _samples.front(), -1 );
+         _samples.pop_front();
+      }
+
+      update_estimates();
+   }
+
+   void fee_estimator::apply_sample( const block_sample& s, int64_t sign )
+   {
+      _total_block_size += sign * int64_t(s.block_size);
+      for( auto item : s.trxs )
+      {
+         _confirmed[item.first][item.second] += int32_t(sign);
+         if( item.second != 0 )
+         {
+            _total_delay   += sign * int64_t(item.second);
+            _delay_samples += int32_t(sign);
+         }
+      }
+   }
+
+   /**
+    *  For each target walk the buckets from the highest fee to the lowest and
+    *  stop as soon as too few of the transactions paying at least that fee
+    *  were included within the target.
+    */
+   void fee_estimator::update_estimates()
+   {
+      for( uint32_t target = 1; target <= BTS_BLOCKCHAIN_FEE_ESTIMATOR_MAX_TARGET; ++target )
+      {
+         uint64_t total    = 0;
+         uint64_t within   = 0;
+         uint64_t estimate = 0;
+         for( int32_t bucket = FEE_ESTIMATOR_BUCKETS-1; bucket >= 0; --bucket )
+         {
+            const auto& delays = _confirmed[bucket];
+            for( uint32_t d = 1; d < delays.size(); ++d )
+            {
+               total += delays[d];
+               if( d <= target ) within += delays[d];
+            }
+            if( total < FEE_ESTIMATOR_MIN_SAMPLES ) continue;
+            if( within * 100 < total * FEE_ESTIMATOR_SUCCESS_PERCENT ) break;
+            estimate = _bucket_bounds[bucket];
+         }
+         // waiting longer should never cost more
+         if( target > 1 && _estimates[target-2] != 0 && (estimate == 0 || estimate > _estimates[target-2]) )
+            estimate = _estimates[target-2];
+         _estimates[target-1] = estimate;
+      }
+
+      fee_statistics stats;
+      stats.blocks_sampled     = _samples.size();
+      stats.average_block_size = _total_block_size / _samples.size();
+      if( _delay_samples )
+         stats.average_inclusion_delay = double(_total_delay) / _delay_samples;
+
+      std::vector<uint64_t> rates;
+      for( const block_sample& s : _samples )
+         rates.insert( rates.end(), s.fee_rates.begin(), s.fee_rates.end() );
+      stats.transactions_sampled = rates.size();
+      if( rates.size() )
+      {
+         auto mid = rates.begin() + rates.size() / 2;
+         std::nth_element( rates.begin(), mid, rates.end() );
+         stats.median_fee_rate = *mid;
+         stats.min_fee_rate    = *std::min_element( rates.begin(), mid+1 );
+      }
+      stats.estimates = _estimates;
+      _stats = std::move(stats);
+   }
+
+   uint64_t fee_estimator::estimate_fee_rate( uint32_t target_blocks )const
+   {
+      target_blocks = std::max<uint32_t>( target_blocks, 1 );
+      target_blocks = std::min<uint32_t>( target_blocks, BTS_BLOCKCHAIN_FEE_ESTIMATOR_MAX_TARGET );
+      return _estimates[target_blocks-1];
+   }
+
+} } // bts::blockchain
@@ -3,6 +3,7 @@
 #include <bts/blockchain/transaction.hpp>
 #include <bts/blockchain/transaction_validator.hpp>
 #include <bts/blockchain/pow_validator.hpp>
+#include <bts/blockchain/fee_estimator.hpp>
 
 namespace fc
 {
@@ -76,6 +77,16 @@ namespace bts { namespace blockchain {
 
           void evaluate_transaction( const signed_transaction& trx );
 
+          /**
+           *  Evaluates the transactions in order as if they were the next block, so one that
+           *  spends an output or claims a name an earlier one already did is rejected.  Each
+           *  transaction is evaluated on a copy of the block state that is kept only if it is
+           *  valid, so an invalid transaction doesn't affect the ones after it.
+           *
+           *  @return the error for each transaction that is invalid, empty for the valid ones
+           */
+          std::vector<fc::optional<fc::exception> > evaluate_transactions( const signed_transactions& trxs );
+
           fc::optional<name_record> lookup_name( const std::string& name );
           fc::optional<name_record> lookup_delegate( uint16_t del );
 
@@ -117,6 +128,13 @@ namespace bts { namespace blockchain {
 
           /** return the fee rate in shares */
           uint64_t                    get_fee_rate()const;
+
+          /**
+           *  @return the fee rate in milli-shares per byte that has recently been sufficient to
+           *  be included within target_blocks, never less than get_fee_rate()
+           */
+          uint64_t                    estimate_fee_rate( uint32_t target_blocks = 1 )const;
+          const fee_statistics&       get_fee_statistics()const;
           uint32_t                    get_new_delegate_id()const;
 
 
@@ -130,9 +148,14 @@ namespace bts { namespace blockchain {
          trx_output fetch_output(const output_reference& ref);
 
          uint32_t                   fetch_block_num( const block_id_type& block_id );
+         block_id_type              fetch_block_id( uint32_t block_num )const;
+         /** @return the ids of up to count blocks starting at first_block_num, fewer near the head */
+         std::vector<block_id_type> fetch_block_ids( uint32_t first_block_num, uint32_t count )const;
          signed_block_header        fetch_block( uint32_t block_num );
          digest_block               fetch_digest_block( uint32_t block_num );
          trx_block                  fetch_trx_block( uint32_t block_num );
+         /** reads up to count consecutive blocks with one sequential scan of the block store */
+         std::vector<trx_block>     fetch_trx_blocks( uint32_t first_block_num, uint32_t count );
 
          /**
           *  Validates the block and then pushes it into the database.
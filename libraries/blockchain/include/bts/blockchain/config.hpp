@@ -12,6 +12,9 @@
 #define BTS_BLOCKCHAIN_DELEGATES                 (100)
 #define BTS_BLOCKCHAIN_BIP                       (1000000000000000ll)
 
+/** keys recovered from transaction signatures that are kept for when the transaction is evaluated again */
+#define BTS_BLOCKCHAIN_SIGNATURE_CACHE_SIZE      (100000)
+
 /** defines the maximum block size allowed, 24 MB per hour */
 #define BTS_BLOCKCHAIN_MAX_BLOCK_SIZE     (24 * 1024*1024 / BTS_BLOCKCHAIN_BLOCKS_PER_HOUR)
 
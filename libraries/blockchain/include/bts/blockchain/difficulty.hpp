@@ -3,6 +3,7 @@
 #include <fc/crypto/sha224.hpp>
 #include <fc/crypto/sha256.hpp>
 #include <fc/crypto/ripemd160.hpp>
+#include <string.h>
 
 namespace bts { namespace blockchain {
 
@@ -27,5 +28,35 @@ namespace bts { namespace blockchain {
      */
     uint64_t difficulty( const fc::uint160& hash_value );
 
+    /**
+     *  The largest hash value, read as a big endian number, that still has a
+     *  given difficulty:  floor( (2^hash_bits - 1) / difficulty ).  
+     *
+     *  words[0] is the most significant 32 bits and only the first
+     *  hash_bits / 32 words are used.
+     */
+    struct pow_target
+    {
+       pow_target():hash_bits(0){ memset( words, 0, sizeof(words) ); }
+
+       uint32_t hash_bits;
+       uint32_t words[8];
+    };
+
+    /**
+     *  @param hash_bits 160, 224 or 256 depending upon the hash the target will be compared with
+     *
+     *  Recently used targets are cached, so calling this for every proof of work
+     *  checked against the same difficulty is cheap.
+     */
+    pow_target target_from_difficulty( uint64_t difficulty, uint32_t hash_bits = 256 );
+
+    /**
+     *  Equivalent to difficulty( hash_value ) >= the difficulty the target was created from,
+     *  but implemented as a word-wise compare without any big integer math.
+     */
+    bool meets_target( const fc::sha224& hash_value, const pow_target& target );
+    bool meets_target( const fc::sha256& hash_value, const pow_target& target );
+    bool meets_target( const fc::uint160& hash_value, const pow_target& target );
 
 } } // namespace bts::blockchain
@@ -0,0 +1,100 @@
+#pragma once
+#include <bts/blockchain/block.hpp>
+#include <deque>
+#include <unordered_map>
+
+/** number of recent blocks the fee estimator keeps statistics for */
+#define BTS_BLOCKCHAIN_FEE_ESTIMATOR_WINDOW         (BTS_BLOCKCHAIN_BLOCKS_PER_HOUR)
+/** the largest confirmation target (in blocks) that can be estimated */
+#define BTS_BLOCKCHAIN_FEE_ESTIMATOR_MAX_TARGET     (10)
+/** the maximum number of pending transactions tracked for inclusion delay */
+#define BTS_BLOCKCHAIN_FEE_ESTIMATOR_MAX_PENDING    (10000)
+
+namespace bts { namespace blockchain {
+
+   /**
+    *  Summary of the recent block history used to estimate fees,
+    *  all fee rates are in milli-shares per byte like chain_database::get_fee_rate()
+    */
+   struct fee_statistics
+   {
+      fee_statistics()
+      :blocks_sampled(0),transactions_sampled(0),average_block_size(0),
+       min_fee_rate(0),median_fee_rate(0),average_inclusion_delay(0){}
+
+      uint32_t               blocks_sampled;
+      uint32_t               transactions_sampled;
+      uint64_t               average_block_size;
+      uint64_t               min_fee_rate;
+      uint64_t               median_fee_rate;
+      /** average number of blocks between first seeing a transaction and its inclusion */
+      double                 average_inclusion_delay;
+      /** estimates[i] is the fee rate required to confirm within i+1 blocks */
+      std::vector<uint64_t>  estimates;
+   };
+
+   /**
+    *  @class fee_estimator
+    *  @brief tracks the fees paid and inclusion delay of recent transactions
+    *
+    *  Each stored block is recorded along with the fee paid by every transaction.  If a
+    *  transaction was previously observed in the pending pool the number of blocks it
+    *  waited is also recorded.  Transactions are grouped into exponentially spaced fee
+    *  rate buckets and after every block the minimum fee rate that confirmed within
+    *  1..BTS_BLOCKCHAIN_FEE_ESTIMATOR_MAX_TARGET blocks is recalculated so that queries
+    *  are a simple table lookup.
+    */
+   class fee_estimator
+   {
+      public:
+         fee_estimator( uint32_t window_blocks = BTS_BLOCKCHAIN_FEE_ESTIMATOR_WINDOW );
+
+         /** called when a transaction enters the pending pool while head_block_num is the head */
+         void      observe_transaction( const transaction_id_type& trx_id, uint32_t head_block_num );
+
+         /**
+          *  @param fees the fees paid by each of b.trxs in the same order
+          */
+         void      record_block( const trx_block& b, const std::vector<int64_t>& fees );
+
+         /**
+          *  @return the fee rate, in milli-shares per byte, that has recently been sufficient
+          *  to be included within target_blocks or 0 if there is not enough data.
+          */
+         uint64_t  estimate_fee_rate( uint32_t target_blocks )const;
+
+         const fee_statistics& get_statistics()const { return _stats; }
+
+      private:
+         struct block_sample
+         {
+            uint64_t                                  block_size;
+            /** (fee bucket, inclusion delay) per transaction, delay of 0 means unknown */
+            std::vector< std::pair<uint16_t,uint16_t> > trxs;
+            std::vector<uint64_t>                     fee_rates;
+         };
+
+         uint16_t  bucket_for( uint64_t fee_rate )const;
+         void      apply_sample( const block_sample& s, int64_t sign );
+         void      update_estimates();
+
+         uint32_t                                          _window;
+         std::deque<block_sample>                          _samples;
+         std::vector<uint64_t>                             _bucket_bounds;
+         /** _confirmed[bucket][delay] running totals over the window, delay 0 means unknown */
+         std::vector< std::vector<uint32_t> >              _confirmed;
+         uint64_t                                          _total_block_size;
+         uint64_t                                          _total_delay;
+         uint32_t                                          _delay_samples;
+
+         std::unordered_map<transaction_id_type,uint32_t>  _pending;
+         std::deque<transaction_id_type>                   _pending_order;
+
+         std::vector<uint64_t>                             _estimates;
+         fee_statistics                                    _stats;
+   };
+
+} } // bts::blockchain
+
+FC_REFLECT( bts::blockchain::fee_statistics, (blocks_sampled)(transactions_sampled)(average_block_size)
+                                              (min_fee_rate)(median_fee_rate)(average_inclusion_delay)(estimates) )
@@ -2,20 +2,163 @@
 #include <fc/array.hpp>
 #include <fc/io/varint.hpp>
 #include <fc/crypto/ripemd160.hpp>
+#include <fc/crypto/sha256.hpp>
+#include <fc/crypto/sha512.hpp>
 #include <fc/reflect/reflect.hpp>
 
+#include <functional>
+#include <memory>
+#include <vector>
+
 #define MOMENTUM_NONCE_BITS 26
 #define MAX_MOMENTUM_NONCE  (1<<MOMENTUM_NONCE_BITS)
+#define BIRTHDAYS_PER_HASH  8
 
 namespace bts { namespace blockchain {
    typedef fc::sha256     pow_seed_type;
    typedef fc::ripemd160  pow_hash_type;
 
    /** 
+    *  Allocates the search memory for a single search, use a momentum_workspace
+    *  when searching repeatedly.
+    *
     *  @return all collisions found in the nonce search space 
     */
    std::vector< std::pair<uint32_t,uint32_t> > momentum_search( pow_seed_type head );
+
+   /**
+    *  Splits hashing by nonce range and duplicate detection by partition
+    *  across num_threads threads.
+    *
+    *  @return the same collisions as momentum_search( head ) in the same order
+    */
+   std::vector< std::pair<uint32_t,uint32_t> > momentum_search( pow_seed_type head, uint32_t num_threads );
    bool momentum_verify( pow_seed_type head, uint32_t a, uint32_t b );
 
+   namespace detail { class momentum_workspace_impl; }
+
+   /** timing of the two phases of the most recent momentum_workspace::search */
+   struct momentum_search_stats
+   {
+      momentum_search_stats()
+      :nonces(0),partitions(0),collisions(0),hash_time_us(0),scan_time_us(0),canceled(false){}
+
+      uint32_t nonces;       ///< nonces hashed into the hash store
+      uint32_t partitions;   ///< partitions scanned for duplicates
+      uint32_t collisions;   ///< collision pairs found, both directions
+      int64_t  hash_time_us;
+      int64_t  scan_time_us;
+      bool     canceled;
+      /** nonces per second hashed by each search thread, 0 for threads that were canceled */
+      std::vector<double> thread_hash_rates;
+   };
+
+   /**
+    *  @class momentum_workspace
+    *  @brief owns the memory and threads used by repeated momentum searches
+    *
+    *  A search needs ~540MB of hash storage, allocating and faulting it in for
+    *  every attempt is a measurable share of the search time.  The workspace
+    *  allocates it once, optionally backed by huge pages and prefaulted, and
+    *  reuses it (along with the filters and worker threads) for every search.
+    *
+    *  Blocks are signed by trustees rather than mined, so bts_benchmarks is its
+    *  only caller today; block_miner (not built) still calls momentum_search().
+    */
+   class momentum_workspace
+   {
+      public:
+         enum huge_page_mode
+         {
+            no_huge_pages          = 0,
+            transparent_huge_pages = 1, ///< madvise( MADV_HUGEPAGE ), Linux only
+            explicit_huge_pages    = 2  ///< MAP_HUGETLB, Linux only, falls back to transparent
+         };
+
+         /** @throw fc::exception if the hash storage cannot be allocated */
+         momentum_workspace( uint32_t num_threads = 1, huge_page_mode huge_pages = transparent_huge_pages, bool prefault = true );
+         ~momentum_workspace();
+
+         /**
+          *  Polled by every search thread, so it must be thread safe, and once it
+          *  returns true it must keep returning true for the rest of the search.
+          */
+         typedef std::function<bool()> cancel_check;
+
+         /** @return the same collisions as momentum_search( head ) */
+         std::vector< std::pair<uint32_t,uint32_t> > search( const pow_seed_type& head );
+         /**
+          *  Checks canceled() every 64K nonces hashed and every 64 partitions scanned.
+          *
+          *  @return the collisions or an empty vector if the search was canceled
+          */
+         std::vector< std::pair<uint32_t,uint32_t> > search( const pow_seed_type& head, const cancel_check& canceled );
+
+         const momentum_search_stats& get_last_search_stats()const;
+         /** @return total nonces hashed by thread since construction, safe to call during a search */
+         uint64_t                     get_nonces_hashed( uint32_t thread )const;
+
+         uint32_t       get_num_threads()const;
+         /** @return the kind of pages actually obtained from the OS */
+         huge_page_mode get_huge_page_mode()const;
+
+      private:
+         std::unique_ptr<detail::momentum_workspace_impl> my;
+   };
+
+   /**
+    *  Implementations of the sha512 used to generate momentum birthdays,
+    *  the SIMD kernels hash several nonces at once, one per lane.
+    */
+   enum momentum_kernel_type
+   {
+      scalar_momentum_kernel = 0,
+      avx2_momentum_kernel   = 1,  ///< 4 nonce blocks at a time
+      avx512_momentum_kernel = 2   ///< 8 nonce blocks at a time
+   };
+
+   /** @return the fastest kernel supported by this CPU */
+   momentum_kernel_type best_momentum_kernel();
+   bool                 momentum_kernel_supported( momentum_kernel_type kernel );
+
+   /**
+    *  results[i] = sha512( first_nonce + i*BIRTHDAYS_PER_HASH, head ) for i in [0,count)
+    *  which is bit for bit what momentum_verify computes for those nonces.
+    *
+    *  @param first_nonce must be a multiple of BIRTHDAYS_PER_HASH
+    */
+   void momentum_hash_blocks( const pow_seed_type& head, uint32_t first_nonce, uint32_t count, fc::sha512* results );
+   void momentum_hash_blocks( momentum_kernel_type kernel, const pow_seed_type& head,
+                              uint32_t first_nonce, uint32_t count, fc::sha512* results );
+
+   namespace detail
+   {
+      /** the SHA-512 message block for a seed, only the nonce in word 0 changes between hashes */
+      struct momentum_block
+      {
+         uint64_t seed_word0;
+         uint64_t w[16];
+      };
+   }
+
+   /**
+    *  Checks the kernel and builds the message block for a seed once, so a search
+    *  can hash millions of batches without repeating that work for each one.
+    */
+   class momentum_hasher
+   {
+      public:
+         momentum_hasher( momentum_kernel_type kernel, const pow_seed_type& head );
+
+         /** same as momentum_hash_blocks(), first_nonce must be a multiple of BIRTHDAYS_PER_HASH */
+         void hash_blocks( uint32_t first_nonce, uint32_t count, fc::sha512* results )const;
+
+      private:
+         momentum_kernel_type   _kernel;
+         detail::momentum_block _block;
+   };
+
 } } // bts::blockchain
 
+FC_REFLECT( bts::blockchain::momentum_search_stats, (nonces)(partitions)(collisions)(hash_time_us)(scan_time_us)(canceled)(thread_hash_rates) )
+
@@ -183,6 +183,11 @@ struct transaction
  */
 struct signed_transaction : public transaction
 {
+    /**
+     *  Recovers the key of each signature.  Recovered keys are cached, so evaluating the
+     *  transaction again, or calling this ahead of time on another thread, is cheap.
+     */
+    std::vector<fc::ecc::public_key> get_signing_keys()const;
     std::unordered_set<address>      get_signed_addresses()const;
     std::unordered_set<pts_address>  get_signed_pts_addresses()const;
     transaction_id_type              id()const;
@@ -39,6 +39,11 @@ namespace bts { namespace blockchain {
    {
       public:
          virtual ~block_evaluation_state(){}
+         /** a copy to evaluate a transaction against, so a failed transaction leaves this state as it was */
+         virtual std::shared_ptr<block_evaluation_state> clone()const
+         {
+            return std::make_shared<block_evaluation_state>( *this );
+         }
          void add_name_output( const claim_name_output& o )
          {
             FC_ASSERT( _name_outputs.find( o.name ) == _name_outputs.end() );
@@ -50,6 +55,8 @@ namespace bts { namespace blockchain {
          std::unordered_map<std::string,claim_name_output> _name_outputs;
          std::unordered_map<int32_t,uint64_t>              _input_votes;
          std::unordered_map<int32_t,uint64_t>              _output_votes;
+         /** fees paid by each non-deterministic transaction in block order */
+         std::vector<int64_t>                              _trx_fees;
    };
 
    typedef std::shared_ptr<block_evaluation_state> block_evaluation_state_ptr;
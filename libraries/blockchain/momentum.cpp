@@ -9,24 +9,35 @@
 #include <unordered_map>
 #include <fc/reflect/variant.hpp>
 #include <fc/time.hpp>
+#include <fc/string.hpp>
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <memory>
 
 #include <fc/log/logger.hpp>
+#include <fc/exception/exception.hpp>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 
 
 namespace bts { namespace blockchain {
 
    #define SEARCH_SPACE_BITS 50
-   #define BIRTHDAYS_PER_HASH 8
 
    // The Momentum duplicate detector filter
    #define FILTER_SLOTS_POWER 19  /* 2^20 bits - fits in L2 */
    #define FILTER_SIZE_BYTES (1 << (FILTER_SLOTS_POWER+1-3))
    #define PARTITION_BITS     10 /* Balance TLB pressure vs filter */
+   #define MOMENTUM_MAX_SEARCH_THREADS 64
 
    #define HASH_MASK ((1ULL<<(64-MOMENTUM_NONCE_BITS))-1)  /* How hash is stored in hashStore */
    #define MOMENTUM_COLHASH_SIZE 36 /* bytes */
+   #define NUM_PARTITIONS (1<<PARTITION_BITS)
+   #define HASH_BATCH_BLOCKS  8  /* nonce blocks handed to the sha512 kernel at once, one avx512 batch */
+   #define CANCEL_CHECK_NONCES (1<<16) /* nonces hashed between checks for a canceled search */
 
 
    /*
@@ -116,19 +127,72 @@ namespace bts { namespace blockchain {
    }
 
 
-   void generate_hashes(pow_seed_type head, uint64_t *hashStore, uint32_t *hashCounts)
+   /* Every CANCEL_CHECK_NONCES the hashing loops add their progress to
+    * nonces_hashed and give up if the search has been canceled. */
+
+   bool generate_hashes(pow_seed_type head, uint64_t *hashStore, uint32_t *hashCounts,
+                        const momentum_workspace::cancel_check &canceled, std::atomic<uint64_t> &nonces_hashed)
    {
-      fc::sha512::encoder enc;
-      for ( uint32_t n = 0; n < MAX_MOMENTUM_NONCE; n += (BIRTHDAYS_PER_HASH)) {
-         enc.write( (char*)&n, sizeof(n));
-         enc.write( (char *)&head, sizeof(head));
-	 auto result = enc.result();
+      const momentum_hasher hasher(best_momentum_kernel(), head);
+      fc::sha512 results[HASH_BATCH_BLOCKS];
+      for ( uint32_t n = 0; n < MAX_MOMENTUM_NONCE; n += HASH_BATCH_BLOCKS*BIRTHDAYS_PER_HASH) {
+         if (n % CANCEL_CHECK_NONCES == 0 && n != 0) {
+            nonces_hashed += CANCEL_CHECK_NONCES;
+            if (canceled && canceled()) return false;
+         }
+         hasher.hash_blocks(n, HASH_BATCH_BLOCKS, results);
+
+         for (uint32_t b = 0; b < HASH_BATCH_BLOCKS; b++) {
+            for (uint32_t i = 0; i < BIRTHDAYS_PER_HASH; i++) {
+               put_hash_in_bucket((results[b]._hash[i] >> (64 - SEARCH_SPACE_BITS)), hashStore, hashCounts, n+b*BIRTHDAYS_PER_HASH+i);
+            }
+         }
+      }
+      nonces_hashed += CANCEL_CHECK_NONCES;
+      return true;
+   }
 
-	 for (uint32_t i = 0; i < BIRTHDAYS_PER_HASH; i++) {
-	    put_hash_in_bucket((result._hash[i] >> (64 - SEARCH_SPACE_BITS)), hashStore, hashCounts, n+i);
-	 }
-	 enc.reset();
+
+   /* The parallel search gives every thread its own slot within each
+    * partition so that threads never share a bucket counter.  Smaller
+    * slots have a larger relative variance so they are given a 12.5%
+    * margin plus a little extra.  A slot that fills up drops the
+    * remaining hashes rather than overrunning its neighbor. */
+
+   uint32_t parallel_slot_size(uint32_t num_threads)
+   {
+      uint32_t slot_real_size = (1<<(MOMENTUM_NONCE_BITS-PARTITION_BITS)) / num_threads;
+      return slot_real_size + (slot_real_size>>3) + 64;
+   }
+
+   bool generate_hashes_in_range(pow_seed_type head, uint64_t *hashStore, uint32_t *hashCounts, const uint32_t *hashLimits,
+                                 uint32_t first_nonce, uint32_t last_nonce,
+                                 const momentum_workspace::cancel_check &canceled, std::atomic<uint64_t> &nonces_hashed)
+   {
+      const momentum_hasher hasher(best_momentum_kernel(), head);
+      fc::sha512 results[HASH_BATCH_BLOCKS];
+      uint32_t checked = first_nonce;
+      for ( uint32_t n = first_nonce; n < last_nonce; n += HASH_BATCH_BLOCKS*BIRTHDAYS_PER_HASH) {
+         if (n - checked >= CANCEL_CHECK_NONCES) {
+            nonces_hashed += n - checked;
+            checked = n;
+            if (canceled && canceled()) return false;
+         }
+         uint32_t blocks = std::min<uint32_t>(HASH_BATCH_BLOCKS, (last_nonce - n) / BIRTHDAYS_PER_HASH);
+         hasher.hash_blocks(n, blocks, results);
+
+         for (uint32_t b = 0; b < blocks; b++) {
+            for (uint32_t i = 0; i < BIRTHDAYS_PER_HASH; i++) {
+               uint64_t hash = results[b]._hash[i] >> (64 - SEARCH_SPACE_BITS);
+               uint32_t bin  = hash & ((1<<PARTITION_BITS)-1);
+               if (hashCounts[bin] < hashLimits[bin]) {
+                  put_hash_in_bucket(hash, hashStore, hashCounts, n+b*BIRTHDAYS_PER_HASH+i);
+               }
+            }
+         }
       }
+      nonces_hashed += last_nonce - checked;
+      return true;
    }
 
 
@@ -183,50 +247,339 @@ namespace bts { namespace blockchain {
    }
 
    
-   std::vector< std::pair<uint32_t,uint32_t> > momentum_search( pow_seed_type head )
+   /* The hashStore is half a gigabyte.  Allocating it for every search
+    * means faulting in every page of it again, so the workspace keeps it
+    * (and the filters and worker threads) alive across searches.  On Linux
+    * it can be backed by explicit (MAP_HUGETLB) or transparent huge pages
+    * to cut the TLB misses of the random bucket writes. */
+
+   #define HUGE_PAGE_SIZE (2*1024*1024)
+   #define SMALL_PAGE_SIZE 4096
+
+   uint64_t *allocate_hash_store(size_t size, momentum_workspace::huge_page_mode requested, bool prefault,
+                                 momentum_workspace::huge_page_mode &obtained, bool &mapped)
    {
-      std::vector< std::pair<uint32_t,uint32_t> > results;
+      obtained = momentum_workspace::no_huge_pages;
+      mapped   = false;
+      void *store = NULL;
+
+#ifdef __linux__
+      if (requested != momentum_workspace::no_huge_pages) {
+         size = (size + HUGE_PAGE_SIZE - 1) & ~size_t(HUGE_PAGE_SIZE - 1);
+         if (requested == momentum_workspace::explicit_huge_pages) {
+            store = mmap(NULL, size, PROT_READ|PROT_WRITE,
+                         MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|(prefault ? MAP_POPULATE : 0), -1, 0);
+            if (store != MAP_FAILED) {
+               obtained = momentum_workspace::explicit_huge_pages;
+               mapped   = true;
+               return (uint64_t *)store;
+            }
+            wlog( "unable to map ${size} bytes of explicit huge pages for momentum, falling back to transparent huge pages", ("size",size) );
+         }
+         store = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+         if (store == MAP_FAILED) {
+            return NULL;
+         }
+         mapped = true;
+         if (madvise(store, size, MADV_HUGEPAGE) == 0) {
+            obtained = momentum_workspace::transparent_huge_pages;
+         }
+      }
+#endif
+      if (!store) {
+         store = malloc(size);
+         if (!store) {
+            return NULL;
+         }
+      }
 
-      uint32_t *filter = allocate_filter();
-      if (!filter) {
-            printf("Could not allocate filter for mining\n");
-            return results;
+      /* touch every page now so that searches never take a page fault */
+      if (prefault) {
+         for (size_t offset = 0; offset < size; offset += SMALL_PAGE_SIZE) {
+            ((volatile char *)store)[offset] = 0;
+         }
       }
-      uint32_t hashStoreSize = MAX_MOMENTUM_NONCE * sizeof(uint64_t);
-      /* inter-partition margin of 3% plus a little extra at the end for
-       * paranoia.  Missing things is OK 1 in a billion times, but 
-       * crashing isn't, so the extra 1/64th at the end pushes the
-       * probability of overrun down into the infestisimally small range.
-       */
-
-      hashStoreSize += ((hashStoreSize >> 5) + (hashStoreSize >> 6));
-      uint64_t *hashStore = (uint64_t *)malloc(hashStoreSize);
-      if (!hashStore) {
-            free_filter(filter);
-            printf("Could not allocate hashStore for mining\n");
-            return results;
+      return (uint64_t *)store;
+   }
+
+   namespace detail
+   {
+      class momentum_workspace_impl
+      {
+         public:
+            momentum_workspace_impl()
+            :_num_threads(1),_huge_pages(momentum_workspace::no_huge_pages),
+             _hash_store(NULL),_hash_store_size(0),_hash_store_mapped(false),
+             _slot_size(0),_partition_stride(0){}
+
+            ~momentum_workspace_impl()
+            {
+               for (auto f : _filters) free_filter(f);
+               if (_hash_store) {
+#ifdef __linux__
+                  if (_hash_store_mapped) {
+                     munmap(_hash_store, _hash_store_size);
+                  } else
+#endif
+                  free(_hash_store);
+               }
+            }
+
+            uint32_t                                    _num_threads;
+            momentum_workspace::huge_page_mode          _huge_pages;
+            uint64_t*                                   _hash_store;
+            size_t                                      _hash_store_size;
+            bool                                        _hash_store_mapped;
+
+            /* hashStore is laid out as [partition][thread][slot], with one
+             * thread this is the original partition_offset() layout */
+            uint32_t                                    _slot_size;
+            uint32_t                                    _partition_stride;
+
+            /* counts and limits are indexed by [thread][partition] */
+            std::vector<uint32_t>                       _hash_counts;
+            std::vector<uint32_t>                       _hash_limits;
+            std::vector<uint32_t*>                      _filters;
+            std::vector< std::unique_ptr<fc::thread> >  _threads;
+            momentum_search_stats                       _last_search;
+            /* running total of nonces hashed by each thread, read while searching */
+            std::unique_ptr< std::atomic<uint64_t>[] >  _nonces_hashed;
+
+            void reset_counts()
+            {
+               for (uint32_t t = 0; t < _num_threads; t++) {
+                  for (uint32_t i = 0; i < NUM_PARTITIONS; i++) {
+                     _hash_counts[t*NUM_PARTITIONS + i] = i*_partition_stride + t*_slot_size;
+                     _hash_limits[t*NUM_PARTITIONS + i] = _hash_counts[t*NUM_PARTITIONS + i] + _slot_size;
+                  }
+               }
+            }
+
+            std::vector< std::pair<uint32_t,uint32_t> > search( const pow_seed_type& head,
+                                                                const momentum_workspace::cancel_check& canceled )
+            {
+               std::vector< std::pair<uint32_t,uint32_t> > results;
+               reset_counts();
+               _last_search = momentum_search_stats();
+               _last_search.thread_hash_rates.resize( _num_threads );
+
+               auto start = fc::time_point::now();
+               if (_num_threads == 1) {
+                  if (!generate_hashes(head, _hash_store, _hash_counts.data(), canceled, _nonces_hashed[0])) {
+                     _last_search.canceled = true;
+                     return results;
+                  }
+                  auto hashed = fc::time_point::now();
+                  _last_search.thread_hash_rates[0] = per_second( MAX_MOMENTUM_NONCE, hashed - start );
+                  for (uint32_t i = 0; i < NUM_PARTITIONS; i++) {
+                     if (canceled && i % 64 == 0 && canceled()) {
+                        _last_search.canceled = true;
+                        return std::vector< std::pair<uint32_t,uint32_t> >();
+                     }
+                     uint32_t binStart = partition_offset(i);
+                     uint32_t binCount = _hash_counts[i] - binStart;
+                     find_duplicates(_hash_store+binStart, binCount, results, _filters[0], head);
+                  }
+                  record_stats( start, hashed, results );
+                  return results;
+               }
+
+               uint64_t *hashStore        = _hash_store;
+               uint32_t  slot_size        = _slot_size;
+               uint32_t  partition_stride = _partition_stride;
+               uint32_t  num_threads      = _num_threads;
+
+               /* nonce ranges must start on a multiple of BIRTHDAYS_PER_HASH */
+               uint32_t nonces_per_thread = (MAX_MOMENTUM_NONCE / num_threads) & ~(BIRTHDAYS_PER_HASH-1);
+               std::vector< fc::future<bool> > hashing_complete;
+               for (uint32_t t = 0; t < num_threads; t++) {
+                  uint32_t first = t * nonces_per_thread;
+                  uint32_t last  = (t == num_threads-1) ? MAX_MOMENTUM_NONCE : first + nonces_per_thread;
+                  uint32_t *counts = &_hash_counts[t*NUM_PARTITIONS];
+                  const uint32_t *limits = &_hash_limits[t*NUM_PARTITIONS];
+                  std::atomic<uint64_t>* nonces_hashed = &_nonces_hashed[t];
+                  double* hash_rate = &_last_search.thread_hash_rates[t];
+                  hashing_complete.push_back( _threads[t]->async( [=,&canceled](){
+                     auto thread_start = fc::time_point::now();
+                     if (!generate_hashes_in_range(head, hashStore, counts, limits, first, last, canceled, *nonces_hashed)) {
+                        return false;
+                     }
+                     *hash_rate = per_second( last - first, fc::time_point::now() - thread_start );
+                     return true;
+                  } ) );
+               }
+               bool complete = true;
+               for (auto& f : hashing_complete) complete &= f.wait();
+               if (!complete) {
+                  _last_search.canceled = true;
+                  return results;
+               }
+               auto hashed = fc::time_point::now();
+
+               /* Each thread takes a contiguous range of partitions, moves the slots
+                * of each partition together in nonce order and searches it. */
+               const uint32_t *hashCounts = _hash_counts.data();
+               std::vector< std::vector< std::pair<uint32_t,uint32_t> > > thread_results( num_threads );
+               std::vector< fc::future<void> > search_complete;
+               for (uint32_t t = 0; t < num_threads; t++) {
+                  uint32_t first = (NUM_PARTITIONS * t) / num_threads;
+                  uint32_t last  = (NUM_PARTITIONS * (t+1)) / num_threads;
+                  auto* found    = &thread_results[t];
+                  uint32_t *filter = _filters[t];
+                  search_complete.push_back( _threads[t]->async( [=,&canceled](){
+                     for (uint32_t i = first; i < last; i++) {
+                        if (canceled && (i - first) % 64 == 0 && canceled()) {
+                           found->clear();
+                           return;
+                        }
+                        uint32_t binStart = i*partition_stride;
+                        uint32_t binCount = hashCounts[i] - binStart;
+                        for (uint32_t s = 1; s < num_threads; s++) {
+                           uint32_t slotStart = binStart + s*slot_size;
+                           uint32_t slotCount = hashCounts[s*NUM_PARTITIONS + i] - slotStart;
+                           memmove(hashStore+binStart+binCount, hashStore+slotStart, slotCount*sizeof(uint64_t));
+                           binCount += slotCount;
+                        }
+                        find_duplicates(hashStore+binStart, binCount, *found, filter, head);
+                     }
+                  } ) );
+               }
+               for (auto& f : search_complete) f.wait();
+               if (canceled && canceled()) {
+                  _last_search.canceled = true;
+                  return results;
+               }
+
+               for (auto& found : thread_results) {
+                  results.insert( results.end(), found.begin(), found.end() );
+               }
+               record_stats( start, hashed, results );
+               return results;
+            }
+
+            static double per_second( uint64_t count, const fc::microseconds& elapsed )
+            {
+               if (elapsed.count() <= 0) return 0;
+               return double(count) * 1000000 / elapsed.count();
+            }
+
+            void record_stats( const fc::time_point& start, const fc::time_point& hashed,
+                               const std::vector< std::pair<uint32_t,uint32_t> >& results )
+            {
+               _last_search.nonces       = MAX_MOMENTUM_NONCE;
+               _last_search.partitions   = NUM_PARTITIONS;
+               _last_search.collisions   = results.size();
+               _last_search.hash_time_us = (hashed - start).count();
+               _last_search.scan_time_us = (fc::time_point::now() - hashed).count();
+            }
+      };
+   } // detail
+
+   momentum_workspace::momentum_workspace( uint32_t num_threads, huge_page_mode huge_pages, bool prefault )
+   :my( new detail::momentum_workspace_impl() )
+   {
+      my->_num_threads = std::max<uint32_t>( 1, std::min<uint32_t>( num_threads, MOMENTUM_MAX_SEARCH_THREADS ) );
+
+      for (uint32_t t = 0; t < my->_num_threads; t++) {
+         uint32_t *filter = allocate_filter();
+         if (!filter) {
+            FC_THROW_EXCEPTION( exception, "Could not allocate filter for mining" );
+         }
+         my->_filters.push_back(filter);
       }
 
-      static const int NUM_PARTITIONS = (1<<PARTITION_BITS);
-      uint32_t hashCounts[NUM_PARTITIONS];
+      if (my->_num_threads == 1) {
+         my->_slot_size        = partition_offset(1);
+         my->_partition_stride = my->_slot_size;
+         my->_hash_store_size  = MAX_MOMENTUM_NONCE * sizeof(uint64_t);
+         /* inter-partition margin of 3% plus a little extra at the end for
+          * paranoia.  Missing things is OK 1 in a billion times, but 
+          * crashing isn't, so the extra 1/64th at the end pushes the
+          * probability of overrun down into the infestisimally small range.
+          */
+         my->_hash_store_size += ((my->_hash_store_size >> 5) + (my->_hash_store_size >> 6));
+      } else {
+         my->_slot_size        = parallel_slot_size(my->_num_threads);
+         my->_partition_stride = my->_slot_size * my->_num_threads;
+         my->_hash_store_size  = size_t(my->_partition_stride) * NUM_PARTITIONS * sizeof(uint64_t);
+      }
+
+      my->_hash_store = allocate_hash_store( my->_hash_store_size, huge_pages, prefault, my->_huge_pages, my->_hash_store_mapped );
+      if (!my->_hash_store) {
+         FC_THROW_EXCEPTION( exception, "Could not allocate hashStore for mining", ("size",my->_hash_store_size) );
+      }
+      if (my->_hash_store_mapped) {
+         my->_hash_store_size = (my->_hash_store_size + HUGE_PAGE_SIZE - 1) & ~size_t(HUGE_PAGE_SIZE - 1);
+      }
 
-      for (int i = 0; i < NUM_PARTITIONS; i++) { 
-            hashCounts[i] = partition_offset(i);
+      my->_nonces_hashed.reset( new std::atomic<uint64_t>[my->_num_threads] );
+      for (uint32_t t = 0; t < my->_num_threads; t++) {
+         my->_nonces_hashed[t] = 0;
       }
 
-      generate_hashes(head, hashStore, hashCounts);
-      for (uint32_t i = 0; i < NUM_PARTITIONS; i++) {
-	    int binStart = partition_offset(i);
-	    int binCount = hashCounts[i] - binStart;
-	    find_duplicates(hashStore+binStart, binCount, results, filter, head);
+      my->_hash_counts.resize( my->_num_threads * NUM_PARTITIONS );
+      my->_hash_limits.resize( my->_num_threads * NUM_PARTITIONS );
+
+      if (my->_num_threads > 1) {
+         for (uint32_t t = 0; t < my->_num_threads; t++) {
+            my->_threads.emplace_back( new fc::thread( "momentum " + fc::to_string( int64_t(t) ) ) );
+         }
       }
+   }
 
-      free_filter(filter);
-      free(hashStore);
+   momentum_workspace::~momentum_workspace()
+   {
+   }
+
+   std::vector< std::pair<uint32_t,uint32_t> > momentum_workspace::search( const pow_seed_type& head )
+   {
+      return my->search( head, cancel_check() );
+   }
+
+   std::vector< std::pair<uint32_t,uint32_t> > momentum_workspace::search( const pow_seed_type& head, const cancel_check& canceled )
+   {
+      return my->search( head, canceled );
+   }
+
+   uint64_t momentum_workspace::get_nonces_hashed( uint32_t thread )const
+   {
+      FC_ASSERT( thread < my->_num_threads );
+      return my->_nonces_hashed[thread];
+   }
+
+   const momentum_search_stats& momentum_workspace::get_last_search_stats()const
+   {
+      return my->_last_search;
+   }
 
-      return results;
+   uint32_t momentum_workspace::get_num_threads()const
+   {
+      return my->_num_threads;
    }
 
+   momentum_workspace::huge_page_mode momentum_workspace::get_huge_page_mode()const
+   {
+      return my->_huge_pages;
+   }
+
+   
+   std::vector< std::pair<uint32_t,uint32_t> > momentum_search( pow_seed_type head )
+   {
+      return momentum_search( head, 1 );
+   }
+
+   std::vector< std::pair<uint32_t,uint32_t> > momentum_search( pow_seed_type head, uint32_t num_threads )
+   {
+      try {
+         momentum_workspace workspace( num_threads, momentum_workspace::no_huge_pages, false );
+         return workspace.search( head );
+      } 
+      catch ( const fc::exception& e )
+      {
+         elog( "${e}", ("e",e.to_detail_string()) );
+         return std::vector< std::pair<uint32_t,uint32_t> >();
+      }
+   }
 
    bool momentum_verify( pow_seed_type head, uint32_t a, uint32_t b )
    {
@@ -0,0 +1,320 @@
+#include <bts/blockchain/momentum.hpp>
+#include <fc/crypto/sha512.hpp>
+#include <fc/exception/exception.hpp>
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define MOMENTUM_X86_KERNELS 1
+#  include <immintrin.h>
+#endif
+
+/**
+ *  Momentum hashes sha512( nonce, seed ) where nonce is a 4 byte integer and
+ *  seed is 32 bytes.  The 36 byte message always fits in a single 128 byte
+ *  SHA-512 block and only the first message word depends upon the nonce, so
+ *  the padding and the other 15 words are built once per seed and the
+ *  compression function is run directly for several nonces at once.
+ */
+
+namespace bts { namespace blockchain {
+
+   namespace
+   {
+      const uint64_t sha512_k[80] = {
+         0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+         0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+         0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+         0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+         0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+         0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+         0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+         0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+         0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+         0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+         0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+         0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+         0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+         0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+         0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+         0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+         0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+         0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+         0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+         0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+      };
+
+      const uint64_t sha512_init[8] = {
+         0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+         0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+      };
+
+      /** message words 1..15 are fixed for a given seed, word 0 holds the seed prefix */
+      using detail::momentum_block;
+
+      inline uint64_t load_be64( const unsigned char* p )
+      {
+         return (uint64_t(p[0]) << 56) | (uint64_t(p[1]) << 48) | (uint64_t(p[2]) << 40) | (uint64_t(p[3]) << 32) |
+                (uint64_t(p[4]) << 24) | (uint64_t(p[5]) << 16) | (uint64_t(p[6]) << 8)  |  uint64_t(p[7]);
+      }
+
+      inline void store_be64( unsigned char* p, uint64_t v )
+      {
+         for( int i = 7; i >= 0; --i ) { p[i] = (unsigned char)v; v >>= 8; }
+      }
+
+      void prepare_block( const pow_seed_type& head, momentum_block& blk )
+      {
+         unsigned char msg[128];
+         memset( msg, 0, sizeof(msg) );
+         memcpy( msg + sizeof(uint32_t), (const char*)&head, sizeof(head) );
+         msg[sizeof(uint32_t) + sizeof(head)] = 0x80;
+         // message length in bits, big endian in the last 16 bytes
+         store_be64( msg + 120, uint64_t(sizeof(uint32_t) + sizeof(head)) * 8 );
+
+         for( int i = 0; i < 16; ++i )
+            blk.w[i] = load_be64( msg + 8*i );
+         blk.seed_word0 = blk.w[0];
+      }
+
+      /** the nonce is hashed as it is laid out in memory, exactly as sha512::encoder::write does */
+      inline uint64_t nonce_word( const momentum_block& blk, uint32_t nonce )
+      {
+         const unsigned char* p = (const unsigned char*)&nonce;
+         return blk.seed_word0 | (uint64_t(p[0]) << 56) | (uint64_t(p[1]) << 48) | (uint64_t(p[2]) << 40) | (uint64_t(p[3]) << 32);
+      }
+
+      inline void store_result( const uint64_t* state, fc::sha512& out )
+      {
+         unsigned char* p = (unsigned char*)out._hash;
+         for( int i = 0; i < 8; ++i )
+            store_be64( p + 8*i, state[i] + sha512_init[i] );
+      }
+
+      #define ROTR64(x,n)  (((x) >> (n)) | ((x) << (64-(n))))
+
+      void hash_blocks_scalar( const momentum_block& blk, uint32_t first_nonce, uint32_t count, fc::sha512* results )
+      {
+         for( uint32_t b = 0; b < count; ++b )
+         {
+            uint64_t w[80];
+            memcpy( w, blk.w, sizeof(blk.w) );
+            w[0] = nonce_word( blk, first_nonce + b * BIRTHDAYS_PER_HASH );
+            for( int i = 16; i < 80; ++i )
+            {
+               uint64_t s0 = ROTR64(w[i-15],1) ^ ROTR64(w[i-15],8) ^ (w[i-15] >> 7);
+               uint64_t s1 = ROTR64(w[i-2],19) ^ ROTR64(w[i-2],61) ^ (w[i-2] >> 6);
+               w[i] = w[i-16] + s0 + w[i-7] + s1;
+            }
+
+            uint64_t s[8];
+            memcpy( s, sha512_init, sizeof(s) );
+            for( int i = 0; i < 80; ++i )
+            {
+               uint64_t S1  = ROTR64(s[4],14) ^ ROTR64(s[4],18) ^ ROTR64(s[4],41);
+               uint64_t ch  = (s[4] & s[5]) ^ (~s[4] & s[6]);
+               uint64_t t1  = s[7] + S1 + ch + sha512_k[i] + w[i];
+               uint64_t S0  = ROTR64(s[0],28) ^ ROTR64(s[0],34) ^ ROTR64(s[0],39);
+               uint64_t maj = (s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]);
+               s[7] = s[6]; s[6] = s[5]; s[5] = s[4];
+               s[4] = s[3] + t1;
+               s[3] = s[2]; s[2] = s[1]; s[1] = s[0];
+               s[0] = t1 + S0 + maj;
+            }
+            store_result( s, results[b] );
+         }
+      }
+
+#ifdef MOMENTUM_X86_KERNELS
+
+      // some gcc versions warn about the intentionally undefined pass-through operand of the avx512 intrinsics
+      #pragma GCC diagnostic push
+      #pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+      #define AVX2_ROTR(x,n)  _mm256_or_si256( _mm256_srli_epi64(x,n), _mm256_slli_epi64(x,64-(n)) )
+
+      /** hashes 4 nonce blocks per iteration, one per 64 bit lane */
+      __attribute__((target("avx2")))
+      void hash_blocks_avx2( const momentum_block& blk, uint32_t first_nonce, uint32_t count, fc::sha512* results )
+      {
+         uint32_t b = 0;
+         for( ; b + 4 <= count; b += 4 )
+         {
+            __m256i w[80];
+            w[0] = _mm256_set_epi64x( nonce_word( blk, first_nonce + (b+3) * BIRTHDAYS_PER_HASH ),
+                                      nonce_word( blk, first_nonce + (b+2) * BIRTHDAYS_PER_HASH ),
+                                      nonce_word( blk, first_nonce + (b+1) * BIRTHDAYS_PER_HASH ),
+                                      nonce_word( blk, first_nonce + (b+0) * BIRTHDAYS_PER_HASH ) );
+            for( int i = 1; i < 16; ++i )
+               w[i] = _mm256_set1_epi64x( blk.w[i] );
+            for( int i = 16; i < 80; ++i )
+            {
+               __m256i s0 = _mm256_xor_si256( _mm256_xor_si256( AVX2_ROTR(w[i-15],1), AVX2_ROTR(w[i-15],8) ), _mm256_srli_epi64(w[i-15],7) );
+               __m256i s1 = _mm256_xor_si256( _mm256_xor_si256( AVX2_ROTR(w[i-2],19), AVX2_ROTR(w[i-2],61) ), _mm256_srli_epi64(w[i-2],6) );
+               w[i] = _mm256_add_epi64( _mm256_add_epi64( w[i-16], s0 ), _mm256_add_epi64( w[i-7], s1 ) );
+            }
+
+            __m256i s[8];
+            for( int i = 0; i < 8; ++i )
+               s[i] = _mm256_set1_epi64x( sha512_init[i] );
+            for( int i = 0; i < 80; ++i )
+            {
+               __m256i S1  = _mm256_xor_si256( _mm256_xor_si256( AVX2_ROTR(s[4],14), AVX2_ROTR(s[4],18) ), AVX2_ROTR(s[4],41) );
+               __m256i ch  = _mm256_xor_si256( _mm256_and_si256( s[4], s[5] ), _mm256_andnot_si256( s[4], s[6] ) );
+               __m256i t1  = _mm256_add_epi64( _mm256_add_epi64( s[7], S1 ),
+                                               _mm256_add_epi64( _mm256_add_epi64( ch, w[i] ), _mm256_set1_epi64x( sha512_k[i] ) ) );
+               __m256i S0  = _mm256_xor_si256( _mm256_xor_si256( AVX2_ROTR(s[0],28), AVX2_ROTR(s[0],34) ), AVX2_ROTR(s[0],39) );
+               __m256i maj = _mm256_or_si256( _mm256_and_si256( s[0], s[1] ), _mm256_and_si256( s[2], _mm256_or_si256( s[0], s[1] ) ) );
+               s[7] = s[6]; s[6] = s[5]; s[5] = s[4];
+               s[4] = _mm256_add_epi64( s[3], t1 );
+               s[3] = s[2]; s[2] = s[1]; s[1] = s[0];
+               s[0] = _mm256_add_epi64( t1, _mm256_add_epi64( S0, maj ) );
+            }
+
+            uint64_t lanes[8][4];
+            for( int i = 0; i < 8; ++i )
+               _mm256_storeu_si256( (__m256i*)lanes[i], s[i] );
+            for( int l = 0; l < 4; ++l )
+            {
+               uint64_t state[8];
+               for( int i = 0; i < 8; ++i ) state[i] = lanes[i][l];
+               store_result( state, results[b+l] );
+            }
+         }
+         if( b < count )
+            hash_blocks_scalar( blk, first_nonce + b * BIRTHDAYS_PER_HASH, count - b, results + b );
+      }
+
+      /** hashes 8 nonce blocks per iteration, one per 64 bit lane */
+      __attribute__((target("avx512f")))
+      void hash_blocks_avx512( const momentum_block& blk, uint32_t first_nonce, uint32_t count, fc::sha512* results )
+      {
+         uint32_t b = 0;
+         for( ; b + 8 <= count; b += 8 )
+         {
+            __m512i w[80];
+            w[0] = _mm512_set_epi64( nonce_word( blk, first_nonce + (b+7) * BIRTHDAYS_PER_HASH ),
+                                     nonce_word( blk, first_nonce + (b+6) * BIRTHDAYS_PER_HASH ),
+                                     nonce_word( blk, first_nonce + (b+5) * BIRTHDAYS_PER_HASH ),
+                                     nonce_word( blk, first_nonce + (b+4) * BIRTHDAYS_PER_HASH ),
+                                     nonce_word( blk, first_nonce + (b+3) * BIRTHDAYS_PER_HASH ),
+                                     nonce_word( blk, first_nonce + (b+2) * BIRTHDAYS_PER_HASH ),
+                                     nonce_word( blk, first_nonce + (b+1) * BIRTHDAYS_PER_HASH ),
+                                     nonce_word( blk, first_nonce + (b+0) * BIRTHDAYS_PER_HASH ) );
+            for( int i = 1; i < 16; ++i )
+               w[i] = _mm512_set1_epi64( blk.w[i] );
+            for( int i = 16; i < 80; ++i )
+            {
+               __m512i s0 = _mm512_ternarylogic_epi64( _mm512_ror_epi64(w[i-15],1), _mm512_ror_epi64(w[i-15],8), _mm512_srli_epi64(w[i-15],7), 0x96 );
+               __m512i s1 = _mm512_ternarylogic_epi64( _mm512_ror_epi64(w[i-2],19), _mm512_ror_epi64(w[i-2],61), _mm512_srli_epi64(w[i-2],6), 0x96 );
+               w[i] = _mm512_add_epi64( _mm512_add_epi64( w[i-16], s0 ), _mm512_add_epi64( w[i-7], s1 ) );
+            }
+
+            __m512i s[8];
+            for( int i = 0; i < 8; ++i )
+               s[i] = _mm512_set1_epi64( sha512_init[i] );
+            for( int i = 0; i < 80; ++i )
+            {
+               // 0x96 is a ^ b ^ c, 0xca is a ? b : c, 0xe8 is majority( a, b, c )
+               __m512i S1  = _mm512_ternarylogic_epi64( _mm512_ror_epi64(s[4],14), _mm512_ror_epi64(s[4],18), _mm512_ror_epi64(s[4],41), 0x96 );
+               __m512i ch  = _mm512_ternarylogic_epi64( s[4], s[5], s[6], 0xca );
+               __m512i t1  = _mm512_add_epi64( _mm512_add_epi64( s[7], S1 ),
+                                               _mm512_add_epi64( _mm512_add_epi64( ch, w[i] ), _mm512_set1_epi64( sha512_k[i] ) ) );
+               __m512i S0  = _mm512_ternarylogic_epi64( _mm512_ror_epi64(s[0],28), _mm512_ror_epi64(s[0],34), _mm512_ror_epi64(s[0],39), 0x96 );
+               __m512i maj = _mm512_ternarylogic_epi64( s[0], s[1], s[2], 0xe8 );
+               s[7] = s[6]; s[6] = s[5]; s[5] = s[4];
+               s[4] = _mm512_add_epi64( s[3], t1 );
+               s[3] = s[2]; s[2] = s[1]; s[1] = s[0];
+               s[0] = _mm512_add_epi64( t1, _mm512_add_epi64( S0, maj ) );
+            }
+
+            uint64_t lanes[8][8];
+            for( int i = 0; i < 8; ++i )
+               _mm512_storeu_si512( (void*)lanes[i], s[i] );
+            for( int l = 0; l < 8; ++l )
+            {
+               uint64_t state[8];
+               for( int i = 0; i < 8; ++i ) state[i] = lanes[i][l];
+               store_result( state, results[b+l] );
+            }
+         }
+         if( b < count )
+            hash_blocks_avx2( blk, first_nonce + b * BIRTHDAYS_PER_HASH, count - b, results + b );
+      }
+
+      #pragma GCC diagnostic pop
+
+#endif // MOMENTUM_X86_KERNELS
+
+      momentum_kernel_type detect_momentum_kernel()
+      {
+#ifdef MOMENTUM_X86_KERNELS
+         __builtin_cpu_init();
+         if( __builtin_cpu_supports( "avx512f" ) ) return avx512_momentum_kernel;
+         if( __builtin_cpu_supports( "avx2" ) )    return avx2_momentum_kernel;
+#endif
+         return scalar_momentum_kernel;
+      }
+   } // anonymous namespace
+
+   bool momentum_kernel_supported( momentum_kernel_type kernel )
+   {
+      switch( kernel )
+      {
+         case scalar_momentum_kernel:
+            return true;
+#ifdef MOMENTUM_X86_KERNELS
+         case avx2_momentum_kernel:
+            return __builtin_cpu_supports( "avx2" ) != 0;
+         case avx512_momentum_kernel:
+            // the avx512 kernel finishes partial batches with the avx2 kernel
+            return __builtin_cpu_supports( "avx512f" ) && __builtin_cpu_supports( "avx2" );
+#endif
+         default:
+            return false;
+      }
+   }
+
+   momentum_kernel_type best_momentum_kernel()
+   {
+      static const momentum_kernel_type best = detect_momentum_kernel();
+      return best;
+   }
+
+   momentum_hasher::momentum_hasher( momentum_kernel_type kernel, const pow_seed_type& head )
+   :_kernel( kernel )
+   {
+      FC_ASSERT( momentum_kernel_supported( kernel ) );
+      prepare_block( head, _block );
+   }
+
+   void momentum_hasher::hash_blocks( uint32_t first_nonce, uint32_t count, fc::sha512* results )const
+   {
+      switch( _kernel )
+      {
+#ifdef MOMENTUM_X86_KERNELS
+         case avx512_momentum_kernel:
+            hash_blocks_avx512( _block, first_nonce, count, results );
+            return;
+         case avx2_momentum_kernel:
+            hash_blocks_avx2( _block, first_nonce, count, results );
+            return;
+#endif
+         default:
+            hash_blocks_scalar( _block, first_nonce, count, results );
+      }
+   }
+
+   void momentum_hash_blocks( momentum_kernel_type kernel, const pow_seed_type& head,
+                              uint32_t first_nonce, uint32_t count, fc::sha512* results )
+   {
+      FC_ASSERT( first_nonce % BIRTHDAYS_PER_HASH == 0 );
+      momentum_hasher( kernel, head ).hash_blocks( first_nonce, count, results );
+   }
+
+   void momentum_hash_blocks( const pow_seed_type& head, uint32_t first_nonce, uint32_t count, fc::sha512* results )
+   {
+      momentum_hash_blocks( best_momentum_kernel(), head, first_nonce, count, results );
+   }
+
+} } // bts::blockchain
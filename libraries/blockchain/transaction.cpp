@@ -1,13 +1,73 @@
 #include <bts/blockchain/address.hpp>
 #include <bts/blockchain/transaction.hpp>
 #include <bts/blockchain/small_hash.hpp>
+#include <bts/blockchain/config.hpp>
 #include <fc/reflect/variant.hpp>
 #include <fc/io/raw.hpp>
 
 #include <fc/log/logger.hpp>
 
+#include <mutex>
+#include <unordered_map>
+
 namespace bts { namespace blockchain {
 
+   namespace detail
+   {
+      struct sha256_hasher
+      {
+         size_t operator()( const fc::sha256& h )const { return size_t( h._hash[0] ); }
+      };
+
+      /**
+       *  Keys recovered from signatures, keyed by the hash of the signature and the digest it
+       *  signs.  Shared by all threads, the cache is emptied when it fills up.
+       */
+      class signature_cache
+      {
+         public:
+            bool fetch( const fc::sha256& sig_hash, fc::ecc::public_key& key )
+            {
+               std::lock_guard<std::mutex> lock( _mutex );
+               auto itr = _keys.find( sig_hash );
+               if( itr == _keys.end() )
+                  return false;
+               key = itr->second;
+               return true;
+            }
+
+            void store( const fc::sha256& sig_hash, const fc::ecc::public_key& key )
+            {
+               std::lock_guard<std::mutex> lock( _mutex );
+               if( _keys.size() >= BTS_BLOCKCHAIN_SIGNATURE_CACHE_SIZE )
+                  _keys.clear();
+               _keys[sig_hash] = key;
+            }
+
+         private:
+            std::mutex                                                          _mutex;
+            std::unordered_map<fc::sha256,fc::ecc::public_key,sha256_hasher>    _keys;
+      };
+
+      fc::ecc::public_key recover_key( const fc::ecc::compact_signature& sig, const fc::sha256& dig )
+      {
+         static signature_cache cache;
+
+         fc::sha256::encoder enc;
+         fc::raw::pack( enc, sig );
+         fc::raw::pack( enc, dig );
+         fc::sha256 sig_hash = enc.result();
+
+         fc::ecc::public_key key;
+         if( !cache.fetch( sig_hash, key ) )
+         {
+            key = fc::ecc::public_key( sig, dig );
+            cache.store( sig_hash, key );
+         }
+         return key;
+      }
+   } // namespace detail
+
    fc::sha256 transaction::digest()const
    {
       fc::sha256::encoder enc;
@@ -15,25 +75,35 @@ namespace bts { namespace blockchain {
       return enc.result();
    }
 
-   std::unordered_set<address> signed_transaction::get_signed_addresses()const
+   std::vector<fc::ecc::public_key> signed_transaction::get_signing_keys()const
    {
        auto dig = digest(); 
-       std::unordered_set<address> r;
+       std::vector<fc::ecc::public_key> keys;
+       keys.reserve( sigs.size() );
        for( auto itr = sigs.begin(); itr != sigs.end(); ++itr )
        {
-            r.insert( address(fc::ecc::public_key( *itr, dig )) );
+            keys.push_back( detail::recover_key( *itr, dig ) );
+       }
+       return keys;
+   }
+
+   std::unordered_set<address> signed_transaction::get_signed_addresses()const
+   {
+       std::unordered_set<address> r;
+       for( const auto& key : get_signing_keys() )
+       {
+            r.insert( address( key ) );
        }
        return r;
    }
 
    std::unordered_set<pts_address> signed_transaction::get_signed_pts_addresses()const
    {
-       auto dig = digest(); 
        std::unordered_set<pts_address> r;
        // add both compressed and uncompressed forms...
-       for( auto itr = sigs.begin(); itr != sigs.end(); ++itr )
+       for( const auto& key : get_signing_keys() )
        {
-            auto signed_key_data = fc::ecc::public_key( *itr, dig ).serialize();
+            auto signed_key_data = key.serialize();
             
             // note: 56 is the version bit of protoshares
             r.insert( pts_address(fc::ecc::public_key( signed_key_data),false,56) );
@@ -1,4 +1,7 @@
 #include <algorithm>
+#include <iterator>
+#include <list>
+#include <unordered_map>
 
 #include <bts/client/client.hpp>
 #include <bts/client/messages.hpp>
@@ -14,6 +17,95 @@ namespace bts { namespace client {
 
     namespace detail 
     { 
+       /// total size of the serialized messages kept for answering get_item
+#define BTS_CLIENT_MAX_MESSAGE_CACHE_BYTES (32*1024*1024)
+
+       /**
+        *  Recently accepted or relayed block and transaction messages, already serialized,
+        *  so that peers fetching the chain tip or recent history are served a copy instead
+        *  of a database read and a re-pack.  The least recently used messages are dropped
+        *  once the cache holds more than its byte limit.
+        *
+        *  Messages are found by the item id the node asks for, the hash of the message
+        *  itself.  A message can also be given an alias: blocks are fetched by block id
+        *  while syncing, and transactions are dropped by transaction id once confirmed.
+        */
+       class message_cache
+       {
+          public:
+            message_cache( size_t max_bytes = BTS_CLIENT_MAX_MESSAGE_CACHE_BYTES )
+            :_max_bytes(max_bytes),_bytes(0){}
+
+            void store( const bts::net::message& msg, const bts::net::item_id& alias )
+            {
+               bts::net::item_id id = message_item_id( msg );
+               auto itr = _index.find( id );
+               if( itr != _index.end() )
+               {
+                  _entries.splice( _entries.begin(), _entries, itr->second );
+                  return;
+               }
+               // a received message still points into its socket's receive buffer
+               entry new_entry = { id, alias, msg };
+               new_entry.msg.own_payload();
+               _entries.push_front( std::move( new_entry ) );
+               _index[id]    = _entries.begin();
+               _index[alias] = _entries.begin();
+               _bytes += msg.size;
+               while( _bytes > _max_bytes && _entries.size() > 1 )
+                  erase_entry( std::prev( _entries.end() ) );
+            }
+
+            /** @return nullptr if the message is not cached under id or as an alias */
+            const bts::net::message* find( const bts::net::item_id& id )
+            {
+               auto itr = _index.find( id );
+               if( itr == _index.end() )
+                  return nullptr;
+               _entries.splice( _entries.begin(), _entries, itr->second );
+               return &itr->second->msg;
+            }
+
+            /** drops the message cached under id or as an alias */
+            void erase( const bts::net::item_id& id )
+            {
+               auto itr = _index.find( id );
+               if( itr == _index.end() )
+                  return;
+               erase_entry( itr->second );
+            }
+
+          private:
+            struct entry
+            {
+               bts::net::item_id id;
+               bts::net::item_id alias;
+               bts::net::message msg;
+            };
+            typedef std::list<entry> entry_list;
+
+            static bts::net::item_id message_item_id( const bts::net::message& msg )
+            {
+               return bts::net::item_id( msg.msg_type, msg.id() );
+            }
+
+            void erase_entry( entry_list::iterator itr )
+            {
+               _bytes -= itr->msg.size;
+               _index.erase( itr->id );
+               // a newer message for the same block may have taken over the alias
+               auto alias_itr = _index.find( itr->alias );
+               if( alias_itr != _index.end() && alias_itr->second == itr )
+                  _index.erase( alias_itr );
+               _entries.erase( itr );
+            }
+
+            size_t                                                       _max_bytes;
+            size_t                                                       _bytes;
+            entry_list                                                   _entries; ///< most recently used first
+            std::unordered_map<bts::net::item_id, entry_list::iterator> _index;
+       };
+
        class client_impl : public bts::net::chain_client_delegate,
                            public bts::net::node_delegate
        {
@@ -35,6 +127,9 @@ namespace bts { namespace client {
 
             void trustee_loop();
             signed_transactions get_pending_transactions() const;
+            bts::net::message   make_block_message( const trx_block& block ) const;
+            void                accept_block( const trx_block& block, const bts::net::message& block_message_to_cache );
+            void                drop_pending_transaction( const transaction_id_type& trx_id );
 
             /* Implement chain_client_impl */
             // @{
@@ -62,6 +157,9 @@ namespace bts { namespace client {
             bts::net::node_ptr                   _p2p_node;
             bts::blockchain::chain_database_ptr  _chain_db;
             std::unordered_map<transaction_id_type, signed_transaction> _pending_trxs;
+            /// the node asks for transactions by message hash, this maps it back to the trx id
+            std::unordered_map<bts::net::item_hash_t, transaction_id_type> _pending_trx_message_ids;
+            message_cache                        _message_cache;
             bts::wallet::wallet_ptr              _wallet;
             float                                _effort;
             fc::future<void>                     _trustee_loop_complete;
@@ -103,24 +201,62 @@ namespace bts { namespace client {
          return trxs;
        }
 
+       bts::net::message client_impl::make_block_message(const trx_block& block) const
+       {
+         block_message message_to_send;
+         message_to_send.block = block;
+         message_to_send.block_id = block.id();
+         message_to_send.signature = block.trustee_signature;
+         return message_to_send;
+       }
+
        ///////////////////////////////////////////////////////
        // Implement chain_client_delegate                   //
        ///////////////////////////////////////////////////////
-       void client_impl::on_new_block(const trx_block& block)
+       void client_impl::accept_block(const trx_block& block, const bts::net::message& block_message_to_cache)
        {
          _chain_db->push_block(block);
+         _message_cache.store(block_message_to_cache, bts::net::item_id(block_message_type, block.id()));
 
          for (auto trx : block.trxs)
-           _pending_trxs.erase(trx.id());
+           drop_pending_transaction(trx.id());
          ilog("");
          _wallet->scan_chain(*_chain_db, block.block_num);
        }
 
+       /**
+        *  Forgets a transaction that was confirmed or dropped, along with its cached message,
+        *  so that confirmed transactions don't crowd blocks out of the message cache.
+        */
+       void client_impl::drop_pending_transaction(const transaction_id_type& trx_id)
+       {
+         auto iter = _pending_trxs.find(trx_id);
+         if (iter == _pending_trxs.end())
+           return;
+         trx_message trx_message_to_drop;
+         trx_message_to_drop.trx = iter->second;
+         _pending_trx_message_ids.erase(bts::net::message(trx_message_to_drop).id());
+         _pending_trxs.erase(iter);
+         _message_cache.erase(bts::net::item_id(trx_message_type, trx_id));
+       }
+
+       void client_impl::on_new_block(const trx_block& block)
+       {
+         accept_block(block, make_block_message(block));
+       }
+
        void client_impl::on_new_transaction(const signed_transaction& trx)
        {
          _chain_db->evaluate_transaction(trx); // throws exception if invalid trx.
          if (_pending_trxs.insert(std::make_pair(trx.id(), trx)).second)
+         {
            ilog("new transaction");
+           trx_message trx_message_to_cache;
+           trx_message_to_cache.trx = trx;
+           bts::net::message message_to_cache(trx_message_to_cache);
+           _pending_trx_message_ids[message_to_cache.id()] = trx.id();
+           _message_cache.store(message_to_cache, bts::net::item_id(trx_message_type, trx.id()));
+         }
          else
            wlog("duplicate transaction, ignoring");
        }
@@ -141,7 +277,8 @@ namespace bts { namespace client {
            {
              block_message block_message_to_handle(message_to_handle.as<block_message>());
              ilog("CLIENT: just received block ${id}", ("id", block_message_to_handle.block_id));
-             on_new_block(block_message_to_handle.block);
+             // serve peers exactly the bytes we were relayed
+             accept_block(block_message_to_handle.block, message_to_handle);
              break;
            }
          case trx_message_type:
@@ -170,60 +307,42 @@ namespace bts { namespace client {
          }
          remaining_item_count = _chain_db->head_block_num() - last_seen_block_num;
          uint32_t items_to_get_this_iteration = std::min(limit, remaining_item_count);
-         std::vector<bts::net::item_hash_t> hashes_to_return;
-         hashes_to_return.reserve(items_to_get_this_iteration);
-         for (uint32_t i = 0; i < items_to_get_this_iteration; ++i)
-         {
-           ++last_seen_block_num;
-           signed_block_header header;
-           try
-           {
-             header = _chain_db->fetch_block(last_seen_block_num);
-           }
-           catch (fc::key_not_found_exception&)
-           {
-             assert(false && "I assume this can never happen");
-           }
-           hashes_to_return.push_back(header.id());
-         }
-         remaining_item_count -= items_to_get_this_iteration;
+         std::vector<bts::net::item_hash_t> hashes_to_return = _chain_db->fetch_block_ids(last_seen_block_num + 1, items_to_get_this_iteration);
+         assert(hashes_to_return.size() == items_to_get_this_iteration);
+         remaining_item_count -= hashes_to_return.size();
          return hashes_to_return;
        }
 
        bts::net::message client_impl::get_item(const bts::net::item_id& id)
        {
-#if 0
-         try
-         {
-           bts::net::message result = _message_cache.get_message(id.item_hash);
-           ilog("get_item() returning message from _message_cache (id: ${item_hash})", ("item_hash", result.id()));
-           ilog("item's real hash is ${hash}", ("hash", fc::ripemd160::hash(&result.data[0], result.data.size())));
-           return result;
-         }
-         catch (const fc::key_not_found_exception&)
-         {
-           // not in our cache.  Either it has already expired from our cache, or
-           // it's a request for an actual block during synchronization.  
-         }
-#endif
+         const bts::net::message* cached_message = _message_cache.find(id);
+         if (cached_message)
+           return *cached_message;
 
+         // not in our cache.  Either it has already expired from our cache, or
+         // it's a request for an older block during synchronization, which asks
+         // by block id rather than by message hash.
          if (id.item_type == block_message_type)
          {
            uint32_t block_number = _chain_db->fetch_block_num(id.item_hash);
-           bts::client::block_message block_message_to_send;
-           block_message_to_send.block = _chain_db->fetch_block(block_number);
-           block_message_to_send.block_id = block_message_to_send.block.id();
-           FC_ASSERT(id.item_hash == block_message_to_send.block_id);
-           block_message_to_send.signature = block_message_to_send.block.trustee_signature;
+           trx_block block = _chain_db->fetch_trx_block(block_number);
+           FC_ASSERT(id.item_hash == block.id());
+           bts::net::message block_message_to_send = make_block_message(block);
+           // several peers usually sync the same blocks from us, so keep it for the next one
+           _message_cache.store(block_message_to_send, id);
            return block_message_to_send;
          }
 
          if (id.item_type == trx_message_type)
          {
-           trx_message trx_message_to_send;
-           auto iter = _pending_trxs.find(id.item_hash);
+           auto id_iter = _pending_trx_message_ids.find(id.item_hash);
+           auto iter = id_iter == _pending_trx_message_ids.end() ? _pending_trxs.end() : _pending_trxs.find(id_iter->second);
            if (iter != _pending_trxs.end())
+           {
+             trx_message trx_message_to_send;
              trx_message_to_send.trx = iter->second;
+             return trx_message_to_send;
+           }
          }
 
          FC_THROW_EXCEPTION(key_not_found_exception, "I don't have the item you're looking for");
@@ -29,6 +29,11 @@ class dns_tx_evaluation_state : public bts::blockchain::transaction_evaluation_s
 class dns_block_evaluation_state : public bts::blockchain::block_evaluation_state
 {
     public:
+        virtual std::shared_ptr<bts::blockchain::block_evaluation_state> clone() const
+        {
+            return std::make_shared<dns_block_evaluation_state>(*this);
+        }
+
         std::vector<std::string> name_pool;
 };
 
@@ -11,6 +11,8 @@ namespace bts { namespace kid
        fc::sha256 digest()const;
        fc::sha256 digest512()const;
        uint64_t   difficulty()const;
+       /** @return difficulty() >= required_difficulty without any big integer division */
+       bool       meets_difficulty( uint64_t required_difficulty )const;
  
        std::string         name;
        fc::ecc::public_key master_key;
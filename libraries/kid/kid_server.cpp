@@ -19,6 +19,12 @@ namespace bts { namespace kid {
       return 1000 * bts::blockchain::difficulty( digest512() );
    }
 
+   bool name_record::meets_difficulty( uint64_t required_difficulty )const
+   {
+      auto target = bts::blockchain::target_from_difficulty( required_difficulty / 1000 + (required_difficulty % 1000 != 0) );
+      return bts::blockchain::meets_target( digest512(), target );
+   }
+
    fc::ecc::public_key signed_name_record::get_signee()const
    {
       return fc::ecc::public_key( master_signature, digest() );
@@ -313,7 +319,7 @@ namespace bts { namespace kid {
       FC_ASSERT( my->_pending.size() < 20000 );
       FC_ASSERT( fc::trim_and_normalize_spaces( r.name ) == r.name );
       FC_ASSERT( fc::to_lower( r.name ) == r.name );
-      FC_ASSERT( r.difficulty() >= my->_current_block.difficulty, "",
+      FC_ASSERT( r.meets_difficulty( my->_current_block.difficulty ), "",
                  ("r.difficulty",r.difficulty())("current_difficulty",my->_current_block.difficulty));
       FC_ASSERT( my->_current_block_id == r.prev_block_id     );
       FC_ASSERT( r.get_signee() == r.master_key );
@@ -5,7 +5,16 @@
 #include <fc/thread/thread.hpp>
 #include <fc/reflect/variant.hpp>
 
+#include <deque>
 #include <iostream>
+#include <unordered_map>
+
+/** sync blocks we let the server send ahead of the block we are applying */
+#define BTS_NET_CHAIN_SYNC_CREDIT_WINDOW 64
+/** pending trxs kept to rebuild compact blocks, the oldest are dropped first */
+#define BTS_NET_CHAIN_MAX_PENDING_TRXS          10000
+/** a pending trx not seen in a block for this long is dropped */
+#define BTS_NET_CHAIN_PENDING_TRX_EXPIRATION_SEC (60*60)
 
 
 using namespace bts::blockchain;
@@ -24,24 +33,215 @@ namespace bts { namespace net {
             {
                auto blkmsg = m.as<block_message>();
                ilog( "received block num ${n}", ("n",blkmsg.block_data.block_num) );
-               _delegate->on_new_block( blkmsg.block_data );
+               on_new_block( blkmsg.block_data );
+            }
+            else if( m.msg_type == compact_block_message::type )
+            {
+               auto blkmsg = m.as<compact_block_message>();
+               ilog( "received compact block num ${n}", ("n",blkmsg.block_data.block_num) );
+               _compact_blocks.push_back( blkmsg.block_data );
+               // blocks must be applied in order, so later blocks wait behind one
+               // that is still missing trxs
+               if( _compact_blocks.size() == 1 )
+                  process_compact_blocks();
+            }
+            else if( m.msg_type == block_trxs_message::type )
+            {
+               try {
+                  on_block_trxs( m.as<block_trxs_message>() );
+               }
+               catch ( const fc::exception& e )
+               {
+                  wlog( "unable to complete compact block, resubscribing ${e}", ("e", e.to_detail_string() ) );
+                  resubscribe();
+               }
             }
             else if( m.msg_type == trx_message::type )
             {
                auto trx_msg = m.as<trx_message>();
                ilog( "received message ${m}", ("m",trx_msg) );
                _delegate->on_new_transaction( trx_msg.signed_trx );
+               add_pending_trx( trx_msg.signed_trx );
+            }
+            else if( m.msg_type == trxs_message::type )
+            {
+               auto trxs_msg = m.as<trxs_message>();
+               ilog( "received ${n} transactions", ("n",trxs_msg.trxs.size()) );
+               for( const auto& trx : trxs_msg.trxs )
+               {
+                  // one bad trx shouldn't cost us the rest of the batch
+                  try {
+                     _delegate->on_new_transaction( trx );
+                     add_pending_trx( trx );
+                  }
+                  catch ( const fc::exception& e )
+                  {
+                     wlog( "${e}", ("e", e.to_detail_string() ) );
+                  }
+               }
             }
             else if( m.msg_type == trx_err_message::type )
             {
                auto errmsg = m.as<trx_err_message>();
                std::cerr<<  errmsg.err <<"\n";
                elog( "${e}", ("e", errmsg ) );
+               // the server rejected it, so it won't be in a block
+               _pending_trxs.erase( errmsg.signed_trx.id() );
             }
         }
         
+        void on_new_block( const trx_block& blk )
+        {
+            _delegate->on_new_block( blk );
+            for( const auto& trx : blk.trxs )
+               _pending_trxs.erase( trx.id() );
+            grant_sync_credit();
+        }
+
+        /**
+         *  Called after each block is applied, tops the server's credit back up to the
+         *  window once half of it has been used.
+         */
+        void grant_sync_credit()
+        {
+            if( _sync_credit_outstanding )
+               --_sync_credit_outstanding;
+            if( _chain_connected && _sync_credit_outstanding <= BTS_NET_CHAIN_SYNC_CREDIT_WINDOW / 2 )
+            {
+               _chain_con.send( message( sync_credit_message( BTS_NET_CHAIN_SYNC_CREDIT_WINDOW - _sync_credit_outstanding ) ) );
+               _sync_credit_outstanding = BTS_NET_CHAIN_SYNC_CREDIT_WINDOW;
+            }
+        }
+
+        void add_pending_trx( const signed_transaction& trx )
+        {
+            pending_trx& pending = _pending_trxs[trx.id()];
+            if( pending.received != fc::time_point() )
+               return;
+            pending.trx      = trx;
+            pending.received = fc::time_point::now();
+            _pending_trx_order.push_back( std::make_pair( pending.received, trx.id() ) );
+            expire_pending_trxs();
+        }
+
+        /** drops pending trxs that were never confirmed or rejected, oldest first */
+        void expire_pending_trxs()
+        {
+            auto cutoff = fc::time_point::now() - fc::seconds( BTS_NET_CHAIN_PENDING_TRX_EXPIRATION_SEC );
+            while( _pending_trx_order.size() &&
+                   ( _pending_trx_order.size() > BTS_NET_CHAIN_MAX_PENDING_TRXS || _pending_trx_order.front().first < cutoff ) )
+            {
+               // trxs already confirmed, or confirmed and received again since, are left alone
+               auto itr = _pending_trxs.find( _pending_trx_order.front().second );
+               if( itr != _pending_trxs.end() && itr->second.received == _pending_trx_order.front().first )
+                  _pending_trxs.erase( itr );
+               _pending_trx_order.pop_front();
+            }
+        }
+
+        /** forgets the queued compact blocks and has the server resend every block after our head */
+        void resubscribe()
+        {
+            _compact_blocks.clear();
+            _missing_trx_indexes.clear();
+            if( _chain_connected )
+               subscribe();
+        }
+
+        void subscribe()
+        {
+            subscribe_message msg;
+            msg.version        = BTS_NET_CHAIN_TRX_BATCH_VERSION;
+            if( _chain->head_block_num() != uint32_t(-1) )
+            {
+               msg.last_block     = _chain->head_block_id();
+            }
+            _chain_con.send( message( msg ) );
+            _chain_con.send( message( sync_credit_message( BTS_NET_CHAIN_SYNC_CREDIT_WINDOW ) ) );
+            _sync_credit_outstanding = BTS_NET_CHAIN_SYNC_CREDIT_WINDOW;
+        }
+
+        /**
+         *  Rebuilds the compact blocks at the front of the queue from the pending
+         *  trxs, stopping at the first one that needs trxs from the server.  A block
+         *  that fails to apply takes the blocks queued behind it with it and we
+         *  resubscribe, rather than leaving the queue stuck.
+         */
+        void process_compact_blocks()
+        {
+            while( _compact_blocks.size() )
+            {
+               const digest_block& digest = _compact_blocks.front();
+               _incomplete_block = trx_block( digest );
+               _incomplete_block.trxs.resize( digest.trx_ids.size() );
+
+               get_block_trxs_message request;
+               request.block_id = digest.id();
+               for( uint32_t i = 0; i < digest.trx_ids.size(); ++i )
+               {
+                  auto itr = _pending_trxs.find( digest.trx_ids[i] );
+                  if( itr != _pending_trxs.end() )
+                     _incomplete_block.trxs[i] = itr->second.trx;
+                  else
+                     request.trx_indexes.push_back( i );
+               }
+
+               if( request.trx_indexes.size() )
+               {
+                  ilog( "requesting ${n} of ${t} trxs in block ${b}",
+                        ("n",request.trx_indexes.size())("t",digest.trx_ids.size())("b",digest.block_num) );
+                  _missing_trx_indexes = request.trx_indexes;
+                  _chain_con.send( message( request ) );
+                  return;
+               }
+
+               _compact_blocks.pop_front();
+               try {
+                  on_new_block( _incomplete_block );
+               }
+               catch ( const fc::exception& e )
+               {
+                  wlog( "unable to apply compact block ${b}, resubscribing ${e}",
+                        ("b",_incomplete_block.block_num)("e", e.to_detail_string() ) );
+                  resubscribe();
+                  return;
+               }
+            }
+        }
+
+        void on_block_trxs( const block_trxs_message& msg )
+        {
+            FC_ASSERT( _compact_blocks.size() && _missing_trx_indexes.size() );
+            const digest_block& digest = _compact_blocks.front();
+            FC_ASSERT( msg.block_id == digest.id() );
+            FC_ASSERT( msg.trxs.size() == _missing_trx_indexes.size() );
+
+            for( uint32_t i = 0; i < msg.trxs.size(); ++i )
+            {
+               uint32_t idx = _missing_trx_indexes[i];
+               FC_ASSERT( msg.trxs[i].id() == digest.trx_ids[idx], "unexpected trx for index ${i}", ("i",idx) );
+               _incomplete_block.trxs[idx] = msg.trxs[i];
+            }
+            _missing_trx_indexes.clear();
+            _compact_blocks.pop_front();
+            try {
+               on_new_block( _incomplete_block );
+            }
+            catch ( const fc::exception& e )
+            {
+               wlog( "unable to apply compact block ${b}, resubscribing ${e}",
+                     ("b",_incomplete_block.block_num)("e", e.to_detail_string() ) );
+               resubscribe();
+               return;
+            }
+            process_compact_blocks();
+        }
+
         virtual void on_connection_disconnected( chain_connection& c )
         {
+            // the server resends everything after our head block when we resubscribe
+            _compact_blocks.clear();
+            _missing_trx_indexes.clear();
             start_connect_loop();
         }
         void start_connect_loop()
@@ -64,13 +264,7 @@ namespace bts { namespace net {
                        // TODO: pass public key to connection so we can avoid man-in-the-middle attacks
                        _chain_con.connect( fc::ip::endpoint::from_string(ep) );
 
-                       subscribe_message msg;
-                       msg.version        = 0;
-                       if( _chain->head_block_num() != uint32_t(-1) )
-                       {
-                          msg.last_block     = _chain->head_block_id();
-                       }
-                       _chain_con.send( message( msg ) );
+                       subscribe();
                        // std::cout<< "\rconnected to bitshares network\n";
                        _chain_connected = true;
                        return;
@@ -88,17 +282,33 @@ namespace bts { namespace net {
             }
         }
 
-        chain_client_impl():_delegate(nullptr),_chain_con(this),_chain_connected(false){}
+        chain_client_impl():_delegate(nullptr),_chain_con(this),_chain_connected(false),_sync_credit_outstanding(0){}
 
 
         chain_client_delegate*                                     _delegate;
         chain_connection                                           _chain_con;
         bool                                                       _chain_connected;
+        /** sync blocks we have granted the server credit for and not yet applied */
+        uint32_t                                                   _sync_credit_outstanding;
 
         std::vector<std::string>                                   _unique_node_list;
 
         chain_client_delegate*                                     _chain_client;
         chain_database_ptr                                         _chain;
+
+        struct pending_trx
+        {
+           signed_transaction trx;
+           fc::time_point     received;
+        };
+        /** trxs broadcast by or to us that have not been seen in a block or rejected yet */
+        std::unordered_map<transaction_id_type,pending_trx>        _pending_trxs;
+        /** when each pending trx was received, oldest first, see expire_pending_trxs() */
+        std::deque<std::pair<fc::time_point,transaction_id_type> > _pending_trx_order;
+        /** compact blocks waiting to be applied, the front may be waiting on trxs */
+        std::deque<digest_block>                                   _compact_blocks;
+        trx_block                                                  _incomplete_block;
+        std::vector<uint32_t>                                      _missing_trx_indexes;
         fc::future<void>                                           _chain_connect_loop_complete;
    };
 
@@ -126,7 +336,7 @@ namespace bts { namespace net {
 
   void chain_client::broadcast_transaction( const signed_transaction& trx )
   {
-     // my->_pending_trxs[trx.id()] = trx;
+     my->add_pending_trx( trx );
      my->_chain_con.send( trx_message( trx ) );
   }
 
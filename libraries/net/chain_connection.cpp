@@ -10,39 +10,283 @@
 #include <fc/io/raw.hpp>
 #include <fc/log/logger.hpp>
 #include <fc/string.hpp>
-#include <fc/thread/mutex.hpp>
-#include <fc/thread/scoped_lock.hpp>
 
 #include <unordered_map>
+#include <deque>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <bts/db/level_map.hpp>
+
+/** sync blocks read from the block store at a time */
+#define BTS_NET_CHAIN_SYNC_READ_AHEAD_BLOCKS  32
+/** the sync loop waits while this many bytes are queued, whatever credit the subscriber granted */
+#define BTS_NET_CHAIN_MAX_QUEUED_SYNC_BYTES   (1024*1024)
+
 namespace bts { namespace net {
 
 const chain_message_type subscribe_message::type = chain_message_type::subscribe_msg;
 const chain_message_type block_message::type     = chain_message_type::block_msg;
 const chain_message_type trx_message::type       = chain_message_type::trx_msg;
 const chain_message_type trx_err_message::type   = chain_message_type::trx_err_msg;
+const chain_message_type compact_block_message::type  = chain_message_type::compact_block_msg;
+const chain_message_type get_block_trxs_message::type = chain_message_type::get_block_trxs_msg;
+const chain_message_type block_trxs_message::type     = chain_message_type::block_trxs_msg;
+const chain_message_type sync_credit_message::type    = chain_message_type::sync_credit_msg;
+const chain_message_type trxs_message::type           = chain_message_type::trxs_msg;
 
   namespace detail
   {
      class chain_connection_impl
      {
         public:
-          chain_connection_impl(chain_connection& s)
-          :self(s),con_del(nullptr){}
+          chain_connection_impl(chain_connection& s, fc::thread* io_thread)
+          :self(s),con_del(nullptr),_owner_thread(&fc::thread::current()),_io_thread(io_thread),
+           _remote_version(0),incoming_drain_posted(false),queued_byte_count(0),sync_credit(0),
+           sync_loop_waiting(false){}
           chain_connection&          self;
           stcp_socket_ptr      sock;
           fc::ip::endpoint     remote_ep;
-          chain_connection_delegate* con_del;
+          chain_connection_delegate* con_del; /// only used on _owner_thread
+
+          fc::thread*          _owner_thread; /// the thread that created us, where the delegate and the sync loop run
+          fc::thread*          _io_thread;    /// runs the read and send loops if set, otherwise they run on _owner_thread
+          /** the last message or disconnect handed to _owner_thread, they are handled one at a time */
+          fc::future<void>     _previous_delivery;
+          /** the last time the send loop asked _owner_thread to wake the sync loop */
+          fc::future<void>     _previous_sent_notification;
 
           bts::blockchain::block_id_type   _last_block_id;
+          uint16_t                         _remote_version;
           bts::blockchain::chain_database* chain;
 
-          /** used to ensure that messages are written completely */
-          fc::mutex              write_lock;
+          /**
+           *  Messages sent from other threads wait here for the I/O thread, which takes them all
+           *  at once.  Only the send() that finds the queue idle posts a task to drain it.
+           */
+          /// @{
+          std::mutex                     incoming_mutex;
+          std::deque<framed_message_ptr> incoming_messages;
+          bool                           incoming_drain_posted;
+          /// @}
+
+          /** framed messages waiting to be written, broadcasts share one buffer across connections */
+          std::deque<framed_message_ptr> queued_messages;
+          std::atomic<size_t>    queued_byte_count; /// added to by send(), taken from by the send loop
+          /** the batch being written, reused so it keeps its capacity */
+          std::vector<char>      bytes_being_sent;
+          fc::future<void>       send_loop_complete;
 
 
           fc::future<void>       read_loop_complete;
           fc::future<void>       exec_sync_loop_complete;
+          /** sync blocks the subscriber granted with sync_credit_messages and we have not sent yet */
+          uint32_t               sync_credit;
+          /** the sync loop waits on this for credit or for the send queue to drain */
+          fc::promise<void>::ptr sync_loop_wakeup;
+          /** set while the sync loop waits for the send queue, the send loop only wakes it then */
+          std::atomic<bool>      sync_loop_waiting;
+
+          bool can_send_sync_block()const
+          {
+             if( queued_byte_count >= BTS_NET_CHAIN_MAX_QUEUED_SYNC_BYTES )
+                return false;
+             // older subscribers don't grant credit, they are only limited by the send queue
+             return _remote_version < BTS_NET_CHAIN_SYNC_CREDIT_VERSION || sync_credit > 0;
+          }
+
+          void wake_sync_loop()
+          {
+             if( sync_loop_wakeup && !sync_loop_wakeup->ready() )
+                sync_loop_wakeup->set_value();
+          }
+
+          template <typename Functor>
+          void run_on_io_thread( Functor&& f )
+          {
+             if( _io_thread && !_io_thread->is_current() )
+                _io_thread->async( std::forward<Functor>(f) ).wait();
+             else
+                f();
+          }
+
+          void wait_for_previous_delivery()
+          {
+             if( _previous_delivery.valid() && !_previous_delivery.ready() )
+                _previous_delivery.wait();
+          }
+
+          /**
+           *  With an I/O thread the message is handed to the owner thread, where the chain
+           *  database lives, and we wait for it to be handled before handing over the next
+           *  one, so a slow delegate slows our reading rather than piling up messages.
+           */
+          void deliver_message( message& m )
+          {
+             if( !_io_thread )
+             {
+                con_del->on_connection_message( self, m );
+                return;
+             }
+
+             wait_for_previous_delivery();
+             auto message_to_deliver = std::make_shared<message>( std::move(m) );
+             _previous_delivery = _owner_thread->async( [=]()
+             {
+                if( !con_del )
+                   return;
+                try {
+                   con_del->on_connection_message( self, *message_to_deliver );
+                }
+                catch ( const fc::exception& e )
+                {
+                   wlog( "error handling message ${e}", ("e", e.to_detail_string() ) );
+                }
+             });
+          }
+
+          /** queues the disconnect behind the messages already handed to the owner thread */
+          void notify_disconnected_from_io_thread()
+          {
+             try {
+                wait_for_previous_delivery();
+             } catch ( const fc::exception& ) {}
+             _previous_delivery = _owner_thread->async( [=]()
+             {
+                if( con_del )
+                   con_del->on_connection_disconnected( self );
+             });
+          }
+
+          void notify_queued_messages_sent()
+          {
+             if( !sync_loop_waiting.exchange( false ) )
+                return;
+             if( _io_thread )
+                _previous_sent_notification = _owner_thread->async( [=](){ wake_sync_loop(); } );
+             else
+                wake_sync_loop();
+          }
+
+          /** called from any thread other than the I/O thread */
+          void post_to_io_thread( const framed_message_ptr& framed )
+          {
+             bool post_drain = false;
+             {
+                std::lock_guard<std::mutex> lock( incoming_mutex );
+                incoming_messages.push_back( framed );
+                if( !incoming_drain_posted )
+                   post_drain = incoming_drain_posted = true;
+             }
+             if( post_drain )
+                _io_thread->async( [=](){ drain_incoming_messages(); } );
+          }
+
+          /** moves everything posted by other threads to the send queue, on the I/O thread */
+          void take_incoming_messages()
+          {
+             std::lock_guard<std::mutex> lock( incoming_mutex );
+             std::move( incoming_messages.begin(), incoming_messages.end(), std::back_inserter( queued_messages ) );
+             incoming_messages.clear();
+          }
+
+          void drain_incoming_messages()
+          {
+             {
+                std::lock_guard<std::mutex> lock( incoming_mutex );
+                incoming_drain_posted = false;
+             }
+             take_incoming_messages();
+             start_send_loop();
+          }
+
+          /** called on the I/O thread if there is one */
+          void enqueue( const framed_message_ptr& framed )
+          {
+             // anything posted from other threads was sent first
+             if( _io_thread )
+                take_incoming_messages();
+             queued_messages.push_back( framed );
+             start_send_loop();
+          }
+
+          void start_send_loop()
+          {
+             if( queued_messages.size() && (!send_loop_complete.valid() || send_loop_complete.ready()) )
+                send_loop_complete = fc::async( [=](){ send_loop(); } );
+          }
+
+          void discard_queued_messages()
+          {
+             take_incoming_messages();
+             for( const framed_message_ptr& framed : queued_messages )
+                queued_byte_count -= framed->size();
+             queued_messages.clear();
+          }
+
+          void stop_send_loop()
+          {
+             if( send_loop_complete.valid() && !send_loop_complete.ready() )
+             {
+                send_loop_complete.cancel();
+                try {
+                   send_loop_complete.wait();
+                } catch ( const fc::canceled_exception& ) {}
+             }
+          }
+
+          void stop_sync_loop()
+          {
+             if( exec_sync_loop_complete.valid() && !exec_sync_loop_complete.ready() )
+             {
+                exec_sync_loop_complete.cancel();
+                wake_sync_loop();
+                try {
+                   exec_sync_loop_complete.wait();
+                } catch ( const fc::canceled_exception& ) {}
+             }
+          }
+
+          /**
+           *  Writes everything queued by send() in as few writes as possible, messages
+           *  queued while a write is in progress go out together in the next one.
+           */
+          void send_loop()
+          {
+            try {
+               if( _io_thread )
+                  take_incoming_messages();
+               while( queued_messages.size() )
+               {
+                  bytes_being_sent.clear();
+                  bytes_being_sent.reserve( queued_byte_count );
+                  for( const framed_message_ptr& framed : queued_messages )
+                     bytes_being_sent.insert( bytes_being_sent.end(), framed->begin(), framed->end() );
+                  queued_messages.clear();
+                  // send() may have counted messages that are still on their way to this thread
+                  queued_byte_count -= bytes_being_sent.size();
+                  sock->encrypt_and_write( bytes_being_sent.data(), bytes_being_sent.size() );
+                  sock->flush();
+                  if( bytes_being_sent.capacity() > BTS_NET_MAX_RETAINED_SEND_BUFFER_SIZE )
+                     std::vector<char>().swap( bytes_being_sent );
+                  if( _io_thread )
+                     take_incoming_messages();
+                  notify_queued_messages_sent();
+               }
+            }
+            catch ( const fc::canceled_exception& e )
+            {
+               discard_queued_messages();
+               throw;
+            }
+            catch ( const fc::exception& e )
+            {
+               // the read loop notices the closed socket and notifies the delegate
+               wlog( "unable to send queued messages, closing connection ${e}", ("e", e.to_detail_string() ) );
+               discard_queued_messages();
+               try { sock->close(); } catch ( ... ) {}
+            }
+          }
 
           void read_loop()
           {
@@ -52,15 +296,27 @@ const chain_message_type trx_err_message::type   = chain_message_type::trx_err_m
                message m;
                while( !read_loop_complete.canceled() )
                {
-                  char tmp[BUFFER_SIZE];
-                  sock->read( tmp, BUFFER_SIZE );
-                  memcpy( (char*)&m, tmp, sizeof(message_header) );
-                  m.data.resize( m.size + 16 ); //give extra 16 bytes to allow for padding added in send call
-                  memcpy( (char*)m.data.data(), tmp + sizeof(message_header), LEFTOVER );
-                  sock->read( m.data.data() + LEFTOVER, 16*((m.size -LEFTOVER + 15)/16) );
+                  // messages that fit in the receive buffer are handed on where they were decrypted
+                  memcpy( (char*)&m, sock->peek( BUFFER_SIZE ), sizeof(message_header) );
+                  size_t padded_size = padded_message_size( m );
+                  if( padded_size <= BTS_NET_STCP_RECV_BUFFER_SIZE )
+                  {
+                     std::shared_ptr<const char> framed = sock->read_shared( padded_size );
+                     m.shared_data = std::shared_ptr<const char>( framed, framed.get() + sizeof(message_header) );
+                     m.data.clear();
+                  }
+                  else
+                  {
+                     char tmp[BUFFER_SIZE];
+                     sock->read( tmp, BUFFER_SIZE );
+                     m.shared_data.reset();
+                     m.data.resize( m.size + 16 ); //give extra 16 bytes to allow for padding added in send call
+                     memcpy( (char*)m.data.data(), tmp + sizeof(message_header), LEFTOVER );
+                     sock->read( m.data.data() + LEFTOVER, 16*((m.size -LEFTOVER + 15)/16) );
+                  }
 
                   try { // message handling errors are warnings... 
-                    con_del->on_connection_message( self, m );
+                    deliver_message( m );
                   } 
                   catch ( fc::canceled_exception& e ) { wlog(".");throw; }
                   catch ( fc::eof_exception& e ) { wlog(".");throw; }
@@ -79,7 +335,11 @@ const chain_message_type trx_err_message::type   = chain_message_type::trx_err_m
             } 
             catch ( const fc::canceled_exception& e )
             {
-              if( con_del )
+              if( _io_thread )
+              {
+                 notify_disconnected_from_io_thread();
+              }
+              else if( con_del )
               {
                  con_del->on_connection_disconnected( self );
               }
@@ -92,7 +352,11 @@ const chain_message_type trx_err_message::type   = chain_message_type::trx_err_m
             }
             catch ( const fc::eof_exception& e )
             {
-              if( con_del )
+              if( _io_thread )
+              {
+                 notify_disconnected_from_io_thread();
+              }
+              else if( con_del )
               {
                  fc::async( [=](){con_del->on_connection_disconnected( self );} );
               }
@@ -103,7 +367,12 @@ const chain_message_type trx_err_message::type   = chain_message_type::trx_err_m
             }
             catch ( fc::exception& er )
             {
-              if( con_del )
+              if( _io_thread )
+              {
+                 elog( "disconnected ${er}", ("er", er.to_detail_string() ) );
+                 notify_disconnected_from_io_thread();
+              }
+              else if( con_del )
               {
                 elog( "disconnected ${er}", ("er", er.to_detail_string() ) );
                 //con_del->on_connection_disconnected( self );
@@ -125,17 +394,18 @@ const chain_message_type trx_err_message::type   = chain_message_type::trx_err_m
      };
   } // namespace detail
 
-  chain_connection::chain_connection( const stcp_socket_ptr& c, chain_connection_delegate* d )
-  :my( new detail::chain_connection_impl(*this) )
+  chain_connection::chain_connection( const stcp_socket_ptr& c, chain_connection_delegate* d, fc::thread* io_thread )
+  :my( new detail::chain_connection_impl(*this, io_thread) )
   {
     my->sock = c;
     my->con_del = d;
-    my->remote_ep = remote_endpoint();
-    my->read_loop_complete = fc::async( [=](){ my->read_loop(); } );
+    if( c->get_socket().is_open() )
+       my->remote_ep = c->get_socket().remote_endpoint();
+    my->run_on_io_thread( [=](){ my->read_loop_complete = fc::async( [=](){ my->read_loop(); } ); } );
   }
 
   chain_connection::chain_connection( chain_connection_delegate* d )
-  :my( new detail::chain_connection_impl(*this) ) 
+  :my( new detail::chain_connection_impl(*this, nullptr) ) 
   { 
     assert( d != nullptr );
     my->con_del = d; 
@@ -150,6 +420,15 @@ const chain_message_type trx_err_message::type   = chain_message_type::trx_err_m
      return my->_last_block_id;
   }
 
+  void chain_connection::set_remote_version( uint16_t v )
+  {
+     my->_remote_version = v;
+  }
+  uint16_t chain_connection::get_remote_version()const
+  {
+     return my->_remote_version;
+  }
+
   chain_connection::~chain_connection()
   {
     try {
@@ -157,17 +436,27 @@ const chain_message_type trx_err_message::type   = chain_message_type::trx_err_m
         // because shared_from_this() will return nullptr 
         // and cause us all kinds of grief
         my->con_del = nullptr; 
+        my->stop_sync_loop();
 
         close();
-        if( my->read_loop_complete.valid() )
+        my->run_on_io_thread( [=]()
         {
-          my->read_loop_complete.wait();
-        }
-        if( my->exec_sync_loop_complete.valid() )
-        {
-          my->exec_sync_loop_complete.cancel();
-          my->exec_sync_loop_complete.wait();
-        }
+           my->stop_send_loop();
+           if( my->read_loop_complete.valid() )
+           {
+             try {
+                my->read_loop_complete.wait();
+             } catch ( const fc::exception& e )
+             {
+                wlog( "${w}", ("w",e.to_detail_string()) );
+             }
+           }
+        });
+
+        // deliveries already handed to this thread do nothing now, but they refer to us
+        my->wait_for_previous_delivery();
+        if( my->_previous_sent_notification.valid() && !my->_previous_sent_notification.ready() )
+           my->_previous_sent_notification.wait();
     } 
     catch ( const fc::canceled_exception& e )
     {
@@ -192,8 +481,23 @@ const chain_message_type trx_err_message::type   = chain_message_type::trx_err_m
      try {
          if( my->sock )
          {
-           my->sock->close();
-           if( my->read_loop_complete.valid() )
+           my->run_on_io_thread( [=]()
+           {
+              // give messages queued before the close, like a trx_err_message, a chance to go out
+              if( my->send_loop_complete.valid() && !my->send_loop_complete.ready() )
+              {
+                 try {
+                    my->send_loop_complete.wait( fc::milliseconds( BTS_NET_SEND_QUEUE_CLOSE_TIMEOUT_MS ) );
+                 } catch ( const fc::timeout_exception& e )
+                 {
+                    wlog( "closing with ${n} bytes still queued", ("n", size_t(my->queued_byte_count)) );
+                 }
+              }
+              my->sock->close();
+           });
+           // the read loop may be waiting for us to handle its last message, so with an I/O
+           // thread it is left to notice the closed socket and the destructor waits for it
+           if( !my->_io_thread && my->read_loop_complete.valid() )
            {
               wlog( "waiting for socket to close" );
               my->read_loop_complete.cancel();
@@ -240,24 +544,37 @@ const chain_message_type trx_err_message::type   = chain_message_type::trx_err_m
       FC_THROW_EXCEPTION( exception, "unable to connect to ${host_port}", ("host_port",host_port) );
   }
 
+  /**
+   *  Queues the message and returns without waiting for it to be written.
+   */
   void chain_connection::send( const message& m )
+  {
+    send( frame_message( m ) );
+  }
+
+  /**
+   *  Queues a message framed with frame_message(), the buffer is shared rather than copied
+   *  until the send loop writes it, so one framed broadcast can be queued on every connection.
+   */
+  void chain_connection::send( const framed_message_ptr& framed )
   {
     try {
-      fc::scoped_lock<fc::mutex> lock(my->write_lock);
-#define MAIL_PACKED_MESSAGE_HEADER sizeof(message_header)
-      size_t len = MAIL_PACKED_MESSAGE_HEADER + m.size;
-      len = 16*((len+15)/16); //pad the message we send to a multiple of 16 bytes
-      std::vector<char> tmp(len);
-      memcpy( tmp.data(), (char*)&m, MAIL_PACKED_MESSAGE_HEADER );
-      memcpy( tmp.data() + MAIL_PACKED_MESSAGE_HEADER, m.data.data(), m.size );
-      my->sock->write( tmp.data(), tmp.size() );
-      my->sock->flush();
+      FC_ASSERT( my->sock, "not connected" );
+      // counted here so the sync loop sees it before the I/O thread gets to it
+      my->queued_byte_count += framed->size();
+      if( my->_io_thread && !my->_io_thread->is_current() )
+         my->post_to_io_thread( framed );
+      else
+         my->enqueue( framed );
     } FC_RETHROW_EXCEPTIONS( warn, "unable to send message" );
   }
 
 
   fc::ip::endpoint chain_connection::remote_endpoint()const 
   {
+     // the socket belongs to the I/O thread, remote_ep was saved when we were constructed
+     if( my->_io_thread )
+        return my->remote_ep;
      if( get_socket()->get_socket().is_open() )
      {
          return my->remote_ep = get_socket()->get_socket().remote_endpoint();
@@ -266,44 +583,93 @@ const chain_message_type trx_err_message::type   = chain_message_type::trx_err_m
      return my->remote_ep;
   }
 
+  /**
+   *  Sends the subscriber every block after its last block id.  Blocks are read from the
+   *  block store in batches and sent back to back for as long as the subscriber has granted
+   *  credit and the send queue is short, so catching up is paced by the subscriber applying
+   *  the blocks rather than by a fixed delay.
+   */
   void chain_connection::exec_sync_loop()
   {
+      my->stop_sync_loop();
       my->exec_sync_loop_complete = fc::async( [=]() 
       {
-          while( !my->exec_sync_loop_complete.canceled() )
-          {
-             try {
-                int32_t  cur_block_num  = int32_t(-1);
-                if( my->_last_block_id != bts::blockchain::block_id_type() )
-                    cur_block_num = my->chain->fetch_block_num( my->_last_block_id );
-                ilog( "head block ${h}  cur block ${c}", ("c",cur_block_num)("h",my->chain->head_block_num() ) );
-                while( cur_block_num < int32_t(my->chain->head_block_num())  )
+          try {
+             std::deque<block_message>       read_ahead;
+             bts::blockchain::block_id_type  last_sent_block_id;
+             uint32_t                        next_block_num = 0;
+             bool                            first_pass = true;
+             while( !my->exec_sync_loop_complete.canceled() )
+             {
+                // broadcasts may have moved the subscriber along since we last sent it a block
+                if( first_pass || my->_last_block_id != last_sent_block_id )
                 {
-                    cur_block_num++;
-                    block_message blk_msg;
-                    blk_msg.block_data = my->chain->fetch_trx_block( cur_block_num );
-                    // TODO: sign it..
-                    ilog( "sending block ${n} ${c}", ("n",cur_block_num)("c",blk_msg.block_data.id()) );
-                    send( bts::net::message(blk_msg) );
-                    my->_last_block_id = blk_msg.block_data.id();
-                    fc::usleep( fc::microseconds( 1000*100 ) );
+                   next_block_num = 0;
+                   if( my->_last_block_id != bts::blockchain::block_id_type() )
+                      next_block_num = my->chain->fetch_block_num( my->_last_block_id ) + 1;
+                   first_pass = false;
+                   read_ahead.clear();
                 }
-                ilog( "all synced up, no blocks left to send" );
-                return;
-             } 
-             catch ( const fc::exception& e ) 
-             {
-                wlog( "${e}", ("e", e.to_detail_string() ) );
-                trx_err_message reply;
-                reply.err = e.to_detail_string();
-                send( message( reply ) );
-                get_socket()->get_socket().close();
-                return;
+
+                uint32_t head_block_num = my->chain->head_block_num();
+                if( head_block_num == uint32_t(-1) || next_block_num > head_block_num )
+                {
+                   ilog( "all synced up, no blocks left to send" );
+                   return;
+                }
+
+                if( read_ahead.empty() )
+                {
+                   for( auto& blk : my->chain->fetch_trx_blocks( next_block_num, BTS_NET_CHAIN_SYNC_READ_AHEAD_BLOCKS ) )
+                      read_ahead.push_back( block_message( blk ) );
+                   FC_ASSERT( read_ahead.size(), "unable to read block ${n}", ("n",next_block_num) );
+                }
+
+                if( !my->can_send_sync_block() )
+                {
+                   my->sync_loop_wakeup = fc::promise<void>::ptr( new fc::promise<void>() );
+                   // the send loop may have drained the queue before it saw the flag, so check again
+                   my->sync_loop_waiting = true;
+                   if( !my->can_send_sync_block() )
+                      my->sync_loop_wakeup->wait();
+                   my->sync_loop_waiting = false;
+                   my->sync_loop_wakeup.reset();
+                   continue;
+                }
+
+                const block_message& blk_msg = read_ahead.front();
+                // TODO: sign it..
+                last_sent_block_id = blk_msg.block_data.id();
+                ilog( "sending block ${n} ${c}", ("n",next_block_num)("c",last_sent_block_id) );
+                send( bts::net::message(blk_msg) );
+                my->_last_block_id = last_sent_block_id;
+                if( my->sync_credit )
+                   --my->sync_credit;
+                read_ahead.pop_front();
+                ++next_block_num;
              }
+          } 
+          catch ( const fc::canceled_exception& e )
+          {
+             throw;
+          }
+          catch ( const fc::exception& e ) 
+          {
+             wlog( "${e}", ("e", e.to_detail_string() ) );
+             trx_err_message reply;
+             reply.err = e.to_detail_string();
+             send( message( reply ) );
+             my->run_on_io_thread( [=](){ get_socket()->get_socket().close(); } );
           }
       });
   }
 
+  void chain_connection::add_sync_credit( uint32_t blocks )
+  {
+     my->sync_credit = uint32_t( std::min<uint64_t>( uint64_t(my->sync_credit) + blocks, uint32_t(-1) ) );
+     my->wake_sync_loop();
+  }
+
   void chain_connection::set_database( bts::blockchain::chain_database* db )
   {
      my->chain = db;
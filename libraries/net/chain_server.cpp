@@ -20,8 +20,15 @@
 
 #include <algorithm>
 #include <unordered_map>
+#include <unordered_set>
 #include <map>
 
+/** trxs received within this long of the first one waiting are admitted together */
+#define BTS_NET_CHAIN_TRX_ADMISSION_WINDOW_MS  10
+#define BTS_NET_CHAIN_MAX_TRX_BATCH            1000
+/** the accept loop stops accepting while this many key exchanges are in progress */
+#define BTS_NET_CHAIN_MAX_PENDING_HANDSHAKES   64
+
 
 struct genesis_block_config
 {
@@ -159,20 +166,47 @@ namespace detail
         chain_server_impl()
         :_ser_del( nullptr )
         ,_chain( std::make_shared<bts::blockchain::chain_database>() )
+        ,_next_io_thread( 0 )
+        ,_handshakes_in_progress( 0 )
         { }
 
         chain_server_impl( bts::blockchain::chain_database_ptr& chain )
         :_ser_del( nullptr )
         ,_chain( chain )
+        ,_next_io_thread( 0 )
+        ,_handshakes_in_progress( 0 )
         { }
 
         ~chain_server_impl()
         {
            close();
+           // connections stop their loops on their I/O threads, so they go before the threads do
+           _connections.clear();
         }
         void close()
         {
             ilog( "closing connections..." );
+            // a batch in flight makes the wait rethrow the cancel, which must not keep us from closing the rest
+            try
+            {
+                if( _admission_loop_complete.valid() && !_admission_loop_complete.ready() )
+                {
+                    _admission_loop_complete.cancel();
+                    _admission_loop_complete.wait();
+                }
+            }
+            catch ( const fc::canceled_exception& e )
+            {
+                ilog( "canceled admission of queued transactions" );
+            }
+            catch ( const fc::exception& e )
+            {
+                wlog( "unhandled exception stopping the admission loop ${e}", ("e", e.to_detail_string() ));
+            }
+            // the queued trxs refer to connections, which must go before their I/O threads
+            _admission_queue.clear();
+            _queued_trx_ids.clear();
+
             try
             {
                 _tcp_serv.close();
@@ -205,20 +239,63 @@ namespace detail
         fc::future<void>                                                                             _accept_loop_complete;
         bts::blockchain::chain_database_ptr                                                          _chain;
         std::unordered_map<bts::blockchain::transaction_id_type,bts::blockchain::signed_transaction> _pending;
+        /** kept to answer get_block_trxs_messages without a database lookup */
+        bts::blockchain::trx_block                                                                   _last_broadcast_block;
+
+        /** trxs waiting to be admitted with the connection each came from, see queue_transaction() */
+        std::vector<std::pair<chain_connection_ptr,signed_transaction> >                             _admission_queue;
+        std::unordered_set<bts::blockchain::transaction_id_type>                                     _queued_trx_ids;
+        fc::future<void>                                                                             _admission_loop_complete;
+        std::vector<std::unique_ptr<fc::thread> >                                                    _signature_threads;
+
+        /** each connection is handed to one of these round robin, see chain_server::config::io_threads */
+        std::vector<std::unique_ptr<fc::thread> >                                                    _io_threads;
+        uint32_t                                                                                     _next_io_thread;
+        uint32_t                                                                                     _handshakes_in_progress;
+        /** the accept loop waits on this while too many key exchanges are in progress */
+        fc::promise<void>::ptr                                                                       _handshake_slot_available;
+
+        /** @return the thread for the next connection, or nullptr to keep it on this thread */
+        fc::thread* next_io_thread()
+        {
+            if( _io_threads.empty() )
+               return nullptr;
+            return _io_threads[ _next_io_thread++ % _io_threads.size() ].get();
+        }
 
+        void handshake_finished()
+        {
+            --_handshakes_in_progress;
+            if( _handshake_slot_available && !_handshake_slot_available->ready() )
+               _handshake_slot_available->set_value();
+        }
 
+
+        /**
+         *  Both forms of the block are packed and framed once and the buffers are shared by
+         *  every subscriber's send queue.  send() only queues, it never yields, so the
+         *  connection table can't change while we walk it.
+         */
         void broadcast_block( const bts::blockchain::trx_block& blk )
         {
-            // copy list to prevent yielding in middle...
-            auto cons = _connections;
-
-            block_message blk_msg(blk);
-            for( auto c : cons )
+            // subscribers already have nearly every trx in the block from our trx
+            // broadcasts, so send them the ids and let them ask for the rest
+            _last_broadcast_block = blk;
+            framed_message_ptr full_msg; // only older subscribers need it, framed on first use
+            framed_message_ptr compact_msg = frame_message( message( compact_block_message( digest_block( blk, blk.trxs, signed_transactions() ) ) ) );
+            for( const auto& c : _connections )
             {
                try {
                   if( c.second->get_last_block_id() == blk.prev )
                   {
-                    c.second->send( message( blk_msg ) );
+                    if( c.second->get_remote_version() >= BTS_NET_CHAIN_COMPACT_BLOCK_VERSION )
+                       c.second->send( compact_msg );
+                    else
+                    {
+                       if( !full_msg )
+                          full_msg = frame_message( message( block_message( blk ) ) );
+                       c.second->send( full_msg );
+                    }
                     c.second->set_last_block_id( blk.id() );
                   }
                }
@@ -229,23 +306,24 @@ namespace detail
             }
         }
 
-        void broadcast( const message& m )
+        /** replies with the trxs a subscriber could not find for a compact block */
+        void send_block_trxs( chain_connection& c, const get_block_trxs_message& request )
         {
-            // copy list to prevent yielding in middle...
-            auto cons = _connections;
-            ilog( "broadcast" );
-
-            for( auto con : cons )
+            trx_block blk;
+            if( request.block_id == _last_broadcast_block.id() )
+               blk = _last_broadcast_block;
+            else
+               blk = _chain->fetch_trx_block( _chain->fetch_block_num( request.block_id ) );
+
+            block_trxs_message reply;
+            reply.block_id = request.block_id;
+            reply.trxs.reserve( request.trx_indexes.size() );
+            for( auto idx : request.trx_indexes )
             {
-               try {
-                 // TODO... make sure connection is synced...
-                 con.second->send( m );
-               }
-               catch ( const fc::exception& w )
-               {
-                  wlog( "${w}", ( "w",w.to_detail_string() ) );
-               }
+               FC_ASSERT( idx < blk.trxs.size(), "invalid trx index ${i}", ("i",idx) );
+               reply.trxs.push_back( blk.trxs[idx] );
             }
+            c.send( message( reply ) );
         }
 
         /**
@@ -264,6 +342,7 @@ namespace detail
                 auto sm = m.as<subscribe_message>();
                 ilog( "recv: ${m}", ("m",sm) );
                 c.set_last_block_id( sm.last_block );
+                c.set_remote_version( sm.version );
                 c.exec_sync_loop();
              }
              else if( m.msg_type == block_message::type )
@@ -286,33 +365,35 @@ namespace detail
                    c.close();
                 }
              }
-             else if( m.msg_type == chain_message_type::trx_msg )
+             else if( m.msg_type == sync_credit_message::type )
              {
-                auto trx = m.as<trx_message>();
-                ilog( "recv: ${m}", ("m",trx) );
-                try
-                {
-                   _chain->evaluate_transaction( trx.signed_trx ); // throws if error
-                   if( _pending.insert( std::make_pair(trx.signed_trx.id(),trx.signed_trx) ).second )
-                   {
-                      ilog( "new transaction, broadcasting" );
-                      fc::async( [=]() { broadcast( m ); } );
-                   }
-                   else
-                   {
-                      wlog( "duplicate transaction, ignoring" );
-                   }
+                c.add_sync_credit( m.as<sync_credit_message>().blocks );
+             }
+             else if( m.msg_type == get_block_trxs_message::type )
+             {
+                try {
+                   send_block_trxs( c, m.as<get_block_trxs_message>() );
                 }
                 catch ( const fc::exception& e )
                 {
                    trx_err_message reply;
-                   reply.signed_trx = trx.signed_trx;
                    reply.err = e.to_detail_string();
                    wlog( "${e}", ("e", e.to_detail_string() ) );
                    c.send( message( reply ) );
                    c.close();
                 }
              }
+             else if( m.msg_type == chain_message_type::trx_msg )
+             {
+                auto trx = m.as<trx_message>();
+                ilog( "recv: ${m}", ("m",trx) );
+                queue_transaction( c, trx.signed_trx );
+             }
+             else if( m.msg_type == trxs_message::type )
+             {
+                for( const auto& trx : m.as<trxs_message>().trxs )
+                   queue_transaction( c, trx );
+             }
              else
              {
                  trx_err_message reply;
@@ -324,6 +405,135 @@ namespace detail
         }
 
 
+        /**
+         *  Adds trx to the admission queue, which is evaluated as one batch after a short
+         *  window so a burst of trxs shares one block state and one relay message.
+         */
+        void queue_transaction( chain_connection& c, const signed_transaction& trx )
+        {
+            auto trx_id = trx.id();
+            if( _pending.find( trx_id ) != _pending.end() || !_queued_trx_ids.insert( trx_id ).second )
+            {
+               wlog( "duplicate transaction, ignoring" );
+               return;
+            }
+            _admission_queue.push_back( std::make_pair( c.shared_from_this(), trx ) );
+            if( !_admission_loop_complete.valid() || _admission_loop_complete.ready() )
+               _admission_loop_complete = fc::async( [=](){ admission_loop(); } );
+        }
+
+        void admission_loop()
+        {
+            fc::usleep( fc::milliseconds( BTS_NET_CHAIN_TRX_ADMISSION_WINDOW_MS ) );
+            while( _admission_queue.size() && !_admission_loop_complete.canceled() )
+            {
+               size_t batch_size = std::min<size_t>( _admission_queue.size(), BTS_NET_CHAIN_MAX_TRX_BATCH );
+               std::vector<std::pair<chain_connection_ptr,signed_transaction> > batch( _admission_queue.begin(),
+                                                                                       _admission_queue.begin() + batch_size );
+               _admission_queue.erase( _admission_queue.begin(), _admission_queue.begin() + batch_size );
+               admit_transactions( batch );
+            }
+        }
+
+        void admit_transactions( const std::vector<std::pair<chain_connection_ptr,signed_transaction> >& batch )
+        {
+            signed_transactions trxs;
+            trxs.reserve( batch.size() );
+            for( const auto& item : batch )
+               trxs.push_back( item.second );
+
+            recover_signatures( trxs );
+            auto errors = _chain->evaluate_transactions( trxs );
+
+            trxs_message accepted;
+            std::unordered_set<chain_connection_ptr> rejected_connections;
+            for( uint32_t i = 0; i < trxs.size(); ++i )
+            {
+               auto trx_id = trxs[i].id();
+               _queued_trx_ids.erase( trx_id );
+               if( errors[i] )
+               {
+                  trx_err_message reply;
+                  reply.signed_trx = trxs[i];
+                  reply.err = errors[i]->to_detail_string();
+                  wlog( "${e}", ("e", reply.err ) );
+                  // every rejected trx gets its own error, the connection is closed once the batch is done
+                  rejected_connections.insert( batch[i].first );
+                  try { batch[i].first->send( message( reply ) ); }
+                  catch ( const fc::exception& e ) { wlog( "${e}", ("e", e.to_detail_string() ) ); }
+               }
+               else if( _pending.insert( std::make_pair( trx_id, trxs[i] ) ).second )
+               {
+                  accepted.trxs.push_back( trxs[i] );
+               }
+            }
+
+            if( accepted.trxs.size() )
+            {
+               ilog( "admitted ${n} of ${t} transactions, broadcasting", ("n",accepted.trxs.size())("t",trxs.size()) );
+               broadcast_transactions( accepted );
+            }
+
+            // closing waits for the errors to be sent, so it is done after everything else
+            for( const auto& con : rejected_connections )
+            {
+               try { con->close(); }
+               catch ( const fc::exception& e ) { wlog( "${e}", ("e", e.to_detail_string() ) ); }
+            }
+        }
+
+        /**
+         *  Recovers the signing keys of trxs on the signature threads, where they are cached
+         *  for evaluation on this thread.
+         */
+        void recover_signatures( const signed_transactions& trxs )
+        {
+            if( _signature_threads.empty() || trxs.size() < 2 )
+               return;
+            uint32_t thread_count = std::min<size_t>( _signature_threads.size(), trxs.size() );
+            std::vector<fc::future<void> > recovered;
+            recovered.reserve( thread_count );
+            for( uint32_t t = 0; t < thread_count; ++t )
+            {
+               recovered.push_back( _signature_threads[t]->async( [&trxs,t,thread_count]()
+               {
+                  for( size_t i = t; i < trxs.size(); i += thread_count )
+                  {
+                     // invalid signatures are reported when the trx is evaluated
+                     try { trxs[i].get_signing_keys(); } catch ( const fc::exception& ) {}
+                  }
+               } ) );
+            }
+            for( auto& f : recovered )
+               f.wait();
+        }
+
+        /** relays admitted trxs in one message to subscribers that accept it, one at a time to the rest */
+        void broadcast_transactions( const trxs_message& accepted )
+        {
+            framed_message_ptr batch_msg = frame_message( message( accepted ) );
+            std::vector<framed_message_ptr> trx_msgs; // only older subscribers need them, framed on first use
+            for( const auto& con : _connections )
+            {
+               try {
+                  if( con.second->get_remote_version() >= BTS_NET_CHAIN_TRX_BATCH_VERSION )
+                  {
+                     con.second->send( batch_msg );
+                     continue;
+                  }
+                  if( trx_msgs.empty() )
+                     for( const auto& trx : accepted.trxs )
+                        trx_msgs.push_back( frame_message( message( trx_message( trx ) ) ) );
+                  for( const auto& framed : trx_msgs )
+                     con.second->send( framed );
+               }
+               catch ( const fc::exception& w )
+               {
+                  wlog( "${w}", ( "w",w.to_detail_string() ) );
+               }
+            }
+        }
+
         virtual void on_connection_disconnected( chain_connection& c )
         {
            try {
@@ -343,7 +553,8 @@ namespace detail
          *  should not throw any exceptions because they are not
          *  being caught anywhere.
          *
-         *
+         *  The DH key exchange runs on the I/O thread the connection is
+         *  given, so slow handshakes don't hold up the chain database.
          */
         void accept_connection( const stcp_socket_ptr& s )
         {
@@ -351,11 +562,15 @@ namespace detail
            {
               // init DH handshake, TODO: this could yield.. what happens if we exit here before
               // adding s to connections list.
-              s->accept();
+              fc::thread* io_thread = next_io_thread();
+              if( io_thread )
+                 io_thread->async( [=](){ s->accept(); } ).wait();
+              else
+                 s->accept();
               ilog( "accepted connection from ${ep}",
                     ("ep", std::string(s->get_socket().remote_endpoint()) ) );
 
-              auto con = std::make_shared<chain_connection>(s,this);
+              auto con = std::make_shared<chain_connection>(s,this,io_thread);
               _connections[con->remote_endpoint()] = con;
               con->set_database( _chain.get() );
               if( _ser_del ) _ser_del->on_connected( con );
@@ -372,6 +587,7 @@ namespace detail
            {
               elog( "unexpected exception" );
            }
+           handshake_finished();
         }
 
         /**
@@ -383,15 +599,21 @@ namespace detail
            {
               while( !_accept_loop_complete.canceled() )
               {
+                 // limit the key exchanges in progress rather than the rate we accept
+                 // at, to prevent DOS attacks without slowing down a burst of subscribers
+                 while( _handshakes_in_progress >= BTS_NET_CHAIN_MAX_PENDING_HANDSHAKES )
+                 {
+                    _handshake_slot_available = fc::promise<void>::ptr( new fc::promise<void>() );
+                    _handshake_slot_available->wait();
+                    _handshake_slot_available.reset();
+                 }
+
                  stcp_socket_ptr sock = std::make_shared<stcp_socket>();
                  _tcp_serv.accept( sock->get_socket() );
 
                  // do the acceptance process async
+                 ++_handshakes_in_progress;
                  fc::async( [=](){ accept_connection( sock ); } );
-
-                 // limit the rate at which we accept connections to prevent
-                 // DOS attacks.
-                 fc::usleep( fc::microseconds( 1000*1 ) );
               }
            }
            catch ( fc::eof_exception& e )
@@ -438,6 +660,10 @@ void chain_server::configure( const chain_server::config& c )
 {
   try {
      my->_cfg = c;
+     while( my->_signature_threads.size() < c.signature_threads )
+        my->_signature_threads.emplace_back( new fc::thread( "signatures " + fc::to_string( int64_t(my->_signature_threads.size()) ) ) );
+     while( my->_io_threads.size() < c.io_threads )
+        my->_io_threads.emplace_back( new fc::thread( "chain io " + fc::to_string( int64_t(my->_io_threads.size()) ) ) );
 
      ilog( "listening for stcp connections on port ${p}", ("p",c.port) );
      my->_tcp_serv.listen( c.port );
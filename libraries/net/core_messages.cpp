@@ -1,4 +1,10 @@
 #include <bts/net/core_messages.hpp>
+#include <fc/exception/exception.hpp>
+
+#include <zlib.h>
+
+/// the largest message we will decompress, matches the 16 MB limit in message_header
+#define BTS_NET_MAX_DECOMPRESSED_MESSAGE_SIZE (16*1024*1024)
 
 namespace bts { namespace net {
 
@@ -12,5 +18,85 @@ namespace bts { namespace net {
   const core_message_type_enum connection_rejected_message::type           = core_message_type_enum::connection_rejected_message_type;
   const core_message_type_enum address_request_message::type               = core_message_type_enum::address_request_message_type;
   const core_message_type_enum address_message::type                       = core_message_type_enum::address_message_type;
+  const core_message_type_enum compressed_message::type                    = core_message_type_enum::compressed_message_type;
+
+  namespace
+  {
+    template<typename T>
+    message pack_with_capabilities(const T& hello)
+    {
+      message result(hello);
+      std::vector<char> packed_capabilities = fc::raw::pack(hello.capabilities);
+      result.data.insert(result.data.end(), packed_capabilities.begin(), packed_capabilities.end());
+      result.size = result.data.size();
+      return result;
+    }
+
+    template<typename T>
+    T unpack_with_capabilities(const message& received_message)
+    {
+      T result = received_message.as<T>();
+      // older peers end their hello here
+      size_t fields_size = fc::raw::pack_size(result);
+      if (received_message.size >= fields_size + sizeof(result.capabilities))
+      {
+        fc::datastream<const char*> ds(received_message.payload() + fields_size, received_message.size - fields_size);
+        fc::raw::unpack(ds, result.capabilities);
+      }
+      return result;
+    }
+  }
+
+  message pack_hello_message(const hello_message& hello)
+  {
+    return pack_with_capabilities(hello);
+  }
+
+  message pack_hello_reply_message(const hello_reply_message& hello_reply)
+  {
+    return pack_with_capabilities(hello_reply);
+  }
+
+  hello_message unpack_hello_message(const message& received_message)
+  {
+    return unpack_with_capabilities<hello_message>(received_message);
+  }
+
+  hello_reply_message unpack_hello_reply_message(const message& received_message)
+  {
+    return unpack_with_capabilities<hello_reply_message>(received_message);
+  }
+
+  compressed_message compress_message(const message& message_to_compress, int compression_level)
+  { try {
+    compressed_message result;
+    result.original_msg_type = message_to_compress.msg_type;
+    result.original_size = message_to_compress.size;
+    uLongf compressed_size = compressBound(message_to_compress.size);
+    result.compressed_data.resize(compressed_size);
+    int status = compress2((Bytef*)result.compressed_data.data(), &compressed_size,
+                           (const Bytef*)message_to_compress.payload(), message_to_compress.size,
+                           compression_level);
+    FC_ASSERT(status == Z_OK, "zlib error ${status}", ("status", status));
+    result.compressed_data.resize(compressed_size);
+    return result;
+  } FC_RETHROW_EXCEPTIONS(warn, "unable to compress message", ("size", message_to_compress.size)("level", compression_level)) }
+
+  message decompress_message(const compressed_message& message_to_decompress)
+  { try {
+    FC_ASSERT(message_to_decompress.original_msg_type != compressed_message::type);
+    FC_ASSERT(message_to_decompress.original_size <= BTS_NET_MAX_DECOMPRESSED_MESSAGE_SIZE);
+    message result;
+    result.msg_type = message_to_decompress.original_msg_type;
+    result.size = message_to_decompress.original_size;
+    result.data.resize(result.size);
+    uLongf decompressed_size = result.size;
+    int status = uncompress((Bytef*)result.data.data(), &decompressed_size,
+                            (const Bytef*)message_to_decompress.compressed_data.data(), message_to_decompress.compressed_data.size());
+    FC_ASSERT(status == Z_OK, "zlib error ${status}", ("status", status));
+    FC_ASSERT(decompressed_size == result.size, "decompressed to ${actual} bytes, expected ${expected}",
+              ("actual", decompressed_size)("expected", result.size));
+    return result;
+  } FC_RETHROW_EXCEPTIONS(warn, "unable to decompress message", ("msg_type", message_to_decompress.original_msg_type)) }
 
 } } // bts::client
@@ -8,6 +8,8 @@
 using namespace bts::blockchain;
 using namespace bts::net;
 
+namespace fc { class thread; }
+
 namespace bts { namespace net {
   
    namespace detail { class chain_connection_impl; }
@@ -35,11 +37,16 @@ namespace bts { namespace net {
     *
     *  A connection also allows arbitrary data to be attached to it
     *  for use by other protocols built at higher levels.
+    *
+    *  The connection must be used from the thread that created it, and
+    *  the delegate and the sync loop always run on that thread.  If an
+    *  io_thread is given, messages are read, decrypted, encrypted and
+    *  written on that thread instead.
     */
    class chain_connection : public std::enable_shared_from_this<chain_connection>
    {
       public:
-        chain_connection( const stcp_socket_ptr& c, chain_connection_delegate* d);
+        chain_connection( const stcp_socket_ptr& c, chain_connection_delegate* d, fc::thread* io_thread = nullptr );
         chain_connection( chain_connection_delegate* d );
         ~chain_connection();
 
@@ -47,6 +54,7 @@ namespace bts { namespace net {
         fc::ip::endpoint remote_endpoint()const;
         
         void send( const message& m );
+        void send( const framed_message_ptr& framed );
 
         void connect( const std::string& host_port );  
         void connect( const fc::ip::endpoint& ep );
@@ -55,7 +63,14 @@ namespace bts { namespace net {
         bts::blockchain::block_id_type get_last_block_id()const;
         void                           set_last_block_id( const bts::blockchain::block_id_type& t );
 
+        /** the version sent in the remote's subscribe_message */
+        uint16_t                       get_remote_version()const;
+        void                           set_remote_version( uint16_t v );
+
+        /** starts sending the remote every block after get_last_block_id() */
         void exec_sync_loop();
+        /** lets the sync loop send this many more blocks to a BTS_NET_CHAIN_SYNC_CREDIT_VERSION subscriber */
+        void add_sync_credit( uint32_t blocks );
         void set_database( bts::blockchain::chain_database*  );
 
       private:
@@ -4,6 +4,13 @@
 #include <bts/blockchain/transaction.hpp>
 #include <set>
 
+/** subscribers at or above this version are sent compact_block_messages */
+#define BTS_NET_CHAIN_COMPACT_BLOCK_VERSION 1
+/** subscribers at or above this version are only sent sync blocks they granted credit for */
+#define BTS_NET_CHAIN_SYNC_CREDIT_VERSION   2
+/** subscribers at or above this version are relayed trxs in trxs_messages */
+#define BTS_NET_CHAIN_TRX_BATCH_VERSION     3
+
 namespace bts { namespace net {
 
    enum chain_message_type
@@ -11,13 +18,19 @@ namespace bts { namespace net {
        subscribe_msg = 1,
        block_msg     = 2,
        trx_msg       = 3,
-       trx_err_msg   = 4
-
+       trx_err_msg   = 4,
+       compact_block_msg  = 5,
+       get_block_trxs_msg = 6,
+       block_trxs_msg     = 7,
+       sync_credit_msg    = 8,
+       trxs_msg           = 9
    };
 
    struct subscribe_message
    {
       static const chain_message_type type;
+      subscribe_message():version(0){}
+
       uint16_t                        version;
       bts::blockchain::block_id_type  last_block;
    };
@@ -40,6 +53,58 @@ namespace bts { namespace net {
       bts::blockchain::signed_transaction    signed_trx;                 
    };
 
+   /** the trxs the server admitted together, relayed in one message */
+   struct trxs_message
+   {
+      static const chain_message_type type;
+      trxs_message(){}
+
+      bts::blockchain::signed_transactions   trxs;
+   };
+
+   /**
+    *  A new block as its header and transaction ids, the receiver rebuilds it
+    *  from its own pending transactions and asks for the rest with a single
+    *  get_block_trxs_message.
+    */
+   struct compact_block_message
+   {
+      static const chain_message_type type;
+      compact_block_message(){}
+      compact_block_message( const bts::blockchain::digest_block& blk )
+      :block_data(blk){}
+
+      bts::blockchain::digest_block          block_data;
+   };
+
+   struct get_block_trxs_message
+   {
+      static const chain_message_type type;
+      bts::blockchain::block_id_type         block_id;
+      /** indexes into compact_block_message::block_data.trx_ids */
+      std::vector<uint32_t>                  trx_indexes;
+   };
+
+   /** the reply to get_block_trxs_message, trxs are in the order they were requested */
+   struct block_trxs_message
+   {
+      static const chain_message_type type;
+      bts::blockchain::block_id_type         block_id;
+      bts::blockchain::signed_transactions   trxs;
+   };
+
+   /**
+    *  Allows the server to send this many more sync blocks, the subscriber sends one
+    *  after subscribing and more as it applies the blocks it was sent.
+    */
+   struct sync_credit_message
+   {
+      static const chain_message_type type;
+      sync_credit_message( uint32_t b = 0 ):blocks(b){}
+
+      uint32_t                               blocks;
+   };
+
    struct trx_err_message
    {
       static const chain_message_type type;
@@ -49,8 +114,15 @@ namespace bts { namespace net {
 
 } } // bts::net
 
-FC_REFLECT_ENUM( bts::net::chain_message_type, (subscribe_msg)(block_msg)(trx_msg)(trx_err_msg) )
+FC_REFLECT_ENUM( bts::net::chain_message_type, (subscribe_msg)(block_msg)(trx_msg)(trx_err_msg)
+                                                 (compact_block_msg)(get_block_trxs_msg)(block_trxs_msg)(sync_credit_msg)
+                                                 (trxs_msg) )
 FC_REFLECT( bts::net::subscribe_message, (version)(last_block) )
 FC_REFLECT( bts::net::block_message, (block_data) )
 FC_REFLECT( bts::net::trx_message, (signed_trx) )
+FC_REFLECT( bts::net::trxs_message, (trxs) )
+FC_REFLECT( bts::net::compact_block_message, (block_data) )
+FC_REFLECT( bts::net::get_block_trxs_message, (block_id)(trx_indexes) )
+FC_REFLECT( bts::net::block_trxs_message, (block_id)(trxs) )
+FC_REFLECT( bts::net::sync_credit_message, (blocks) )
 FC_REFLECT( bts::net::trx_err_message, (signed_trx)(err) )
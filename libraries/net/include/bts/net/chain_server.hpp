@@ -47,8 +47,15 @@ namespace bts { namespace net {
         struct config
         {
             config()
-            :port(0){}
+            :port(0),signature_threads(4),io_threads(0){}
             uint16_t                 port;  ///< the port to listen for incoming connections on.
+            /** threads that recover the signatures of admitted trxs, 0 recovers them while evaluating */
+            uint32_t                 signature_threads;
+            /**
+             *  threads that do the key exchange with new subscribers and then read, write and
+             *  encrypt their messages, 0 does it all on the thread that owns the chain database
+             */
+            uint32_t                 io_threads;
             std::vector<std::string> blacklist;  // host's that are blocked from connecting
             std::vector<fc::ip::endpoint> mirrors;  // host's that are blocked from connecting
         };
@@ -85,4 +92,4 @@ namespace bts { namespace net {
 
 } } // bts::net
 
-FC_REFLECT( chain_server::config, (port)(mirrors) )
+FC_REFLECT( chain_server::config, (port)(mirrors)(signature_threads)(io_threads) )
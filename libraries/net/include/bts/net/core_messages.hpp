@@ -1,4 +1,5 @@
 #pragma once
+#include <bts/net/message.hpp>
 #include <fc/crypto/ripemd160.hpp>
 #include <fc/reflect/reflect.hpp>
 #include <fc/network/ip.hpp>
@@ -37,9 +38,16 @@ namespace bts { namespace net {
     connection_rejected_message_type           = 5008,
     address_request_message_type               = 5009,
     address_message_type                       = 5010,
+    compressed_message_type                    = 5011
   };
 
-  const uint32_t core_protocol_version = 1;
+  const uint32_t core_protocol_version = 2;
+
+  /** advertised in hello_message::capabilities and hello_reply_message::capabilities */
+  enum core_capability_flags
+  {
+    compressed_messages_capability = 0x01 /// we can receive compressed_messages
+  };
 
   struct item_ids_inventory_message
   {
@@ -117,13 +125,16 @@ namespace bts { namespace net {
     uint32_t         core_protocol_version;
     fc::ip::endpoint inbound_endpoint;
     fc::uint160_t    node_id;
+    uint32_t         capabilities; /// core_capability_flags
 
-    hello_message() {}
-    hello_message(const std::string& user_agent, uint32_t core_protocol_version, fc::ip::endpoint inbound_endpoint, const fc::uint160_t& node_id) :
+    hello_message() : capabilities(0) {}
+    hello_message(const std::string& user_agent, uint32_t core_protocol_version, fc::ip::endpoint inbound_endpoint, const fc::uint160_t& node_id,
+                  uint32_t capabilities = 0) :
       user_agent(user_agent),
       core_protocol_version(core_protocol_version),
       inbound_endpoint(inbound_endpoint),
-      node_id(node_id)
+      node_id(node_id),
+      capabilities(capabilities)
     {}
   };
 
@@ -135,14 +146,17 @@ namespace bts { namespace net {
     uint32_t         core_protocol_version;
     fc::ip::endpoint remote_endpoint;
     fc::uint160_t node_id;
+    uint32_t         capabilities; /// core_capability_flags
 
-    hello_reply_message() {}
+    hello_reply_message() : capabilities(0) {}
     hello_reply_message(const std::string& user_agent, uint32_t core_protocol_version,
-                        fc::ip::endpoint remote_endpoint, const fc::uint160_t& node_id) :
+                        fc::ip::endpoint remote_endpoint, const fc::uint160_t& node_id,
+                        uint32_t capabilities = 0) :
       user_agent(user_agent),
       core_protocol_version(core_protocol_version),
       remote_endpoint(remote_endpoint),
-      node_id(node_id)
+      node_id(node_id),
+      capabilities(capabilities)
     {}
   };
 
@@ -188,21 +202,53 @@ namespace bts { namespace net {
     std::vector<address_info> addresses;
   };
 
+  /**
+   *  Wraps another message whose data has been compressed with zlib, only sent to peers
+   *  that advertised compressed_messages_capability.
+   */
+  struct compressed_message
+  {
+    static const core_message_type_enum type;
+
+    uint32_t          original_msg_type;
+    uint32_t          original_size;
+    std::vector<char> compressed_data;
+
+    compressed_message() : original_msg_type(0), original_size(0) {}
+  };
+
+  /**
+   *  capabilities is not reflected with the other hello fields, it is appended after them
+   *  so peers from before core_protocol_version 2, which stop reading after node_id, can
+   *  still unpack our hellos, and theirs unpack here with no capabilities.
+   */
+  message             pack_hello_message(const hello_message& hello);
+  message             pack_hello_reply_message(const hello_reply_message& hello_reply);
+  hello_message       unpack_hello_message(const message& received_message);
+  hello_reply_message unpack_hello_reply_message(const message& received_message);
+
+  /** @param compression_level a zlib level, 1 (fastest) to 9 (smallest) */
+  compressed_message compress_message(const message& message_to_compress, int compression_level);
+  /** @throw fc::exception if the data is corrupt or does not match original_size */
+  message            decompress_message(const compressed_message& message_to_decompress);
+
 } } // bts::client
 
-FC_REFLECT_ENUM( bts::net::core_message_type_enum, (item_ids_inventory_message_type)(blockchain_item_ids_inventory_message_type)(fetch_blockchain_item_ids_message_type)(fetch_item_message_type)(hello_message_type)(address_request_message_type))
+FC_REFLECT_ENUM( bts::net::core_message_type_enum, (item_ids_inventory_message_type)(blockchain_item_ids_inventory_message_type)(fetch_blockchain_item_ids_message_type)(fetch_item_message_type)(hello_message_type)(address_request_message_type)(compressed_message_type))
 FC_REFLECT( bts::net::item_id, (item_type)(item_hash) )
 FC_REFLECT( bts::net::item_ids_inventory_message, (item_type)(item_hashes_available) )
 FC_REFLECT( bts::net::blockchain_item_ids_inventory_message, (total_remaining_item_count)(item_type)(item_hashes_available) )
 FC_REFLECT( bts::net::fetch_blockchain_item_ids_message, (last_item_seen) )
 FC_REFLECT( bts::net::fetch_item_message, (item_to_fetch) )
 FC_REFLECT( bts::net::item_not_available_message, (requested_item) )
+// capabilities is packed by pack_hello_message() and pack_hello_reply_message()
 FC_REFLECT( bts::net::hello_message, (user_agent)(core_protocol_version)(inbound_endpoint)(node_id) )
 FC_REFLECT( bts::net::hello_reply_message, (user_agent)(core_protocol_version)(remote_endpoint)(node_id) )
 FC_REFLECT( bts::net::connection_rejected_message, (user_agent)(core_protocol_version)(remote_endpoint) )
 FC_REFLECT_EMPTY( bts::net::address_request_message )
 FC_REFLECT( bts::net::address_info, (remote_endpoint)(last_seen_time) )
 FC_REFLECT( bts::net::address_message, (addresses) )
+FC_REFLECT( bts::net::compressed_message, (original_msg_type)(original_size)(compressed_data) )
 
 #include <unordered_map>
 #include <fc/crypto/city.hpp>
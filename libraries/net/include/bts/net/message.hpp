@@ -6,6 +6,14 @@
 #include <fc/crypto/ripemd160.hpp>
 #include <fc/reflect/variant.hpp>
 
+#include <memory>
+#include <cstring>
+
+/** how long closing a connection waits for its queued messages to be written */
+#define BTS_NET_SEND_QUEUE_CLOSE_TIMEOUT_MS 1000
+/** send buffers that grew past this (e.g. for a large block) are released after use */
+#define BTS_NET_MAX_RETAINED_SEND_BUFFER_SIZE (1024*1024)
+
 namespace bts { namespace net {
 
   /**
@@ -29,14 +37,39 @@ namespace bts { namespace net {
   struct message : public message_header
   {
      std::vector<char> data;
+     /**
+      *  Set instead of data for a received message that is still in the socket's
+      *  receive buffer (see stcp_socket::read_shared), it points at the size bytes
+      *  of the message and keeps the buffer alive.  Use payload() to read either.
+      *
+      *  The slice pins the socket's entire receive buffer (BTS_NET_STCP_RECV_BUFFER_SIZE),
+      *  however small the message, and the reflection below only covers data.  Call
+      *  own_payload() before keeping a received message around or serializing it.
+      */
+     std::shared_ptr<const char> shared_data;
 
      message(){}
 
      message( message&& m )
-     :message_header(m),data( std::move(m.data) ){}
+     :message_header(m),data( std::move(m.data) ),shared_data( std::move(m.shared_data) ){}
 
      message( const message& m )
-     :message_header(m),data( m.data ){}
+     :message_header(m),data( m.data ),shared_data( m.shared_data ){}
+
+     /** @return the size bytes of the message */
+     const char* payload()const
+     {
+        return shared_data ? shared_data.get() : data.data();
+     }
+
+     /** copies a shared payload into data, releasing the receive buffer it was sliced from */
+     void own_payload()
+     {
+        if( !shared_data )
+           return;
+        data.assign( shared_data.get(), shared_data.get() + size );
+        shared_data.reset();
+     }
 
      /**
       *  Assumes that T::type specifies the message type
@@ -51,7 +84,7 @@ namespace bts { namespace net {
 
      fc::uint160_t id()const
      {
-        return fc::ripemd160::hash( data.data(), data.size() );
+        return fc::ripemd160::hash( payload(), size );
      }
 
 
@@ -66,9 +99,9 @@ namespace bts { namespace net {
          try {
           FC_ASSERT( msg_type == T::type );
           T tmp;
-          if( data.size() )
+          if( size )
           {
-             fc::datastream<const char*> ds( data.data(), data.size() );
+             fc::datastream<const char*> ds( payload(), size );
              fc::raw::unpack( ds, tmp );
           }
           else
@@ -87,8 +120,40 @@ namespace bts { namespace net {
      }
   };
 
+  /** the number of bytes m takes on the wire, see append_padded_message() */
+  inline size_t padded_message_size( const message& m )
+  {
+     return 16 * ((sizeof(message_header) + m.size + 15) / 16);
+  }
+
+  /**
+   *  Appends m to buffer the way it is sent on the wire: the header, the data and
+   *  zeros up to a multiple of 16 bytes for the cipher.
+   */
+  inline void append_padded_message( std::vector<char>& buffer, const message& m )
+  {
+     size_t size_with_padding = padded_message_size( m );
+     size_t offset = buffer.size();
+     buffer.resize( offset + size_with_padding );
+     memcpy( &buffer[offset], (const char*)&m, sizeof(message_header) );
+     if( m.size )
+        memcpy( &buffer[offset + sizeof(message_header)], m.payload(), m.size );
+  }
+
+  /** a message framed by append_padded_message(), shared by every send queue it is placed on */
+  typedef std::shared_ptr<const std::vector<char> > framed_message_ptr;
+
+  inline framed_message_ptr frame_message( const message& m )
+  {
+     auto buffer = std::make_shared<std::vector<char> >();
+     buffer->reserve( padded_message_size( m ) );
+     append_padded_message( *buffer, m );
+     return buffer;
+  }
+
 } } // bts::net
 
 
 FC_REFLECT( bts::net::message_header, (size)(msg_type) )
+// only data is reflected, so a received message must own_payload() before it is packed
 FC_REFLECT_DERIVED( bts::net::message, (bts::net::message_header), (data) )
@@ -1,6 +1,9 @@
 #pragma once
 #include <fc/network/tcp_socket.hpp>
 #include <bts/net/message.hpp>
+#include <fc/time.hpp>
+
+namespace fc { class thread; }
 
 namespace bts { namespace net {
 
@@ -8,30 +11,81 @@ namespace bts { namespace net {
 
   class message_oriented_connection;
 
+  /**
+   *  Outbound messages are queued in one lane per priority, and a lane is only written
+   *  when every lane before it is empty.
+   */
+  enum message_send_priority
+  {
+    new_block_send_priority   = 0,
+    transaction_send_priority = 1,
+    inventory_send_priority   = 2, /// also used for requests and other small control messages
+    sync_send_priority        = 3,
+    address_send_priority     = 4,
+    number_of_send_priorities = 5
+  };
+
+  /**
+   *  Characteristics of one direction of an in-memory link between two connections,
+   *  used to simulate a network without sockets (see connect_simulated()).
+   */
+  struct simulated_link_properties
+  {
+    simulated_link_properties() : latency(fc::milliseconds(50)), bytes_per_second(0), loss_rate(0) {}
+
+    fc::microseconds latency;
+    uint64_t         bytes_per_second; /// 0 for unlimited
+    /** 
+     *  fraction of writes that are lost.  Connections are reliable and ordered, so a lost
+     *  write shows up as a retransmission delay rather than as missing data
+     */
+    double           loss_rate;
+  };
+
   /** receives incoming messages from a message_oriented_connection object */
   class message_oriented_connection_delegate 
   {
   public:
     virtual void on_message(message_oriented_connection* originating_connection, const message& received_message) = 0;
     virtual void on_connection_closed(message_oriented_connection* originating_connection) = 0;
+    /** called each time a batch of queued messages has been written to the socket */
+    virtual void on_queued_messages_sent(message_oriented_connection* originating_connection) {}
   };
 
-  /** uses a secure socket to create a connection that reads and writes a stream of `fc::net::message` objects */
+  /** 
+   *  uses a secure socket to create a connection that reads and writes a stream of `fc::net::message` objects 
+   *
+   *  The connection must be used from the thread that created it, and the delegate is always called
+   *  on that thread.  If an io_thread is given, the socket is read, decrypted and split into
+   *  messages, and queued messages are encrypted and written, on that thread instead.
+   */
   class message_oriented_connection
   {
   public:
-    message_oriented_connection(message_oriented_connection_delegate* delegate = nullptr);
+    message_oriented_connection(message_oriented_connection_delegate* delegate = nullptr, fc::thread* io_thread = nullptr);
     ~message_oriented_connection();
     fc::tcp_socket& get_socket();
     void accept();
     void connect_to(const fc::ip::endpoint& remote_endpoint);
     void connect_to(const fc::ip::endpoint& remote_endpoint, const fc::ip::endpoint& local_endpoint);
 
-    void send_message(const message& message_to_send);
+    void send_message(const message& message_to_send, message_send_priority priority = inventory_send_priority);
+    /** @return bytes queued by send_message() that have not been handed to the socket yet */
+    size_t get_queued_bytes() const;
     void close_connection();
+
+    /**
+     *  Joins two unconnected connections with an in-memory link instead of a socket, messages
+     *  sent on one are delivered to the other after the delays given by the link properties.
+     *  Used for simulating many nodes in one process.
+     */
+    static void connect_simulated(message_oriented_connection& a, message_oriented_connection& b,
+                                  const simulated_link_properties& a_to_b, const simulated_link_properties& b_to_a);
   private:
     std::unique_ptr<detail::message_oriented_connection_impl> my;
   };
   typedef std::shared_ptr<message_oriented_connection> message_oriented_connection_ptr;
 
 } } // bts::net
+
+FC_REFLECT( bts::net::simulated_link_properties, (latency)(bytes_per_second)(loss_rate) )
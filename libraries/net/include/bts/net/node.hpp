@@ -1,6 +1,9 @@
 #pragma once
 #include <bts/net/core_messages.hpp>
 #include <bts/net/message.hpp>
+#include <bts/net/message_oriented_connection.hpp>
+
+#include <map>
 
 namespace bts { namespace net {
 
@@ -71,6 +74,85 @@ namespace bts { namespace net {
       fc::variant      info;
    };
 
+   /**
+    *  Totals for messages compressed for, or decompressed from, peers since the node started.
+    */
+   struct message_compression_statistics
+   {
+      message_compression_statistics()
+      :messages_compressed(0),raw_bytes_compressed(0),compressed_bytes_sent(0),
+       messages_decompressed(0),compressed_bytes_received(0),raw_bytes_decompressed(0){}
+
+      uint64_t messages_compressed;
+      uint64_t raw_bytes_compressed;   ///< size of those messages before compression
+      uint64_t compressed_bytes_sent;
+      uint64_t messages_decompressed;
+      uint64_t compressed_bytes_received;
+      uint64_t raw_bytes_decompressed;
+   };
+
+   /**
+    *  Count and total wire size of the messages of one type sent to and received from peers.
+    */
+   struct message_type_statistics
+   {
+      message_type_statistics()
+      :messages_received(0),bytes_received(0),messages_sent(0),bytes_sent(0){}
+
+      uint64_t messages_received;
+      uint64_t bytes_received;
+      uint64_t messages_sent;
+      uint64_t bytes_sent;
+   };
+
+   /**
+    *  Request-to-response latencies in power-of-two millisecond buckets: buckets[0] counts
+    *  responses faster than 1ms, buckets[i] those in [2^(i-1), 2^i) ms, and the last bucket
+    *  everything slower.
+    */
+   struct latency_histogram
+   {
+      enum { number_of_buckets = 16 };
+
+      latency_histogram()
+      :sample_count(0),total_latency_us(0),max_latency_us(0),buckets(number_of_buckets){}
+
+      void record( const fc::microseconds& latency );
+
+      uint64_t              sample_count;
+      uint64_t              total_latency_us;
+      uint64_t              max_latency_us;
+      std::vector<uint64_t> buckets;
+   };
+
+   /**
+    *  Traffic counters since the node started, and a snapshot of its queues.
+    */
+   struct network_statistics
+   {
+      network_statistics()
+      :active_connections(0),handshaking_connections(0),queued_send_bytes(0),max_peer_queued_send_bytes(0),
+       deferred_sync_item_requests(0),items_to_fetch(0),items_requested(0),new_inventory(0),
+       active_sync_requests(0),sync_backlog(0),unfetched_sync_items(0){}
+
+      /** keyed by message type, a core_message_type_enum or a message type of the client */
+      std::map<uint32_t, message_type_statistics> messages_by_type;
+      latency_histogram fetch_item_latency;                ///< sync and normal item requests
+      latency_histogram fetch_blockchain_item_ids_latency;
+
+      uint32_t active_connections;
+      uint32_t handshaking_connections;
+      uint64_t queued_send_bytes;            ///< waiting to be written, summed over all peers
+      uint64_t max_peer_queued_send_bytes;
+      uint32_t deferred_sync_item_requests;  ///< sync blocks peers asked for while their send queue was full
+      uint32_t items_to_fetch;               ///< advertised items we want but have not requested yet
+      uint32_t items_requested;              ///< item requests waiting for an answer
+      uint32_t new_inventory;                ///< items not yet advertised to peers
+      uint32_t active_sync_requests;         ///< sync blocks requested but not received
+      uint32_t sync_backlog;                 ///< sync blocks received that wait for an earlier block
+      uint32_t unfetched_sync_items;         ///< sync blocks peers have that we have not requested yet
+   };
+
    /**
     *  @class node
     *  @brief provides application independent P2P broadcast and data synchronization
@@ -92,6 +174,22 @@ namespace bts { namespace net {
 
         void      connect_to_p2p_network();
 
+        /**
+         *  Starts the node without a listening socket or outbound connection attempts, for
+         *  running many nodes in one process.  Peers are added with connect_to_simulated_node().
+         *
+         *  @param simulated_endpoint the address the node reports as its own to its peers
+         */
+        void      connect_to_simulated_network( const fc::ip::endpoint& simulated_endpoint );
+
+        /**
+         *  Connects this node to another node in the same process over an in-memory link with
+         *  the given latency, bandwidth and loss in each direction.  This node is the outbound
+         *  side and sends the hello.
+         */
+        void      connect_to_simulated_node( node& remote_node, const simulated_link_properties& outbound_link,
+                                             const simulated_link_properties& inbound_link );
+
         /**
          *  Add endpoint to internal level_map database of potential nodes
          *  to attempt to connect to.  This database is consulted any time
@@ -120,6 +218,23 @@ namespace bts { namespace net {
          */
         std::vector<peer_status> get_connected_peers()const;
 
+        /**
+         *  Sets the zlib level (1-9) used for large block and item id messages sent to
+         *  peers that accept compressed messages, 0 disables compression.  Saved with
+         *  the node configuration.
+         */
+        void      set_compression_level( int32_t compression_level );
+
+        /**
+         *  Spreads the reading, decryption and framing of peer messages, and the encryption and
+         *  writing of queued messages, over this many threads.  Messages are still handled on
+         *  the node's thread, in order.  0 (the default) does all I/O on the node's thread.
+         *  Applies to connections made afterwards, and is saved with the node configuration.
+         */
+        void      set_io_thread_count( uint32_t io_thread_count );
+        message_compression_statistics get_compression_statistics()const;
+        network_statistics             get_network_statistics()const;
+
         /**
          *  Add message to outgoing inventory list, notify peers that
          *  I have a message ready.
@@ -141,3 +256,12 @@ namespace bts { namespace net {
    typedef std::shared_ptr<node> node_ptr;
 
 } } // bts::net
+
+FC_REFLECT( bts::net::message_compression_statistics, (messages_compressed)(raw_bytes_compressed)(compressed_bytes_sent)
+                                                      (messages_decompressed)(compressed_bytes_received)(raw_bytes_decompressed) )
+FC_REFLECT( bts::net::message_type_statistics, (messages_received)(bytes_received)(messages_sent)(bytes_sent) )
+FC_REFLECT( bts::net::latency_histogram, (sample_count)(total_latency_us)(max_latency_us)(buckets) )
+FC_REFLECT( bts::net::network_statistics, (messages_by_type)(fetch_item_latency)(fetch_blockchain_item_ids_latency)
+                                          (active_connections)(handshaking_connections)(queued_send_bytes)(max_peer_queued_send_bytes)
+                                          (deferred_sync_item_requests)(items_to_fetch)(items_requested)(new_inventory)
+                                          (active_sync_requests)(sync_backlog)(unfetched_sync_items) )
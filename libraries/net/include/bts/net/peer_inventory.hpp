@@ -0,0 +1,98 @@
+#pragma once
+#include <bts/net/core_messages.hpp>
+
+#include <fc/time.hpp>
+
+#include <unordered_map>
+
+/** inventory we track per peer rotates to a new generation this often, or when a generation fills up */
+#define BTS_NET_INVENTORY_ROTATION_INTERVAL_SECONDS    300
+#define BTS_NET_MAX_INVENTORY_ITEMS_PER_GENERATION     10000
+
+namespace bts { namespace net {
+
+  /**
+   *  The inventory we know a peer has, either because it advertised the item to us or because we
+   *  advertised it to the peer.  Entries are kept in two generations.  When the current generation
+   *  fills up or is older than the rotation interval, it replaces the previous generation and the
+   *  old previous generation is dropped.  Entries therefore expire after one to two intervals, and
+   *  a peer never costs more than twice max_items_per_generation entries no matter how long the
+   *  connection lives.
+   */
+  class peer_inventory
+  {
+  public:
+    enum inventory_flags 
+    { 
+      advertised_to_peer = 0x01,
+      advertised_to_us   = 0x02
+    };
+
+    peer_inventory(uint32_t max_items_per_generation = BTS_NET_MAX_INVENTORY_ITEMS_PER_GENERATION,
+                   fc::microseconds rotation_interval = fc::seconds(BTS_NET_INVENTORY_ROTATION_INTERVAL_SECONDS)) :
+      _max_items_per_generation(max_items_per_generation),
+      _rotation_interval(rotation_interval),
+      _current_generation_start(fc::time_point::now())
+    {}
+
+    /** @return the inventory_flags recorded for the item, or 0 if we know nothing about it */
+    uint8_t get(const item_id& item) const
+    {
+      auto iter = _current.find(item);
+      if (iter != _current.end())
+        return iter->second;
+      iter = _previous.find(item);
+      return iter != _previous.end() ? iter->second : 0;
+    }
+
+    /** adds flags to the item, refreshing it into the current generation */
+    void set(const item_id& item, uint8_t flags)
+    {
+      rotate_if_needed();
+      auto result = _current.insert(generation_map::value_type(item, flags));
+      if (result.second)
+      {
+        auto previous_iter = _previous.find(item);
+        if (previous_iter != _previous.end())
+        {
+          result.first->second |= previous_iter->second;
+          _previous.erase(previous_iter);
+        }
+      }
+      else
+        result.first->second |= flags;
+    }
+
+    void clear(const item_id& item, uint8_t flags)
+    {
+      auto iter = _current.find(item);
+      if (iter != _current.end())
+        iter->second &= ~flags;
+      iter = _previous.find(item);
+      if (iter != _previous.end())
+        iter->second &= ~flags;
+    }
+
+    size_t size() const { return _current.size() + _previous.size(); }
+
+  private:
+    typedef std::unordered_map<item_id, uint8_t> generation_map;
+
+    void rotate_if_needed()
+    {
+      if (_current.size() < _max_items_per_generation &&
+          fc::time_point::now() < _current_generation_start + _rotation_interval)
+        return;
+      _previous.swap(_current);
+      _current.clear();
+      _current_generation_start = fc::time_point::now();
+    }
+
+    uint32_t         _max_items_per_generation;
+    fc::microseconds _rotation_interval;
+    generation_map   _current;
+    generation_map   _previous;
+    fc::time_point   _current_generation_start;
+  };
+
+} } // bts::net
@@ -3,6 +3,13 @@
 #include <fc/crypto/aes.hpp>
 #include <fc/crypto/elliptic.hpp>
 
+#include <memory>
+
+/** decrypted data is buffered in chunks of this size, larger reads bypass the buffer */
+#define BTS_NET_STCP_RECV_BUFFER_SIZE (64*1024)
+/** the most writesome() encrypts in one pass */
+#define BTS_NET_STCP_SEND_BUFFER_SIZE (64*1024)
+
 namespace bts { namespace net {
 
 /**
@@ -23,19 +30,52 @@ class stcp_socket : public virtual fc::iostream
     virtual size_t   readsome( char* buffer, size_t max );
     virtual bool     eof()const;
 
+    /**
+     *  Makes the next len decrypted bytes contiguous in the receive buffer and returns
+     *  them without consuming them.
+     *
+     *  @param len must be a multiple of 16 and no larger than BTS_NET_STCP_RECV_BUFFER_SIZE
+     */
+    const char*      peek( size_t len );
+    /**
+     *  Consumes len bytes like read(), but returns them where they are in the receive
+     *  buffer, sharing ownership of it, so a message can be handed on without copying.
+     *  The socket moves to a new receive buffer rather than overwrite shared bytes.
+     *
+     *  @param len must be a multiple of 16 and no larger than BTS_NET_STCP_RECV_BUFFER_SIZE
+     */
+    std::shared_ptr<const char> read_shared( size_t len );
+
     virtual size_t   writesome( const char* buffer, size_t len );
+    /**
+     *  Encrypts the whole buffer in one pass, overwriting it with the ciphertext,
+     *  and writes it without copying.
+     *
+     *  @param len must be a multiple of 16
+     */
+    void             encrypt_and_write( char* buffer, size_t len );
     virtual void     flush();
     virtual void     close();
 
     void             get( char& c ) { read( &c, 1 ); }
 
   private:
-    void do_key_exchange();
+    void   do_key_exchange();
+    /** reads at least 16 bytes, a multiple of 16, and decrypts them in place */
+    size_t read_and_decrypt( char* buffer, size_t len );
+    /** moves the unread bytes to the front of a receive buffer that nothing else shares */
+    void   compact_recv_buffer();
 
-    fc::ecc::private_key _priv_key;
-    fc::array<char,8>    _buf;
-    uint32_t             _buf_len;
-    fc::tcp_socket       _sock;
+    fc::ecc::private_key    _priv_key;
+    /**
+     *  decrypted bytes [_recv_pos,_recv_end) have not been returned by readsome yet,
+     *  bytes before _recv_pos may be shared by messages returned by read_shared()
+     */
+    std::shared_ptr<char>   _recv_buffer;
+    size_t                  _recv_pos;
+    size_t                  _recv_end;
+    std::unique_ptr<char[]> _send_buffer;
+    fc::tcp_socket          _sock;
     fc::aes_encoder      _send_aes;
     fc::aes_decoder      _recv_aes;
 };
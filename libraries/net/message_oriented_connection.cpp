@@ -6,6 +6,24 @@
 #include <bts/net/message_oriented_connection.hpp>
 #include <bts/net/stcp_socket.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <vector>
+
+/** the most bytes written from one lane before higher priority lanes are checked again */
+#define BTS_NET_MAX_SEND_BATCH_SIZE (64*1024)
+/** the shortest delay added to a simulated write that was lost, like a TCP retransmission timeout */
+#define BTS_NET_MIN_SIMULATED_RETRANSMIT_DELAY_MS 200
+/**
+ *  how far the I/O thread reads ahead of a busy delegate.  Counted in messages too, because each
+ *  message still in the receive buffer keeps that whole buffer alive
+ */
+#define BTS_NET_MAX_UNDELIVERED_MESSAGE_BYTES (1024*1024)
+#define BTS_NET_MAX_UNDELIVERED_MESSAGES      64
+
 namespace bts { namespace net {
   namespace detail
   {
@@ -13,26 +31,176 @@ namespace bts { namespace net {
     {
     private:
       message_oriented_connection* _self;
-      message_oriented_connection_delegate *_delegate;
+      message_oriented_connection_delegate *_delegate; /// only used on _owner_thread
       stcp_socket _sock;
       fc::future<void> _read_loop_done;
+
+      fc::thread* _owner_thread; /// the thread that created us, where the delegate is called
+      fc::thread* _io_thread;    /// runs the read and send loops if set, otherwise they run on _owner_thread
+      /** the task on the owner thread that hands _undelivered_messages to the delegate */
+      fc::future<void> _previous_delivery;
+
+      /// messages read on the I/O thread that the delegate hasn't seen yet, oldest first
+      /// @{
+      std::mutex             _undelivered_mutex;
+      std::deque<message>    _undelivered_messages;
+      size_t                 _undelivered_bytes;
+      bool                   _delivery_posted;   /// a delivery task is queued or running on the owner thread
+      bool                   _close_undelivered; /// the connection closed after the messages in the queue
+      fc::promise<void>::ptr _undelivered_space_available; /// the read loop waits on this while the queue is full
+      /// @}
+      fc::future<void> _previous_sent_notification;
+
+      /** messages of one message_send_priority waiting to be written */
+      struct send_lane
+      {
+        std::vector<char>  bytes;       /// framed messages, oldest first
+        std::deque<size_t> frame_sizes; /// padded size of each message in bytes
+      };
+      send_lane _send_lanes[number_of_send_priorities];
+      std::atomic<size_t> _queued_byte_count; /// added to on the owner thread, taken from on the I/O thread
+      /** the batch being written, swapped with a lane's bytes when the whole lane fits so both keep their capacity */
+      std::vector<char> _bytes_being_sent;
+      fc::future<void> _send_queued_messages_done;
+      std::atomic<bool> _closed;
+
+      /// in-memory link used instead of _sock by connect_simulated()
+      /// @{
+      bool                                 _simulated;
+      message_oriented_connection_impl*    _simulated_peer; /// null once either side closes
+      simulated_link_properties            _simulated_link; /// our side's outbound direction
+      fc::time_point                       _last_simulated_arrival;
+      bool                                 _simulated_disconnected;
+      std::deque<std::pair<fc::time_point, std::vector<char> > > _simulated_inbox; /// writes from the peer with their arrival times
+      size_t                               _simulated_inbox_read_pos; /// bytes already read from the front of the inbox
+      fc::promise<void>::ptr               _simulated_data_arrived_promise;
+      std::mt19937                         _simulated_loss_generator;
+      /// @}
+
       void read_loop();
-      void start_read_loop();
+      void read_from_peer(char* buffer, size_t length);
+      void deliver_received_message(message& received_message);
+      void deliver_message(message& received_message);
+      void queue_delivery(message* received_message);
+      void deliver_queued_messages();
+      void notify_connection_closed();
+      void notify_queued_messages_sent();
+      void stop_io_loops();
+      void enqueue_message(const message& message_to_send, message_send_priority priority);
+      void send_queued_messages_loop();
+      bool take_next_batch();
+      void clear_send_lanes();
+      void close_socket();
+
+      void simulated_read(char* buffer, size_t length);
+      void simulated_write(const char* buffer, size_t length);
+      void on_simulated_data(const fc::time_point& arrival_time, std::vector<char>&& data);
+      void on_simulated_disconnect();
+      void wake_simulated_read();
+
+      /** runs f on the I/O thread and waits for it, or just runs it if there is no I/O thread */
+      template<typename Functor>
+      void run_on_io_thread(Functor&& f)
+      {
+        if (_io_thread && !_io_thread->is_current())
+          _io_thread->async(std::forward<Functor>(f)).wait();
+        else
+          f();
+      }
     public:
       fc::tcp_socket& get_socket();
       void accept();
       void connect_to(const fc::ip::endpoint& remote_endpoint);
       void connect_to(const fc::ip::endpoint& remote_endpoint, const fc::ip::endpoint& local_endpoint);
 
-      message_oriented_connection_impl(message_oriented_connection* self, message_oriented_connection_delegate* delegate = nullptr);
-      void send_message(const message& message_to_send);
+      message_oriented_connection_impl(message_oriented_connection* self, message_oriented_connection_delegate* delegate = nullptr,
+                                       fc::thread* io_thread = nullptr);
+      ~message_oriented_connection_impl();
+      void send_message(const message& message_to_send, message_send_priority priority);
+      size_t get_queued_bytes() const { return _queued_byte_count; }
       void close_connection();
+      static void connect_simulated(message_oriented_connection_impl& a, message_oriented_connection_impl& b,
+                                    const simulated_link_properties& a_to_b, const simulated_link_properties& b_to_a);
     };
 
-    message_oriented_connection_impl::message_oriented_connection_impl(message_oriented_connection* self, message_oriented_connection_delegate* delegate) : 
+    message_oriented_connection_impl::message_oriented_connection_impl(message_oriented_connection* self, message_oriented_connection_delegate* delegate,
+                                                                       fc::thread* io_thread) : 
       _self(self),
-      _delegate(delegate)
+      _delegate(delegate),
+      _owner_thread(&fc::thread::current()),
+      _io_thread(io_thread),
+      _undelivered_bytes(0),
+      _delivery_posted(false),
+      _close_undelivered(false),
+      _queued_byte_count(0),
+      _closed(false),
+      _simulated(false),
+      _simulated_peer(nullptr),
+      _simulated_disconnected(false),
+      _simulated_inbox_read_pos(0),
+      _simulated_loss_generator(std::random_device()())
+    {
+    }
+
+    message_oriented_connection_impl::~message_oriented_connection_impl()
+    {
+      // the delegate is going away with us, so it isn't told about the close or anything still in flight
+      _delegate = nullptr;
+
+      if (_simulated)
+      {
+        if (_simulated_peer)
+          _simulated_peer->on_simulated_disconnect();
+        _simulated_peer = nullptr;
+      }
+
+      try
+      {
+        run_on_io_thread([=](){ stop_io_loops(); });
+
+        // deliveries already handed to this thread do nothing now, but they refer to us
+        if (_previous_delivery.valid() && !_previous_delivery.ready())
+          _previous_delivery.wait();
+        if (_previous_sent_notification.valid() && !_previous_sent_notification.ready())
+          _previous_sent_notification.wait();
+      }
+      catch (const fc::exception& e)
+      {
+        wlog("exception while stopping connection loops: ${e}", ("e", e.to_detail_string()));
+      }
+    }
+
+    void message_oriented_connection_impl::stop_io_loops()
     {
+      try
+      {
+        if (_send_queued_messages_done.valid() && !_send_queued_messages_done.ready())
+        {
+          _send_queued_messages_done.cancel();
+          _send_queued_messages_done.wait();
+        }
+      }
+      catch (const fc::exception& e)
+      {
+        wlog("exception while stopping send loop: ${e}", ("e", e.to_detail_string()));
+      }
+
+      // unlike a socket read on the owner thread, these read loops refer to this object while they wait
+      if (_simulated || _io_thread)
+      {
+        try
+        {
+          if (_read_loop_done.valid() && !_read_loop_done.ready())
+          {
+            _read_loop_done.cancel();
+            _read_loop_done.wait();
+          }
+        }
+        catch (const fc::exception& e)
+        {
+          wlog("exception while stopping read loop: ${e}", ("e", e.to_detail_string()));
+        }
+      }
     }
 
     fc::tcp_socket& message_oriented_connection_impl::get_socket()
@@ -42,20 +210,26 @@ namespace bts { namespace net {
 
     void message_oriented_connection_impl::accept()
     {
-      _sock.accept();
-      _read_loop_done = fc::async([=](){ read_loop(); });
+      run_on_io_thread([&](){
+        _sock.accept();
+        _read_loop_done = fc::async([=](){ read_loop(); });
+      });
     }
 
     void message_oriented_connection_impl::connect_to(const fc::ip::endpoint& remote_endpoint)
     {
-      _sock.connect_to(remote_endpoint);
-      _read_loop_done = fc::async([=](){ read_loop(); });
+      run_on_io_thread([&](){
+        _sock.connect_to(remote_endpoint);
+        _read_loop_done = fc::async([=](){ read_loop(); });
+      });
     }
 
     void message_oriented_connection_impl::connect_to(const fc::ip::endpoint& remote_endpoint, const fc::ip::endpoint& local_endpoint)
     {
-      _sock.connect_to(remote_endpoint, local_endpoint);
-      _read_loop_done = fc::async([=](){ read_loop(); });
+      run_on_io_thread([&](){
+        _sock.connect_to(remote_endpoint, local_endpoint);
+        _read_loop_done = fc::async([=](){ read_loop(); });
+      });
     }
 
 
@@ -70,80 +244,470 @@ namespace bts { namespace net {
         message m;
         while( true )
         {
+          if (!_simulated)
+          {
+            // messages that fit in the receive buffer are handed on where they were decrypted
+            memcpy((char*)&m, _sock.peek(BUFFER_SIZE), sizeof(message_header));
+            size_t padded_size = padded_message_size(m);
+            if (padded_size <= BTS_NET_STCP_RECV_BUFFER_SIZE)
+            {
+              std::shared_ptr<const char> framed = _sock.read_shared(padded_size);
+              m.shared_data = std::shared_ptr<const char>(framed, framed.get() + sizeof(message_header));
+              m.data.clear();
+              deliver_received_message(m);
+              continue;
+            }
+          }
+
           char buffer[BUFFER_SIZE];
-          _sock.read(buffer, BUFFER_SIZE);
+          read_from_peer(buffer, BUFFER_SIZE);
           memcpy((char*)&m, buffer, sizeof(message_header));
+          m.shared_data.reset();
 
           size_t remaining_bytes_with_padding = 16 * ((m.size - LEFTOVER + 15) / 16);
           m.data.resize(LEFTOVER + remaining_bytes_with_padding); //give extra 16 bytes to allow for padding added in send call
           std::copy(buffer + sizeof(message_header), buffer + sizeof(buffer), m.data.begin());
           if (remaining_bytes_with_padding)
-            _sock.read(&m.data[LEFTOVER], remaining_bytes_with_padding);
+            read_from_peer(&m.data[LEFTOVER], remaining_bytes_with_padding);
           m.data.resize(m.size); // truncate off the padding bytes
-
-          try 
-          { 
-            // message handling errors are warnings...
-            _delegate->on_message(_self, m);
-          } 
-          /// Dedicated catches needed to distinguish from general fc::exception
-          catch ( fc::canceled_exception& e ) { throw e; }
-          catch ( fc::eof_exception& e ) { throw e; }
-          catch ( fc::exception& e ) 
-          { 
-            /// Here loop should be continued so exception should be just caught locally.
-            wlog( "message transmission failed ${er}", ("er", e.to_detail_string() ) );
-          }
+          deliver_received_message(m);
         }
       } 
       catch ( const fc::canceled_exception& e )
       {
         wlog( "disconnected ${e}", ("e", e.to_detail_string() ) );
-        _delegate->on_connection_closed(_self);
+        notify_connection_closed();
       }
       catch ( const fc::eof_exception& e )
       {
         wlog( "disconnected ${e}", ("e", e.to_detail_string() ) );
-        _delegate->on_connection_closed(_self);
+        notify_connection_closed();
       }
       catch ( fc::exception& e )
       {
         elog( "disconnected ${er}", ("er", e.to_detail_string() ) );
-        _delegate->on_connection_closed(_self);
+        notify_connection_closed();
 
         FC_RETHROW_EXCEPTION( e, warn, "disconnected ${e}", ("e", e.to_detail_string() ) );
       }
       catch ( ... )
       {
-        _delegate->on_connection_closed(_self);
+        notify_connection_closed();
         FC_THROW_EXCEPTION( unhandled_exception, "disconnected: {e}", ("e", fc::except_str() ) );
       }
     }
 
-    void message_oriented_connection_impl::send_message(const message& message_to_send)
+    void message_oriented_connection_impl::deliver_received_message(message& received_message)
+    {
+      try 
+      { 
+        // message handling errors are warnings...
+        deliver_message(received_message);
+      } 
+      /// Dedicated catches needed to distinguish from general fc::exception
+      catch ( fc::canceled_exception& e ) { throw e; }
+      catch ( fc::eof_exception& e ) { throw e; }
+      catch ( fc::exception& e ) 
+      { 
+        /// Here loop should be continued so exception should be just caught locally.
+        wlog( "message transmission failed ${er}", ("er", e.to_detail_string() ) );
+      }
+    }
+
+    /**
+     *  With an I/O thread, the message is queued for the owner thread and we go back to reading the next
+     *  one while the delegate handles it.  The delegate still sees messages one at a time and in order.
+     *  Once BTS_NET_MAX_UNDELIVERED_MESSAGE_BYTES or BTS_NET_MAX_UNDELIVERED_MESSAGES are waiting beyond
+     *  the batch the delegate is working through, we stop reading until it catches up, so a slow delegate
+     *  slows down our reading rather than piling up messages in memory.
+     */
+    void message_oriented_connection_impl::deliver_message(message& received_message)
+    {
+      if (!_io_thread)
+      {
+        _delegate->on_message(_self, received_message);
+        return;
+      }
+
+      for (;;)
+      {
+        fc::promise<void>::ptr space_available;
+        {
+          std::lock_guard<std::mutex> lock(_undelivered_mutex);
+          if (_undelivered_bytes < BTS_NET_MAX_UNDELIVERED_MESSAGE_BYTES &&
+              _undelivered_messages.size() < BTS_NET_MAX_UNDELIVERED_MESSAGES)
+            break;
+          if (!_undelivered_space_available)
+            _undelivered_space_available = fc::promise<void>::ptr(new fc::promise<void>());
+          space_available = _undelivered_space_available;
+        }
+        space_available->wait();
+      }
+      queue_delivery(&received_message);
+    }
+
+    /** on the I/O thread, queues the message, or the close if it is null, behind the undelivered messages */
+    void message_oriented_connection_impl::queue_delivery(message* received_message)
+    {
+      bool post_delivery = false;
+      {
+        std::lock_guard<std::mutex> lock(_undelivered_mutex);
+        if (received_message)
+        {
+          _undelivered_bytes += received_message->size;
+          _undelivered_messages.push_back(std::move(*received_message));
+        }
+        else
+          _close_undelivered = true;
+        if (!_delivery_posted)
+          post_delivery = _delivery_posted = true;
+      }
+      if (post_delivery)
+        _previous_delivery = _owner_thread->async([=](){ deliver_queued_messages(); });
+    }
+
+    /** on the owner thread, hands the queued messages, then the close if there was one, to the delegate */
+    void message_oriented_connection_impl::deliver_queued_messages()
+    {
+      for (;;)
+      {
+        std::deque<message> messages_to_deliver;
+        bool connection_closed = false;
+        fc::promise<void>::ptr space_available;
+        {
+          std::lock_guard<std::mutex> lock(_undelivered_mutex);
+          if (_undelivered_messages.empty() && !_close_undelivered)
+          {
+            _delivery_posted = false;
+            return;
+          }
+          messages_to_deliver.swap(_undelivered_messages);
+          _undelivered_bytes = 0;
+          std::swap(connection_closed, _close_undelivered);
+          space_available.swap(_undelivered_space_available);
+        }
+
+        // the read loop waits on the I/O thread, so that's where it is woken
+        if (space_available)
+          _io_thread->async([=](){ space_available->set_value(); });
+
+        for (const message& message_to_deliver : messages_to_deliver)
+        {
+          if (!_delegate)
+            break;
+          try
+          {
+            _delegate->on_message(_self, message_to_deliver);
+          }
+          catch (const fc::exception& e)
+          {
+            wlog( "message transmission failed ${er}", ("er", e.to_detail_string() ) );
+          }
+        }
+        if (connection_closed && _delegate)
+          _delegate->on_connection_closed(_self);
+      }
+    }
+
+    void message_oriented_connection_impl::notify_connection_closed()
+    {
+      if (!_io_thread)
+      {
+        if (_delegate)
+          _delegate->on_connection_closed(_self);
+        return;
+      }
+      queue_delivery(nullptr);
+    }
+
+    void message_oriented_connection_impl::notify_queued_messages_sent()
+    {
+      auto notify = [=](){
+        if (!_delegate)
+          return;
+        try
+        {
+          _delegate->on_queued_messages_sent(_self);
+        }
+        catch (const fc::exception& e)
+        {
+          wlog("exception in on_queued_messages_sent: ${e}", ("e", e.to_detail_string()));
+        }
+      };
+      if (_io_thread)
+        _previous_sent_notification = _owner_thread->async(notify);
+      else
+        notify();
+    }
+
+    void message_oriented_connection_impl::read_from_peer(char* buffer, size_t length)
+    {
+      if (_simulated)
+        simulated_read(buffer, length);
+      else
+        _sock.read(buffer, length);
+    }
+
+    /**
+     *  Frames the message into its priority's lane and returns without waiting for it
+     *  to be written.  Messages queued while a write is in progress are written together
+     *  in the following batches.
+     */
+    void message_oriented_connection_impl::send_message(const message& message_to_send, message_send_priority priority)
     {
       try 
       {
-        size_t size_of_message_and_header = sizeof(message_header) + message_to_send.size;
-        //pad the message we send to a multiple of 16 bytes
-        size_t size_with_padding = 16 * ((size_of_message_and_header + 15) / 16);
-        std::unique_ptr<char[]> padded_message(new char[size_with_padding]);
-        memcpy(padded_message.get(), (char*)&message_to_send, sizeof(message_header));
-        memcpy(padded_message.get() + sizeof(message_header), message_to_send.data.data(), message_to_send.size );
-        _sock.write(padded_message.get(), size_with_padding);
-        _sock.flush();
+        FC_ASSERT(!_closed, "connection is closed");
+        FC_ASSERT(priority < number_of_send_priorities);
+        // counted here so get_queued_bytes() includes it before the I/O thread gets to it
+        _queued_byte_count += padded_message_size(message_to_send);
+        if (_io_thread && !_io_thread->is_current())
+          _io_thread->async([=](){ enqueue_message(message_to_send, priority); });
+        else
+          enqueue_message(message_to_send, priority);
       } FC_RETHROW_EXCEPTIONS( warn, "unable to send message" );    
     }
 
+    void message_oriented_connection_impl::enqueue_message(const message& message_to_send, message_send_priority priority)
+    {
+      send_lane& lane = _send_lanes[priority];
+      size_t size_before = lane.bytes.size();
+      append_padded_message(lane.bytes, message_to_send);
+      lane.frame_sizes.push_back(lane.bytes.size() - size_before);
+
+      if (!_send_queued_messages_done.valid() || _send_queued_messages_done.ready())
+        _send_queued_messages_done = fc::async([=](){ send_queued_messages_loop(); });
+    }
+
+    /**
+     *  Moves up to BTS_NET_MAX_SEND_BATCH_SIZE bytes (but at least one message) from the
+     *  highest priority lane that has anything queued into _bytes_being_sent.
+     *
+     *  @return false if nothing is queued
+     */
+    bool message_oriented_connection_impl::take_next_batch()
+    {
+      for (send_lane& lane : _send_lanes)
+      {
+        if (lane.frame_sizes.empty())
+          continue;
+
+        size_t batch_size = 0;
+        size_t frames_in_batch = 0;
+        while (frames_in_batch < lane.frame_sizes.size() &&
+               (frames_in_batch == 0 || batch_size + lane.frame_sizes[frames_in_batch] <= BTS_NET_MAX_SEND_BATCH_SIZE))
+          batch_size += lane.frame_sizes[frames_in_batch++];
+
+        _bytes_being_sent.clear();
+        if (frames_in_batch == lane.frame_sizes.size())
+        {
+          _bytes_being_sent.swap(lane.bytes);
+          lane.frame_sizes.clear();
+        }
+        else
+        {
+          _bytes_being_sent.assign(lane.bytes.begin(), lane.bytes.begin() + batch_size);
+          lane.bytes.erase(lane.bytes.begin(), lane.bytes.begin() + batch_size);
+          lane.frame_sizes.erase(lane.frame_sizes.begin(), lane.frame_sizes.begin() + frames_in_batch);
+        }
+        _queued_byte_count -= batch_size;
+        return true;
+      }
+      return false;
+    }
+
+    void message_oriented_connection_impl::clear_send_lanes()
+    {
+      for (send_lane& lane : _send_lanes)
+      {
+        _queued_byte_count -= lane.bytes.size();
+        lane.bytes.clear();
+        lane.frame_sizes.clear();
+      }
+    }
+
+    void message_oriented_connection_impl::send_queued_messages_loop()
+    {
+      try
+      {
+        while (take_next_batch())
+        {
+          if (_simulated)
+            simulated_write(_bytes_being_sent.data(), _bytes_being_sent.size());
+          else
+          {
+            _sock.encrypt_and_write(_bytes_being_sent.data(), _bytes_being_sent.size());
+            if (!_queued_byte_count)
+              _sock.flush();
+          }
+          if (_bytes_being_sent.capacity() > BTS_NET_MAX_RETAINED_SEND_BUFFER_SIZE)
+            std::vector<char>().swap(_bytes_being_sent);
+
+          // lets the delegate queue more work, e.g. sync items it held back while we were behind
+          notify_queued_messages_sent();
+        }
+      }
+      catch (const fc::canceled_exception&)
+      {
+        clear_send_lanes();
+        throw;
+      }
+      catch (const fc::exception& e)
+      {
+        // nobody is waiting on this write, so the error is reported by closing the
+        // socket, the read loop will then notify the delegate
+        wlog("unable to send queued messages, closing connection: ${e}", ("e", e.to_detail_string()));
+        clear_send_lanes();
+        _closed = true;
+        try
+        {
+          close_socket();
+        }
+        catch (const fc::exception&)
+        {
+        }
+      }
+    }
+
+    void message_oriented_connection_impl::close_socket()
+    {
+      if (!_simulated)
+      {
+        _sock.close();
+        return;
+      }
+
+      // the peer still reads what is in flight to it, but a closed socket reads nothing more
+      if (_simulated_peer)
+        _simulated_peer->on_simulated_disconnect();
+      _simulated_peer = nullptr;
+      _simulated_disconnected = true;
+      _simulated_inbox.clear();
+      _simulated_inbox_read_pos = 0;
+      wake_simulated_read();
+    }
+
     void message_oriented_connection_impl::close_connection()
     {
-      _sock.close();
+      // give messages queued before the close, like a connection_rejected_message, a
+      // chance to reach the peer
+      _closed = true;
+      run_on_io_thread([=](){
+        if (_send_queued_messages_done.valid() && !_send_queued_messages_done.ready())
+        {
+          try
+          {
+            _send_queued_messages_done.wait(fc::milliseconds(BTS_NET_SEND_QUEUE_CLOSE_TIMEOUT_MS));
+          }
+          catch (const fc::timeout_exception&)
+          {
+            wlog("closing connection with ${bytes} bytes still queued", ("bytes", size_t(_queued_byte_count)));
+          }
+        }
+        close_socket();
+      });
+    }
+
+    void message_oriented_connection_impl::connect_simulated(message_oriented_connection_impl& a, message_oriented_connection_impl& b,
+                                                             const simulated_link_properties& a_to_b, const simulated_link_properties& b_to_a)
+    {
+      FC_ASSERT(!a._simulated && !b._simulated, "connection is already connected");
+      FC_ASSERT(a_to_b.loss_rate >= 0 && a_to_b.loss_rate < 1 && b_to_a.loss_rate >= 0 && b_to_a.loss_rate < 1);
+      // the two ends hand data to each other directly, so both stay on the thread that created them
+      a._io_thread = nullptr;
+      b._io_thread = nullptr;
+      a._simulated = true;
+      a._simulated_peer = &b;
+      a._simulated_link = a_to_b;
+      b._simulated = true;
+      b._simulated_peer = &a;
+      b._simulated_link = b_to_a;
+      a._read_loop_done = fc::async([&a](){ a.read_loop(); });
+      b._read_loop_done = fc::async([&b](){ b.read_loop(); });
+    }
+
+    /** blocks until length bytes sent by the peer have arrived, throws eof once the link is down and drained */
+    void message_oriented_connection_impl::simulated_read(char* buffer, size_t length)
+    {
+      while (length)
+      {
+        if (_simulated_inbox.empty())
+        {
+          if (_simulated_disconnected)
+            FC_THROW_EXCEPTION(fc::eof_exception, "simulated connection closed");
+          _simulated_data_arrived_promise = fc::promise<void>::ptr(new fc::promise<void>());
+          _simulated_data_arrived_promise->wait();
+          _simulated_data_arrived_promise.reset();
+          continue;
+        }
+
+        fc::time_point now = fc::time_point::now();
+        if (_simulated_inbox.front().first > now)
+        {
+          fc::usleep(_simulated_inbox.front().first - now);
+          continue;
+        }
+
+        std::vector<char>& front = _simulated_inbox.front().second;
+        size_t bytes_to_copy = std::min(length, front.size() - _simulated_inbox_read_pos);
+        memcpy(buffer, front.data() + _simulated_inbox_read_pos, bytes_to_copy);
+        buffer += bytes_to_copy;
+        length -= bytes_to_copy;
+        _simulated_inbox_read_pos += bytes_to_copy;
+        if (_simulated_inbox_read_pos == front.size())
+        {
+          _simulated_inbox.pop_front();
+          _simulated_inbox_read_pos = 0;
+        }
+      }
+    }
+
+    /**
+     *  Holds the send loop for as long as the link's bandwidth needs to carry the bytes, then
+     *  hands them to the peer to be read after the link's latency.  Arrival times never go
+     *  backwards, so a delayed (lost) write also delays everything written after it.
+     */
+    void message_oriented_connection_impl::simulated_write(const char* buffer, size_t length)
+    {
+      FC_ASSERT(_simulated_peer, "simulated connection closed");
+      if (_simulated_link.bytes_per_second)
+        fc::usleep(fc::microseconds(length * 1000000 / _simulated_link.bytes_per_second));
+      FC_ASSERT(_simulated_peer, "simulated connection closed");
+
+      fc::time_point arrival_time = fc::time_point::now() + _simulated_link.latency;
+      if (_simulated_link.loss_rate > 0 &&
+          std::uniform_real_distribution<double>(0, 1)(_simulated_loss_generator) < _simulated_link.loss_rate)
+        arrival_time += std::max<fc::microseconds>(fc::milliseconds(BTS_NET_MIN_SIMULATED_RETRANSMIT_DELAY_MS),
+                                                   fc::microseconds(_simulated_link.latency.count() * 2));
+      arrival_time = std::max(arrival_time, _last_simulated_arrival);
+      _last_simulated_arrival = arrival_time;
+
+      _simulated_peer->on_simulated_data(arrival_time, std::vector<char>(buffer, buffer + length));
+    }
+
+    void message_oriented_connection_impl::on_simulated_data(const fc::time_point& arrival_time, std::vector<char>&& data)
+    {
+      _simulated_inbox.emplace_back(arrival_time, std::move(data));
+      wake_simulated_read();
+    }
+
+    void message_oriented_connection_impl::on_simulated_disconnect()
+    {
+      _simulated_peer = nullptr;
+      _simulated_disconnected = true;
+      wake_simulated_read();
+    }
+
+    void message_oriented_connection_impl::wake_simulated_read()
+    {
+      if (_simulated_data_arrived_promise && !_simulated_data_arrived_promise->ready())
+        _simulated_data_arrived_promise->set_value();
     }
   } // end namespace bts::net::detail
 
 
-  message_oriented_connection::message_oriented_connection(message_oriented_connection_delegate* delegate) : 
-    my(new detail::message_oriented_connection_impl(this, delegate))
+  message_oriented_connection::message_oriented_connection(message_oriented_connection_delegate* delegate, fc::thread* io_thread) : 
+    my(new detail::message_oriented_connection_impl(this, delegate, io_thread))
   {
   }
 
@@ -171,9 +735,14 @@ namespace bts { namespace net {
     my->connect_to(remote_endpoint, local_endpoint);
   }
   
-  void message_oriented_connection::send_message(const message& message_to_send)
+  void message_oriented_connection::send_message(const message& message_to_send, message_send_priority priority)
   {
-    my->send_message(message_to_send);
+    my->send_message(message_to_send, priority);
+  }
+
+  size_t message_oriented_connection::get_queued_bytes() const
+  {
+    return my->get_queued_bytes();
   }
 
   void message_oriented_connection::close_connection()
@@ -181,4 +750,10 @@ namespace bts { namespace net {
     my->close_connection();
   }
 
+  void message_oriented_connection::connect_simulated(message_oriented_connection& a, message_oriented_connection& b,
+                                                      const simulated_link_properties& a_to_b, const simulated_link_properties& b_to_a)
+  {
+    detail::message_oriented_connection_impl::connect_simulated(*a.my, *b.my, a_to_b, b_to_a);
+  }
+
 } } // end namespace bts::net
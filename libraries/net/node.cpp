@@ -2,13 +2,16 @@
 #include <iomanip>
 #include <deque>
 #include <unordered_set>
+#include <unordered_map>
 #include <list>
+#include <algorithm>
 //#include <deque>
 #include <boost/tuple/tuple.hpp>
 #include <boost/circular_buffer.hpp>
 
 #include <fc/thread/thread.hpp>
 #include <fc/thread/future.hpp>
+#include <fc/string.hpp>
 #include <fc/log/logger.hpp>
 #include <fc/io/json.hpp>
 #include <fc/io/enum_type.hpp>
@@ -16,6 +19,7 @@
 
 #include <bts/net/node.hpp>
 #include <bts/net/peer_database.hpp>
+#include <bts/net/peer_inventory.hpp>
 #include <bts/net/message_oriented_connection.hpp>
 #include <bts/net/stcp_socket.hpp>
 #include <bts/client/messages.hpp>
@@ -24,6 +28,35 @@
 namespace bts { namespace net {
   namespace detail
   {
+    /// sync blocks we will request from a newly connected peer before we have measured it
+#define BTS_NET_INITIAL_SYNC_REQUEST_WINDOW      2
+#define BTS_NET_MAX_SYNC_REQUEST_WINDOW          64
+    /// number of blocks we try to keep queued at the peer beyond the bandwidth-delay product
+#define BTS_NET_SYNC_REQUEST_QUEUE_TARGET        2
+    /// limits the blocks requested or received-but-unprocessed during sync, across all peers
+#define BTS_NET_MAX_SYNC_BLOCKS_IN_PROGRESS      1000
+    /// we stop serving sync blocks to a peer while this many bytes are waiting to be written to it
+#define BTS_NET_MAX_QUEUED_SYNC_BYTES            (1024*1024)
+    /// block and item id messages at least this large are compressed for peers that accept compressed messages
+#define BTS_NET_MIN_COMPRESSED_MESSAGE_SIZE      1024
+#define BTS_NET_DEFAULT_COMPRESSION_LEVEL        6
+    /// total size of the compressed block messages kept so each block is compressed once, not once per request
+#define BTS_NET_MAX_COMPRESSED_ITEM_CACHE_BYTES  (16*1024*1024)
+#define BTS_NET_MAX_COMPRESSED_ITEM_CACHE_ITEMS  10000
+    /// a request times out after this many times the peer's average delivery latency, within the bounds below
+#define BTS_NET_ITEM_REQUEST_TIMEOUT_FACTOR      4
+#define BTS_NET_MIN_ITEM_REQUEST_TIMEOUT_MS      1000
+#define BTS_NET_MAX_ITEM_REQUEST_TIMEOUT_SECONDS 30
+    /// how often the fetch loops look for timed-out requests while any are outstanding
+#define BTS_NET_REQUEST_TIMEOUT_CHECK_INTERVAL_MS 500
+    /// a peer whose expected delivery time is this many times the fastest sync peer's only gets one sync request at a time
+#define BTS_NET_SLOW_PEER_FACTOR                 4
+    /// how much a peer's expected delivery time grows with the fraction of our requests it failed to answer
+#define BTS_NET_FAILED_REQUEST_PENALTY           4
+    /// a timed-out request is forgotten after this long, or when a peer has more than this many, oldest first
+#define BTS_NET_TIMED_OUT_REQUEST_LIFETIME_SECONDS (10*BTS_NET_MAX_ITEM_REQUEST_TIMEOUT_SECONDS)
+#define BTS_NET_MAX_TIMED_OUT_REQUESTS           1000
+
     enum peer_connection_direction { unknown, inbound, outbound };
 
     class peer_connection : public message_oriented_connection_delegate,
@@ -45,6 +78,7 @@ namespace bts { namespace net {
     private:
       node_impl&                     _node;
       fc::optional<fc::ip::endpoint> _remote_endpoint;
+      fc::thread*                    _io_thread; /// reads and writes our socket, null to use the node's thread
       message_oriented_connection    _message_connection;
     public:
       peer_connection_direction direction;
@@ -56,6 +90,7 @@ namespace bts { namespace net {
       uint32_t         core_protocol_version;
       std::string      user_agent;
       fc::ip::endpoint inbound_endpoint;
+      uint32_t         capabilities; /// core_capability_flags from the peer's hello or hello_reply
       /// @}
 
       /// blockchain synchronization state data
@@ -65,37 +100,69 @@ namespace bts { namespace net {
       bool peer_needs_sync_items_from_us;
       bool we_need_sync_items_from_peer;
       fc::optional<boost::tuple<item_id, fc::time_point> > item_ids_requested_from_peer; /// we check this to detect a timed-out request and in busy()
+      std::deque<item_id> deferred_sync_item_requests; /// sync blocks the peer asked for while its send queue was full, served in order as it drains
       /// @}
 
       /// non-syncronization state data
       /// @{
-      std::unordered_set<item_id> inventory_peer_advertised_to_us;
-      std::unordered_set<item_id> inventory_advertised_to_peer; /// TODO: make this a map to the time/block# we advertised it so we can expire items off of the list
+      peer_inventory inventory; /// items this peer advertised to us or we advertised to it, expires old items
 
       typedef std::unordered_map<item_id, fc::time_point> item_to_time_map_type;
       item_to_time_map_type items_requested_from_peer;  /// items we've requested from this peer during normal operation.  fetch from another peer if this peer disconnects
       item_to_time_map_type sync_items_requested_from_peer; /// ids of blocks we've requested from this peer during sync.  fetch from another peer if this peer disconnects
       /// @}
+
+      /// sync download window, adapted to the latency and bandwidth we measure from this peer
+      /// @{
+      uint32_t         sync_request_window; /// the most sync blocks we will have requested from this peer at once
+      fc::microseconds min_sync_latency; /// lowest request-to-arrival time seen, our estimate of the round trip time
+      double           sync_bytes_per_second;
+      double           average_sync_block_size;
+      fc::time_point   last_sync_block_received_time;
+      /// @}
+
+      /// how well this peer answers our requests, used to send requests to the peers that answer fastest
+      /// @{
+      fc::microseconds average_delivery_latency; /// smoothed request-to-arrival time of the items we fetched from this peer
+      uint32_t         items_delivered;
+      uint32_t         items_not_available;
+      uint32_t         request_timeouts;
+      typedef std::unordered_map<item_id, fc::time_point> timed_out_request_map;
+      timed_out_request_map timed_out_requests; /// requests we gave up on and sent to other peers, this peer may still answer them
+      /// @}
     public:
-      peer_connection(node_impl& n) : 
+      peer_connection(node_impl& n, fc::thread* io_thread = nullptr) : 
         _node(n),
-        _message_connection(this),
+        _io_thread(io_thread),
+        _message_connection(this, io_thread),
         direction(unknown),
         state(disconnected),
+        capabilities(0),
         number_of_unfetched_item_ids(0),
         peer_needs_sync_items_from_us(true),
-        we_need_sync_items_from_peer(true)
+        we_need_sync_items_from_peer(true),
+        sync_request_window(BTS_NET_INITIAL_SYNC_REQUEST_WINDOW),
+        min_sync_latency(fc::microseconds::maximum()),
+        sync_bytes_per_second(0),
+        average_sync_block_size(0),
+        items_delivered(0),
+        items_not_available(0),
+        request_timeouts(0)
       {}
       ~peer_connection() {}
 
       fc::tcp_socket& get_socket();
       void accept_connection();
       void connect_to(const fc::ip::endpoint& remote_endpoint, fc::optional<fc::ip::endpoint> local_endpoint = fc::optional<fc::ip::endpoint>());
+      static void connect_simulated(peer_connection& outbound_peer, peer_connection& inbound_peer,
+                                    const simulated_link_properties& outbound_link, const simulated_link_properties& inbound_link);
 
       void on_message(message_oriented_connection* originating_connection, const message& received_message) override;
       void on_connection_closed(message_oriented_connection* originating_connection) override;
+      void on_queued_messages_sent(message_oriented_connection* originating_connection) override;
 
-      void send_message(const message& message_to_send);
+      void send_message(const message& message_to_send, message_send_priority priority = inventory_send_priority);
+      size_t get_queued_bytes() const;
       void close_connection();
 
       fc::optional<fc::ip::endpoint> get_remote_endpoint();
@@ -103,6 +170,25 @@ namespace bts { namespace net {
 
       bool busy();
       bool idle();
+
+      /** runs f on our I/O thread, if we have one, and waits for it while the node's thread does other work */
+      template<typename Functor>
+      void run_on_io_thread(Functor&& f)
+      {
+        if (_io_thread)
+          _io_thread->async(std::forward<Functor>(f)).wait();
+        else
+          f();
+      }
+
+      uint32_t free_sync_request_slots();
+      void     update_sync_request_window(fc::microseconds latency, uint32_t block_size);
+
+      void             record_item_delivered(fc::microseconds latency);
+      fc::microseconds expected_delivery_time() const;
+      fc::microseconds request_timeout() const;
+      void             remember_timed_out_request(const item_id& requested_item);
+      void             forget_old_timed_out_requests();
     private:
       void accept_connection_task();
       void connect_to_task(const fc::ip::endpoint& remote_endpoint);
@@ -114,12 +200,17 @@ namespace bts { namespace net {
     // in the configuration directory (application data directory)
     struct node_configuration
     {
+      node_configuration() : compression_level(BTS_NET_DEFAULT_COMPRESSION_LEVEL), io_thread_count(0) {}
+
       fc::ip::endpoint listen_endpoint;
+      int32_t          compression_level; /// zlib level for messages we send, 0 disables compression
+      uint32_t         io_thread_count; /// threads that read and write peer sockets, 0 to do it on the node's thread
     };
 
+
  } } } // end namespace bts::net::detail
 
-FC_REFLECT(bts::net::detail::node_configuration, (listen_endpoint));
+FC_REFLECT(bts::net::detail::node_configuration, (listen_endpoint)(compression_level)(io_thread_count));
 
 // not sent over the wire, just reflected for logging
 FC_REFLECT_ENUM(bts::net::detail::peer_connection_direction, (unknown)(inbound)(outbound))
@@ -133,6 +224,12 @@ namespace bts { namespace net {
     public:
       node_delegate*       _delegate;
 
+      /// threads that read and write peer sockets, declared before the connections so they outlive them
+      /// @{
+      std::vector<std::unique_ptr<fc::thread> > _io_threads;
+      uint32_t                                  _next_io_thread;
+      /// @}
+
 #define NODE_CONFIGURATION_FILENAME      "node_config.json"
 #define POTENTIAL_PEER_DATABASE_FILENAME "peers.leveldb"
       fc::path             _node_configuration_directory;
@@ -153,7 +250,8 @@ namespace bts { namespace net {
       fc::future<void>       _fetch_sync_items_loop_done;
       typedef std::unordered_map<bts::blockchain::block_id_type, fc::time_point> active_sync_requests_map;
       active_sync_requests_map              _active_sync_requests; /// list of sync blocks we've asked for from peers but have not yet received
-      std::list<bts::client::block_message> _received_sync_items; /// list of sync blocks we've received, but can't yet process because we are still missing blocks that come earlier in the chain
+      typedef std::unordered_map<bts::blockchain::block_id_type, bts::client::block_message> received_sync_items_map;
+      received_sync_items_map               _received_sync_items; /// sync blocks we've received, but can't yet process because we are still missing blocks that come earlier in the chain
       // @}
 
       /// used by the task that fetches items during normal operation
@@ -195,6 +293,18 @@ namespace bts { namespace net {
       boost::circular_buffer<item_hash_t> _most_recent_blocks_accepted; // the /n/ most recent blocks we've accepted (currently tuned to the max number of connections)
       uint32_t _total_number_of_unfetched_items; /// the number of items we still need to fetch while syncing
 
+      message_compression_statistics _compression_statistics;
+      /**
+       *  The compressed form of block messages we've served, keyed by item id, or nothing if the
+       *  block doesn't shrink.  Oldest first in _compressed_item_order.
+       */
+      std::unordered_map<item_id, fc::optional<message> > _compressed_items;
+      std::deque<item_id>                                  _compressed_item_order;
+      size_t                                               _compressed_item_bytes;
+      std::map<uint32_t, message_type_statistics> _message_statistics; /// wire messages sent and received, by type
+      latency_histogram _fetch_item_latency;
+      latency_histogram _fetch_blockchain_item_ids_latency;
+
       node_impl();
       ~node_impl();
 
@@ -207,9 +317,12 @@ namespace bts { namespace net {
       void request_sync_item_from_peer(const peer_connection_ptr& peer, const item_hash_t& item_to_request);
       void fetch_sync_items_loop();
       void trigger_fetch_sync_items_loop();
+      void expire_timed_out_sync_requests();
+      bool is_sync_item_still_needed(const item_hash_t& item_hash);
 
       void fetch_items_loop();
       void trigger_fetch_items_loop();
+      bool expire_timed_out_item_requests();
 
       void advertise_inventory_loop();
       void trigger_advertise_inventory_loop();
@@ -233,13 +346,23 @@ namespace bts { namespace net {
       void on_fetch_blockchain_item_ids_message(peer_connection* originating_peer, const fetch_blockchain_item_ids_message& fetch_blockchain_item_ids_message_received);
       void on_blockchain_item_ids_inventory_message(peer_connection* originating_peer, const blockchain_item_ids_inventory_message& blockchain_item_ids_inventory_message_received);
       void on_fetch_item_message(peer_connection* originating_peer, const fetch_item_message& fetch_item_message_received);
+      void send_item_to_peer(peer_connection* peer, const item_id& requested_item, message_send_priority priority);
+      void send_compressible_message(peer_connection* peer, const message& message_to_send, message_send_priority priority,
+                                     const item_id* cache_key = nullptr);
+      fc::optional<message> compress_if_smaller(const message& message_to_compress);
+      fc::optional<message> get_compressed_item(const item_id& id, const message& message_to_compress);
+      void on_compressed_message(peer_connection* originating_peer, const message& received_message);
+      void on_queued_messages_sent(peer_connection* peer);
       void on_item_not_available_message(peer_connection* originating_peer, const item_not_available_message& item_not_available_message_received);
       void on_item_ids_inventory_message(peer_connection* originating_peer, const item_ids_inventory_message& item_ids_inventory_message_received);
       void on_connection_closed(peer_connection* originating_peer);
 
       void process_backlog_of_sync_blocks();
-      void process_block_during_sync(peer_connection* originating_peer, const message& block_message, const message_hash_type& message_hash);
-      void process_block_during_normal_operation(peer_connection* originating_peer, const message& block_message, const message_hash_type& message_hash);
+      void on_block_message(peer_connection* originating_peer, const message& received_message);
+      void process_block_during_sync(peer_connection* originating_peer, bts::client::block_message& block_message_to_process, 
+                                     const message& message_to_process);
+      void process_block_during_normal_operation(peer_connection* originating_peer, const bts::client::block_message& block_message_to_process,
+                                                 const message& message_to_process, const message_hash_type& message_hash);
 
       void start_synchronizing();
       void start_synchronizing_with_peer(const peer_connection_ptr& peer);
@@ -251,6 +374,7 @@ namespace bts { namespace net {
       void accept_connection_task(peer_connection_ptr new_peer);
       void accept_loop();
       void connect_to_task(peer_connection_ptr new_peer, const fc::ip::endpoint& remote_endpoint);
+      void send_hello_message(const peer_connection_ptr& peer);
       bool is_connection_to_endpoint_in_progress(const fc::ip::endpoint& remote_endpoint);
 
       void dump_node_status();
@@ -261,11 +385,18 @@ namespace bts { namespace net {
       void set_delegate(node_delegate* del);
       void load_configuration(const fc::path& configuration_directory);
       void connect_to_p2p_network();
+      void connect_to_simulated_network(const fc::ip::endpoint& simulated_endpoint);
+      void connect_to_simulated_node(node_impl& remote_node, const simulated_link_properties& outbound_link, const simulated_link_properties& inbound_link);
       void add_node(const fc::ip::endpoint& ep);
       void connect_to(const fc::ip::endpoint& ep);
       void listen_on_endpoint(const fc::ip::endpoint& ep);
       void listen_on_port(uint16_t port);
       std::vector<peer_status> get_connected_peers() const;
+      void set_compression_level(int32_t compression_level);
+      void set_io_thread_count(uint32_t io_thread_count);
+      fc::thread* choose_io_thread();
+      message_compression_statistics get_compression_statistics() const;
+      network_statistics get_network_statistics() const;
       void broadcast(const message& item_to_broadcast);
       void sync_from(const item_id&);
       bool is_connected() const;
@@ -317,8 +448,24 @@ namespace bts { namespace net {
       }
     } // connect_to()
 
+    /** pairs two unconnected peers from nodes in the same process, see node::connect_to_simulated_node() */
+    void peer_connection::connect_simulated(peer_connection& outbound_peer, peer_connection& inbound_peer,
+                                            const simulated_link_properties& outbound_link, const simulated_link_properties& inbound_link)
+    {
+      assert(outbound_peer.state == disconnected && inbound_peer.state == disconnected);
+      outbound_peer.direction = outbound;
+      inbound_peer.direction = inbound;
+      message_oriented_connection::connect_simulated(outbound_peer._message_connection, inbound_peer._message_connection,
+                                                     outbound_link, inbound_link);
+      outbound_peer.state = secure_connection_established;
+      inbound_peer.state = secure_connection_established;
+    }
+
     void peer_connection::on_message(message_oriented_connection* originating_connection, const message& received_message)
     {
+      message_type_statistics& statistics = _node._message_statistics[received_message.msg_type];
+      ++statistics.messages_received;
+      statistics.bytes_received += padded_message_size(received_message);
       _node.on_message(this, received_message);
     }
 
@@ -327,9 +474,22 @@ namespace bts { namespace net {
       _node.on_connection_closed(this);
     }
 
-    void peer_connection::send_message(const message& message_to_send)
+    void peer_connection::on_queued_messages_sent(message_oriented_connection* originating_connection)
+    {
+      _node.on_queued_messages_sent(this);
+    }
+
+    void peer_connection::send_message(const message& message_to_send, message_send_priority priority)
     {
-      _message_connection.send_message(message_to_send);
+      message_type_statistics& statistics = _node._message_statistics[message_to_send.msg_type];
+      ++statistics.messages_sent;
+      statistics.bytes_sent += padded_message_size(message_to_send);
+      _message_connection.send_message(message_to_send, priority);
+    }
+
+    size_t peer_connection::get_queued_bytes() const
+    {
+      return _message_connection.get_queued_bytes();
     }
 
     void peer_connection::close_connection()
@@ -356,17 +516,125 @@ namespace bts { namespace net {
       return !busy();
     }
 
+    uint32_t peer_connection::free_sync_request_slots()
+    {
+      if (sync_items_requested_from_peer.size() >= sync_request_window)
+        return 0;
+      return sync_request_window - sync_items_requested_from_peer.size();
+    }
+
+    /**
+     *  Called for each sync block received from this peer.  The blocks that fit in the pipe are
+     *  the measured bandwidth times the lowest latency we've seen; we try to keep a couple more
+     *  than that outstanding so the peer never waits on us.  While the window is too small to fill
+     *  the link, the measured bandwidth is window / latency, so the target keeps growing by the
+     *  queue target until the link saturates.
+     */
+    void peer_connection::update_sync_request_window(fc::microseconds latency, uint32_t block_size)
+    {
+      fc::time_point now = fc::time_point::now();
+      if (latency < min_sync_latency)
+        min_sync_latency = latency;
+
+      if (average_sync_block_size == 0)
+        average_sync_block_size = block_size;
+      else
+        average_sync_block_size = (average_sync_block_size * 7 + block_size) / 8;
+
+      // only measure bandwidth while the pipe is kept busy, otherwise we'd be measuring our own idle time
+      if (last_sync_block_received_time != fc::time_point() && !sync_items_requested_from_peer.empty())
+      {
+        int64_t elapsed_us = std::max<int64_t>((now - last_sync_block_received_time).count(), 1);
+        double sample = block_size * 1000000.0 / elapsed_us;
+        sync_bytes_per_second = sync_bytes_per_second == 0 ? sample : (sync_bytes_per_second * 7 + sample) / 8;
+      }
+      last_sync_block_received_time = now;
+
+      if (sync_bytes_per_second == 0 || average_sync_block_size == 0)
+        return;
+      double blocks_in_flight = sync_bytes_per_second * min_sync_latency.count() / 1000000.0 / average_sync_block_size;
+      uint32_t target_window = std::min<uint32_t>(BTS_NET_MAX_SYNC_REQUEST_WINDOW, 
+                                                  uint32_t(blocks_in_flight + 0.5) + BTS_NET_SYNC_REQUEST_QUEUE_TARGET);
+      if (target_window > sync_request_window)
+        ++sync_request_window;
+      else if (target_window < sync_request_window && sync_request_window > 1)
+        --sync_request_window;
+    }
+
+    void peer_connection::record_item_delivered(fc::microseconds latency)
+    {
+      if (!items_delivered)
+        average_delivery_latency = latency;
+      else
+        average_delivery_latency = fc::microseconds((average_delivery_latency.count() * 7 + latency.count()) / 8);
+      ++items_delivered;
+      _node._fetch_item_latency.record(latency);
+    }
+
+    /**
+     *  Our estimate of how long this peer takes to answer a request: its smoothed delivery latency,
+     *  scaled up by the fraction of our requests it timed out on or couldn't answer.  Zero until
+     *  it has delivered something, so new peers get tried.
+     */
+    fc::microseconds peer_connection::expected_delivery_time() const
+    {
+      if (!items_delivered)
+        return fc::microseconds(0);
+      uint32_t failed_requests = items_not_available + request_timeouts;
+      double penalty = 1.0 + BTS_NET_FAILED_REQUEST_PENALTY * double(failed_requests) / (items_delivered + failed_requests);
+      return fc::microseconds(int64_t(average_delivery_latency.count() * penalty));
+    }
+
+    fc::microseconds peer_connection::request_timeout() const
+    {
+      if (!items_delivered)
+        return fc::seconds(BTS_NET_MAX_ITEM_REQUEST_TIMEOUT_SECONDS);
+      int64_t timeout_us = average_delivery_latency.count() * BTS_NET_ITEM_REQUEST_TIMEOUT_FACTOR;
+      timeout_us = std::max<int64_t>(timeout_us, fc::milliseconds(BTS_NET_MIN_ITEM_REQUEST_TIMEOUT_MS).count());
+      timeout_us = std::min<int64_t>(timeout_us, fc::seconds(BTS_NET_MAX_ITEM_REQUEST_TIMEOUT_SECONDS).count());
+      return fc::microseconds(timeout_us);
+    }
+
+    void peer_connection::remember_timed_out_request(const item_id& requested_item)
+    {
+      timed_out_requests[requested_item] = fc::time_point::now();
+      if (timed_out_requests.size() > BTS_NET_MAX_TIMED_OUT_REQUESTS)
+      {
+        auto oldest = std::min_element(timed_out_requests.begin(), timed_out_requests.end(),
+                                       [](const timed_out_request_map::value_type& a, const timed_out_request_map::value_type& b) { return a.second < b.second; });
+        timed_out_requests.erase(oldest);
+      }
+    }
+
+    /**
+     *  A peer that hasn't answered a request long after it timed out isn't going to, and keeping the
+     *  entry would stop us from ever asking this peer for the item again.
+     */
+    void peer_connection::forget_old_timed_out_requests()
+    {
+      fc::time_point cutoff = fc::time_point::now() - fc::seconds(BTS_NET_TIMED_OUT_REQUEST_LIFETIME_SECONDS);
+      for (auto iter = timed_out_requests.begin(); iter != timed_out_requests.end(); )
+      {
+        if (iter->second < cutoff)
+          iter = timed_out_requests.erase(iter);
+        else
+          ++iter;
+      }
+    }
+
 
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
     node_impl::node_impl() : 
       _delegate(nullptr),
+      _next_io_thread(0),
       _user_agent_string("bts::net::node"),
       _desired_number_of_connections(3),
       _maximum_number_of_connections(5),
       _most_recent_blocks_accepted(_maximum_number_of_connections),
-      _total_number_of_unfetched_items(0)
+      _total_number_of_unfetched_items(0),
+      _compressed_item_bytes(0)
     {
       fc::rand_pseudo_bytes(_node_id.data(), 20);
     }
@@ -467,8 +735,7 @@ namespace bts { namespace net {
 
     bool node_impl::have_already_received_sync_item(const item_hash_t& item_hash)
     {
-      return std::find_if(_received_sync_items.begin(), _received_sync_items.end(), 
-                          [&item_hash](const bts::client::block_message& message) { return message.block_id == item_hash; }) != _received_sync_items.end();
+      return _received_sync_items.find(item_hash) != _received_sync_items.end();
     }
 
     void node_impl::request_sync_item_from_peer(const peer_connection_ptr& peer, const item_hash_t& item_to_request)
@@ -487,22 +754,50 @@ namespace bts { namespace net {
         _sync_items_to_fetch_updated = false;
         ilog("beginning another iteration of the sync items loop");
 
-        // for each idle peer that we're syncing with
+        expire_timed_out_sync_requests();
+
+        // fill each sync peer's request window with the earliest items it has that nobody else is fetching.
+        // Walking the peers fastest first gives the next blocks in the chain to the peers most likely to
+        // deliver them soon, and the total is bounded so the backlog of out-of-order blocks we hold can't
+        // grow without limit
+        std::vector<peer_connection_ptr> sync_peers;
         for (const peer_connection_ptr& peer : _active_connections)
+          if (peer->we_need_sync_items_from_peer)
+            sync_peers.push_back(peer);
+        std::sort(sync_peers.begin(), sync_peers.end(), [](const peer_connection_ptr& a, const peer_connection_ptr& b) {
+          return a->expected_delivery_time() < b->expected_delivery_time();
+        });
+        int64_t fastest_delivery_time_us = 0;
+        for (const peer_connection_ptr& peer : sync_peers)
+          if (peer->items_delivered)
+          {
+            fastest_delivery_time_us = peer->expected_delivery_time().count();
+            break;
+          }
+
+        for (const peer_connection_ptr& peer : sync_peers)
         {
-          if (peer->we_need_sync_items_from_peer && peer->idle())
+          uint32_t free_slots = peer->free_sync_request_slots();
+          // a much slower peer would hold up every block behind the ones it's fetching, so it only
+          // gets one request at a time, which is enough to notice if it speeds up
+          if (fastest_delivery_time_us && 
+              peer->expected_delivery_time().count() > fastest_delivery_time_us * BTS_NET_SLOW_PEER_FACTOR)
+            free_slots = peer->sync_items_requested_from_peer.empty() ? std::min<uint32_t>(free_slots, 1) : 0;
+          // loop through the items it has that we don't yet have on our blockchain
+          for (unsigned i = 0; 
+               i < peer->ids_of_items_to_get.size() && free_slots > 0 &&
+               _active_sync_requests.size() + _received_sync_items.size() < BTS_NET_MAX_SYNC_BLOCKS_IN_PROGRESS; 
+               ++i)
           {
-            // loop through the items it has that we don't yet have on our blockchain
-            for (unsigned i = 0; i < peer->ids_of_items_to_get.size(); ++i)
+            // if we don't already have this item in our temporary storage and we haven't requested it from
+            // a syncing peer (including this one, before the request timed out)
+            if (!have_already_received_sync_item(peer->ids_of_items_to_get[i]) &&
+                _active_sync_requests.find(peer->ids_of_items_to_get[i]) == _active_sync_requests.end() &&
+                !peer->timed_out_requests.count(item_id(bts::client::block_message_type, peer->ids_of_items_to_get[i])))
             {
-              // if we don't already have this item in our temporary storage and we haven't requested from another syncing peer
-              if (!have_already_received_sync_item(peer->ids_of_items_to_get[i]) &&
-                  _active_sync_requests.find(peer->ids_of_items_to_get[i]) == _active_sync_requests.end())
-              {
-                // then request it from this peer
-                request_sync_item_from_peer(peer, peer->ids_of_items_to_get[i]);
-                break;
-              }
+              // then request it from this peer
+              request_sync_item_from_peer(peer, peer->ids_of_items_to_get[i]);
+              --free_slots;
             }
           }
         }
@@ -511,12 +806,63 @@ namespace bts { namespace net {
         {
           ilog("no sync items to fetch right now, going to sleep");
           _retrigger_fetch_sync_items_loop_promise = fc::promise<void>::ptr(new fc::promise<void>());
-          _retrigger_fetch_sync_items_loop_promise->wait();
+          try
+          {
+            if (_active_sync_requests.empty())
+              _retrigger_fetch_sync_items_loop_promise->wait();
+            else
+              _retrigger_fetch_sync_items_loop_promise->wait_until(fc::time_point::now() + fc::milliseconds(BTS_NET_REQUEST_TIMEOUT_CHECK_INTERVAL_MS));
+          }
+          catch (fc::timeout_exception&)
+          {
+            // look for timed-out requests
+          }
           _retrigger_fetch_sync_items_loop_promise.reset();
         }
       }
     }
 
+    /**
+     *  Sync requests a peer hasn't answered in time are made available to the other sync peers.  The
+     *  peer may still send the block later, so we remember the request instead of treating the block
+     *  as unsolicited.
+     */
+    void node_impl::expire_timed_out_sync_requests()
+    {
+      fc::time_point now = fc::time_point::now();
+      for (const peer_connection_ptr& peer : _active_connections)
+      {
+        peer->forget_old_timed_out_requests();
+        fc::microseconds timeout = peer->request_timeout();
+        for (auto iter = peer->sync_items_requested_from_peer.begin(); iter != peer->sync_items_requested_from_peer.end(); )
+        {
+          if (now - iter->second > timeout)
+          {
+            wlog("sync request for ${item} timed out at peer ${endpoint}, requesting it from another peer", 
+                 ("item", iter->first.item_hash)("endpoint", peer->get_remote_endpoint()));
+            ++peer->request_timeouts;
+            peer->remember_timed_out_request(iter->first);
+            _active_sync_requests.erase(iter->first.item_hash);
+            iter = peer->sync_items_requested_from_peer.erase(iter);
+            _sync_items_to_fetch_updated = true;
+          }
+          else
+            ++iter;
+        }
+      }
+    }
+
+    /** true if a sync peer still lists the block and we're not holding it in the backlog already */
+    bool node_impl::is_sync_item_still_needed(const item_hash_t& item_hash)
+    {
+      if (have_already_received_sync_item(item_hash))
+        return false;
+      for (const peer_connection_ptr& peer : _active_connections)
+        if (std::find(peer->ids_of_items_to_get.begin(), peer->ids_of_items_to_get.end(), item_hash) != peer->ids_of_items_to_get.end())
+          return true;
+      return false;
+    }
+
     void node_impl::trigger_fetch_sync_items_loop()
     {
       ilog("Triggering fetch sync items loop now");
@@ -531,36 +877,87 @@ namespace bts { namespace net {
       {
         _items_to_fetch_updated = false;
 
+        bool requests_outstanding = expire_timed_out_item_requests();
+
         for (auto iter = _items_to_fetch.begin(); iter != _items_to_fetch.end(); )
         {
-          bool item_fetched = false;
+          // of the idle peers that offered us the item, ask the one we expect to answer first
+          peer_connection_ptr best_peer;
           for (const peer_connection_ptr& peer : _active_connections)
           {
             if (peer->idle() &&
-                peer->inventory_peer_advertised_to_us.find(*iter) != peer->inventory_peer_advertised_to_us.end())
-            {
-              ilog("requesting item ${hash} from peer ${endpoint}", ("hash", iter->item_hash)("endpoint", peer->get_remote_endpoint()));
-              peer->items_requested_from_peer.insert(peer_connection::item_to_time_map_type::value_type(*iter, fc::time_point::now()));
-              item_id item_id_to_fetch = *iter;
-              iter = _items_to_fetch.erase(iter);
-              item_fetched = true;
-              peer->send_message(fetch_item_message(item_id_to_fetch));
-              break;
-            }
+                (peer->inventory.get(*iter) & peer_inventory::advertised_to_us) &&
+                (!best_peer || peer->expected_delivery_time() < best_peer->expected_delivery_time()))
+              best_peer = peer;
+          }
+          if (best_peer)
+          {
+            ilog("requesting item ${hash} from peer ${endpoint}", ("hash", iter->item_hash)("endpoint", best_peer->get_remote_endpoint()));
+            best_peer->items_requested_from_peer.insert(peer_connection::item_to_time_map_type::value_type(*iter, fc::time_point::now()));
+            item_id item_id_to_fetch = *iter;
+            iter = _items_to_fetch.erase(iter);
+            requests_outstanding = true;
+            best_peer->send_message(fetch_item_message(item_id_to_fetch));
           }
-          if (!item_fetched)
+          else
             ++iter;
         }
 
         if (!_items_to_fetch_updated)
         {
           _retrigger_fetch_item_loop_promise = fc::promise<void>::ptr(new fc::promise<void>());
-          _retrigger_fetch_item_loop_promise->wait();
+          try
+          {
+            if (!requests_outstanding)
+              _retrigger_fetch_item_loop_promise->wait();
+            else
+              _retrigger_fetch_item_loop_promise->wait_until(fc::time_point::now() + fc::milliseconds(BTS_NET_REQUEST_TIMEOUT_CHECK_INTERVAL_MS));
+          }
+          catch (fc::timeout_exception&)
+          {
+            // look for timed-out requests
+          }
           _retrigger_fetch_item_loop_promise.reset();
         }
       }
     }
 
+    /**
+     *  Puts items a peer hasn't delivered in time back on the list to fetch, and forgets that the
+     *  peer offered them so another peer is asked.
+     *
+     *  @return true if any requests are still waiting for an answer
+     */
+    bool node_impl::expire_timed_out_item_requests()
+    {
+      bool requests_outstanding = false;
+      fc::time_point now = fc::time_point::now();
+      for (const peer_connection_ptr& peer : _active_connections)
+      {
+        peer->forget_old_timed_out_requests();
+        fc::microseconds timeout = peer->request_timeout();
+        for (auto iter = peer->items_requested_from_peer.begin(); iter != peer->items_requested_from_peer.end(); )
+        {
+          if (now - iter->second > timeout)
+          {
+            wlog("request for item ${item} timed out at peer ${endpoint}, requesting it from another peer", 
+                 ("item", iter->first.item_hash)("endpoint", peer->get_remote_endpoint()));
+            ++peer->request_timeouts;
+            peer->remember_timed_out_request(iter->first);
+            peer->inventory.clear(iter->first, peer_inventory::advertised_to_us);
+            _items_to_fetch.push_front(iter->first);
+            iter = peer->items_requested_from_peer.erase(iter);
+          }
+          else
+          {
+            requests_outstanding = true;
+            ++iter;
+          }
+        }
+      }
+      return requests_outstanding;
+    }
+
     void node_impl::trigger_fetch_items_loop()
     {
       _items_to_fetch_updated = true;
@@ -588,11 +985,10 @@ namespace bts { namespace net {
             // group the items we need to send by type, because we'll need to send one inventory message per type
             unsigned total_items_to_send_to_this_peer = 0;
             for (const item_id& item_to_advertise : inventory_to_advertise)
-              if (peer->inventory_advertised_to_peer.find(item_to_advertise) == peer->inventory_advertised_to_peer.end() &&
-                  peer->inventory_peer_advertised_to_us.find(item_to_advertise) == peer->inventory_peer_advertised_to_us.end())
+              if (!peer->inventory.get(item_to_advertise))
               {
                 items_to_advertise_by_type[item_to_advertise.item_type].push_back(item_to_advertise.item_hash);
-                peer->inventory_advertised_to_peer.insert(item_to_advertise);
+                peer->inventory.set(item_to_advertise, peer_inventory::advertised_to_peer);
                 ++total_items_to_send_to_this_peer;
                 ilog("advertising item ${id} to peer ${endpoint}", ("id", item_to_advertise.item_hash)("endpoint", peer->get_remote_endpoint()));
               }
@@ -689,15 +1085,14 @@ namespace bts { namespace net {
 
     void node_impl::on_message(peer_connection* originating_peer, const message& received_message)
     {
-      message_hash_type message_hash = received_message.id();
       //ilog("handling message ${hash} size ${size} from peer ${endpoint}", ("hash", message_hash)("size", received_message.size)("endpoint", originating_peer->get_remote_endpoint()));
       switch (received_message.msg_type)
       {
       case core_message_type_enum::hello_message_type:
-        on_hello_message(originating_peer, received_message.as<hello_message>());
+        on_hello_message(originating_peer, unpack_hello_message(received_message));
         break;
       case core_message_type_enum::hello_reply_message_type:
-        on_hello_reply_message(originating_peer, received_message.as<hello_reply_message>());
+        on_hello_reply_message(originating_peer, unpack_hello_reply_message(received_message));
         break;
       case core_message_type_enum::connection_rejected_message_type:
         on_connection_rejected_message(originating_peer, received_message.as<connection_rejected_message>());
@@ -723,11 +1118,11 @@ namespace bts { namespace net {
       case core_message_type_enum::item_ids_inventory_message_type:
         on_item_ids_inventory_message(originating_peer, received_message.as<item_ids_inventory_message>());
         break;
+      case core_message_type_enum::compressed_message_type:
+        on_compressed_message(originating_peer, received_message);
+        break;
       case bts::client::message_type_enum::block_message_type:
-        if (originating_peer->we_need_sync_items_from_peer)
-          process_block_during_sync(originating_peer, received_message, message_hash);
-        else
-          process_block_during_normal_operation(originating_peer, received_message, message_hash);
+        on_block_message(originating_peer, received_message);
         break;
       default:
         break;
@@ -744,8 +1139,9 @@ namespace bts { namespace net {
       originating_peer->inbound_endpoint = hello_message_received.inbound_endpoint;
       // hack: right now, a peer listening on all interfaces will tell us it is listening on 0.0.0.0, patch that up here:
       if (originating_peer->inbound_endpoint.get_address() == fc::ip::address())
-        originating_peer->inbound_endpoint = fc::ip::endpoint(originating_peer->get_socket().remote_endpoint().get_address() ,originating_peer->inbound_endpoint.port());
+        originating_peer->inbound_endpoint = fc::ip::endpoint(originating_peer->get_remote_endpoint()->get_address() ,originating_peer->inbound_endpoint.port());
       originating_peer->user_agent = hello_message_received.user_agent;
+      originating_peer->capabilities = hello_message_received.capabilities;
 
       // now decide what to do with it
       if (originating_peer->state == peer_connection::secure_connection_established && 
@@ -753,14 +1149,14 @@ namespace bts { namespace net {
       {
         if (!is_accepting_new_connections())
         {
-          connection_rejected_message connection_rejected(_user_agent_string, core_protocol_version, originating_peer->get_socket().remote_endpoint());
+          connection_rejected_message connection_rejected(_user_agent_string, core_protocol_version, *originating_peer->get_remote_endpoint());
           originating_peer->state = peer_connection::connection_rejected_sent;
           originating_peer->send_message(message(connection_rejected));
           ilog("Received a hello_message from peer ${peer}, but I'm not accepting any more connections, rejection", ("peer", originating_peer->get_remote_endpoint()));
         }
         else if (already_connected_to_this_peer)
         {
-          connection_rejected_message connection_rejected(_user_agent_string, core_protocol_version, originating_peer->get_socket().remote_endpoint());
+          connection_rejected_message connection_rejected(_user_agent_string, core_protocol_version, *originating_peer->get_remote_endpoint());
           originating_peer->state = peer_connection::connection_rejected_sent;
           originating_peer->send_message(message(connection_rejected));
           ilog("Received a hello_message from peer ${peer} that I'm already connected to,  rejection", ("peer", originating_peer->get_remote_endpoint()));
@@ -771,9 +1167,10 @@ namespace bts { namespace net {
           potential_peer_record updated_peer_record = _potential_peer_db.lookup_or_create_entry_for_endpoint(originating_peer->inbound_endpoint);
           _potential_peer_db.update_entry(updated_peer_record);
 
-          hello_reply_message hello_reply(_user_agent_string, core_protocol_version, originating_peer->get_socket().remote_endpoint(), _node_id);
+          hello_reply_message hello_reply(_user_agent_string, core_protocol_version, *originating_peer->get_remote_endpoint(), _node_id,
+                                          compressed_messages_capability);
           originating_peer->state = peer_connection::hello_reply_sent;
-          originating_peer->send_message(message(hello_reply));
+          originating_peer->send_message(pack_hello_reply_message(hello_reply));
           ilog("Received a hello_message from peer ${peer}, sending reply to accept connection", ("peer", originating_peer->get_remote_endpoint()));
         }
       }
@@ -789,6 +1186,7 @@ namespace bts { namespace net {
       originating_peer->node_id = hello_reply_message_received.node_id;
       originating_peer->core_protocol_version = hello_reply_message_received.core_protocol_version;
       originating_peer->user_agent = hello_reply_message_received.user_agent;
+      originating_peer->capabilities = hello_reply_message_received.capabilities;
 
       if (originating_peer->state == peer_connection::hello_sent && 
           originating_peer->direction == peer_connection_direction::outbound)
@@ -803,7 +1201,7 @@ namespace bts { namespace net {
           ilog("Received a reply to my \"hello\" from ${peer}, connection is accepted", ("peer", originating_peer->get_remote_endpoint()));
           ilog("Remote server sees my connection as ${endpoint}", ("endpoint", hello_reply_message_received.remote_endpoint));
           originating_peer->state = peer_connection::connected;
-          originating_peer->send_message(address_request_message());
+          originating_peer->send_message(address_request_message(), address_send_priority);
         }
       }
       else
@@ -818,13 +1216,13 @@ namespace bts { namespace net {
         ilog("Received a rejection in response to my \"hello\"");
 
         // update our database to record that we were rejected so we won't try to connect again for a while
-        potential_peer_record updated_peer_record = _potential_peer_db.lookup_or_create_entry_for_endpoint(originating_peer->get_socket().remote_endpoint());
+        potential_peer_record updated_peer_record = _potential_peer_db.lookup_or_create_entry_for_endpoint(*originating_peer->get_remote_endpoint());
         updated_peer_record.last_connection_disposition = last_connection_rejected;
         updated_peer_record.last_connection_attempt_time = fc::time_point::now();
         _potential_peer_db.update_entry(updated_peer_record);
 
         originating_peer->state = peer_connection::connection_rejected;
-        originating_peer->send_message(address_request_message());
+        originating_peer->send_message(address_request_message(), address_send_priority);
       }
       else
         FC_THROW("unexpected connection_rejected_message from peer");
@@ -837,7 +1235,7 @@ namespace bts { namespace net {
       reply.addresses.reserve(_potential_peer_db.size());
       for (const potential_peer_record& record : _potential_peer_db)
         reply.addresses.emplace_back(record.endpoint, record.last_seen_time);
-      originating_peer->send_message(reply);
+      originating_peer->send_message(reply, address_send_priority);
     }
 
     void node_impl::on_address_message(peer_connection* originating_peer, const address_message& address_message_received)
@@ -889,7 +1287,7 @@ namespace bts { namespace net {
         ilog("sync: peer is out of sync, sending peer ${count} items ids", ("count", reply_message.item_hashes_available.size()));
         originating_peer->peer_needs_sync_items_from_us = true;
       }
-      originating_peer->send_message(reply_message);
+      send_compressible_message(originating_peer, reply_message, inventory_send_priority);
 
       if (originating_peer->direction == peer_connection_direction::inbound &&
           _handshaking_connections.find(originating_peer->shared_from_this()) != _handshaking_connections.end())
@@ -927,6 +1325,7 @@ namespace bts { namespace net {
       // ignore unless we asked for the data
       if (originating_peer->item_ids_requested_from_peer)
       {
+        _fetch_blockchain_item_ids_latency.record(fc::time_point::now() - originating_peer->item_ids_requested_from_peer->get<1>());
         originating_peer->item_ids_requested_from_peer.reset();
 
         ilog("sync: received a list of ${count} available items from ${peer_endpoint}", 
@@ -1038,44 +1437,159 @@ namespace bts { namespace net {
     void node_impl::on_fetch_item_message(peer_connection* originating_peer, const fetch_item_message& fetch_item_message_received)
     {
       ilog("received item request for id ${id} from peer ${endpoint}", ("id", fetch_item_message_received.item_to_fetch.item_hash)("endpoint", originating_peer->get_remote_endpoint()));
+      const item_id& requested_item = fetch_item_message_received.item_to_fetch;
+      if (requested_item.item_type != bts::client::block_message_type)
+      {
+        send_item_to_peer(originating_peer, requested_item, transaction_send_priority);
+        return;
+      }
+      if (!originating_peer->peer_needs_sync_items_from_us)
+      {
+        send_item_to_peer(originating_peer, requested_item, new_block_send_priority);
+        return;
+      }
+
+      // a syncing peer can ask for far more blocks than it can download quickly.  Hold the
+      // requests back while its queue is full so they don't crowd out everything else we
+      // need to send, on_queued_messages_sent() picks them up again
+      if (!originating_peer->deferred_sync_item_requests.empty() ||
+          originating_peer->get_queued_bytes() >= BTS_NET_MAX_QUEUED_SYNC_BYTES)
+        originating_peer->deferred_sync_item_requests.push_back(requested_item);
+      else
+        send_item_to_peer(originating_peer, requested_item, sync_send_priority);
+    }
+
+    void node_impl::send_item_to_peer(peer_connection* peer, const item_id& requested_item, message_send_priority priority)
+    {
       try
       {
-        message requested_message = _delegate->get_item(fetch_item_message_received.item_to_fetch);
+        message requested_message = _delegate->get_item(requested_item);
         ilog("received item request from peer ${endpoint}, returning the item with id ${id} size ${size}",
              ("id", requested_message.id())
              ("size", requested_message.size)
-             ("endpoint", originating_peer->get_remote_endpoint()));
-        //std::ostringstream bytes;
-        //for (const unsigned char& byte : requested_message.data)
-        //  bytes << " " << std::setw(2) << std::setfill('0') << std::hex << (unsigned)byte;
-        //ilog("actual bytes are${bytes}", ("bytes", bytes.str()));
-        //ilog("item's real hash is ${hash}", ("hash", fc::ripemd160::hash(&requested_message.data[0], requested_message.data.size())));
-        originating_peer->send_message(requested_message);
+             ("endpoint", peer->get_remote_endpoint()));
+        if (requested_message.msg_type == bts::client::block_message_type)
+          send_compressible_message(peer, requested_message, priority, &requested_item);
+        else
+          peer->send_message(requested_message, priority);
       }
       catch (fc::key_not_found_exception&)
       {
-        originating_peer->send_message(item_not_available_message(fetch_item_message_received.item_to_fetch));
+        peer->send_message(item_not_available_message(requested_item));
         ilog("received item request from peer ${endpoint} but we don't have it",
-             ("endpoint", originating_peer->get_remote_endpoint()));
+             ("endpoint", peer->get_remote_endpoint()));
+      }
+    }
+
+    /**
+     *  Compresses large messages for peers that accept compressed messages.  Messages that don't
+     *  shrink are sent as they are.  If a cache_key is given, the compressed form is kept under it
+     *  so the next peer asking for the same item gets a copy instead of compressing it again.
+     */
+    void node_impl::send_compressible_message(peer_connection* peer, const message& message_to_send, message_send_priority priority,
+                                              const item_id* cache_key /* = nullptr */)
+    {
+      if (_node_configuration.compression_level > 0 &&
+          (peer->capabilities & compressed_messages_capability) &&
+          message_to_send.size >= BTS_NET_MIN_COMPRESSED_MESSAGE_SIZE)
+      {
+        fc::optional<message> compressed = cache_key ? get_compressed_item(*cache_key, message_to_send)
+                                                     : compress_if_smaller(message_to_send);
+        if (compressed)
+        {
+          ++_compression_statistics.messages_compressed;
+          _compression_statistics.raw_bytes_compressed += message_to_send.size;
+          _compression_statistics.compressed_bytes_sent += compressed->size;
+          peer->send_message(*compressed, priority);
+          return;
+        }
+      }
+      peer->send_message(message_to_send, priority);
+    }
+
+    fc::optional<message> node_impl::compress_if_smaller(const message& message_to_compress)
+    {
+      message compressed(compress_message(message_to_compress, _node_configuration.compression_level));
+      if (compressed.size < message_to_compress.size)
+        return compressed;
+      return fc::optional<message>();
+    }
+
+    fc::optional<message> node_impl::get_compressed_item(const item_id& id, const message& message_to_compress)
+    {
+      auto iter = _compressed_items.find(id);
+      if (iter != _compressed_items.end())
+        return iter->second;
+
+      fc::optional<message> compressed = compress_if_smaller(message_to_compress);
+      _compressed_items[id] = compressed;
+      _compressed_item_order.push_back(id);
+      if (compressed)
+        _compressed_item_bytes += compressed->size;
+      while (_compressed_item_order.size() > 1 &&
+             (_compressed_item_bytes > BTS_NET_MAX_COMPRESSED_ITEM_CACHE_BYTES ||
+              _compressed_item_order.size() > BTS_NET_MAX_COMPRESSED_ITEM_CACHE_ITEMS))
+      {
+        auto oldest = _compressed_items.find(_compressed_item_order.front());
+        if (oldest->second)
+          _compressed_item_bytes -= oldest->second->size;
+        _compressed_items.erase(oldest);
+        _compressed_item_order.pop_front();
+      }
+      return compressed;
+    }
+
+    void node_impl::on_compressed_message(peer_connection* originating_peer, const message& received_message)
+    {
+      // unpacking and inflating happen on the peer's I/O thread, the peer is kept alive until they're done
+      peer_connection_ptr peer = originating_peer->shared_from_this();
+      std::unique_ptr<message> decompressed;
+      size_t compressed_bytes = 0;
+      peer->run_on_io_thread([&](){
+        compressed_message compressed_message_received(received_message.as<compressed_message>());
+        compressed_bytes = compressed_message_received.compressed_data.size();
+        decompressed.reset(new message(decompress_message(compressed_message_received)));
+      });
+      ++_compression_statistics.messages_decompressed;
+      _compression_statistics.compressed_bytes_received += compressed_bytes;
+      _compression_statistics.raw_bytes_decompressed += decompressed->size;
+      on_message(originating_peer, *decompressed);
+    }
+
+    void node_impl::on_queued_messages_sent(peer_connection* peer)
+    {
+      while (!peer->deferred_sync_item_requests.empty() &&
+             peer->get_queued_bytes() < BTS_NET_MAX_QUEUED_SYNC_BYTES)
+      {
+        item_id requested_item = peer->deferred_sync_item_requests.front();
+        peer->deferred_sync_item_requests.pop_front();
+        send_item_to_peer(peer, requested_item, sync_send_priority);
       }
     }
 
     void node_impl::on_item_not_available_message(peer_connection* originating_peer, const item_not_available_message& item_not_available_message_received)
     {
+      // the peer won't send it late after all, so it may be asked again
+      originating_peer->timed_out_requests.erase(item_not_available_message_received.requested_item);
+
       auto regular_item_iter = originating_peer->items_requested_from_peer.find(item_not_available_message_received.requested_item);
       if (regular_item_iter != originating_peer->items_requested_from_peer.end())
       {
         originating_peer->items_requested_from_peer.erase(regular_item_iter);
-        ilog("Peer doesn't have the requested item.");
+        ++originating_peer->items_not_available;
+        ilog("Peer doesn't have the requested item, will fetch it from another peer that offered it");
+        originating_peer->inventory.clear(item_not_available_message_received.requested_item, peer_inventory::advertised_to_us);
+        _items_to_fetch.push_front(item_not_available_message_received.requested_item);
         trigger_fetch_items_loop();
         return;
-        // TODO: reschedule fetching this item from a different peer
       }
 
       auto sync_item_iter = originating_peer->sync_items_requested_from_peer.find(item_not_available_message_received.requested_item);
       if (sync_item_iter != originating_peer->sync_items_requested_from_peer.end())
       {
         originating_peer->sync_items_requested_from_peer.erase(sync_item_iter);
+        ++originating_peer->items_not_available;
+        _active_sync_requests.erase(item_not_available_message_received.requested_item.item_hash);
         ilog("Peer doesn't have the requested sync item.  This reqlly shouldn't happen");
         trigger_fetch_sync_items_loop();
         return;
@@ -1095,7 +1609,7 @@ namespace bts { namespace net {
         bool we_requested_this_item_from_a_peer = false;
         for (const peer_connection_ptr peer : _active_connections)
         {
-          if (peer->inventory_advertised_to_peer.find(advertised_item_id) != peer->inventory_advertised_to_peer.end())
+          if (peer->inventory.get(advertised_item_id) & peer_inventory::advertised_to_peer)
           {
             we_advertised_this_item_to_a_peer = true;
             break;
@@ -1107,7 +1621,7 @@ namespace bts { namespace net {
         // if we have already advertised it to a peer, we must have it, no need to do anything else
         if (!we_advertised_this_item_to_a_peer)
         {
-          originating_peer->inventory_peer_advertised_to_us.insert(advertised_item_id);
+          originating_peer->inventory.set(advertised_item_id, peer_inventory::advertised_to_us);
           if (!we_requested_this_item_from_a_peer)
           {
             ilog("adding item ${item_hash} from inventory message to our list of items to fetch",
@@ -1123,6 +1637,16 @@ namespace bts { namespace net {
     void node_impl::on_connection_closed(peer_connection* originating_peer)
     {
       peer_connection_ptr originating_peer_ptr = originating_peer->shared_from_this();
+
+      // anything still in this peer's sync window will have to be fetched from another peer
+      if (!originating_peer->sync_items_requested_from_peer.empty())
+      {
+        for (const auto& requested_item : originating_peer->sync_items_requested_from_peer)
+          _active_sync_requests.erase(requested_item.first.item_hash);
+        originating_peer->sync_items_requested_from_peer.clear();
+        trigger_fetch_sync_items_loop();
+      }
+
       if (_closing_connections.find(originating_peer_ptr) != _closing_connections.end())
         _closing_connections.erase(originating_peer_ptr);
       else if (_active_connections.find(originating_peer_ptr) != _active_connections.end())
@@ -1136,174 +1660,214 @@ namespace bts { namespace net {
 
     void node_impl::process_backlog_of_sync_blocks()
     {
-      bool block_processed_this_iteration;
-      do
+      for (;;)
       {
-        block_processed_this_iteration = false;
-        for (auto received_block_iter = _received_sync_items.begin(); 
-             received_block_iter != _received_sync_items.end(); 
-             ++received_block_iter)
-        {
-          // find out if this block is the next block that we can hand directly to the client
-          bool potential_first_block = false;
-          for (const peer_connection_ptr& peer : _active_connections)
-            if (!peer->ids_of_items_to_get.empty() &&
-                peer->ids_of_items_to_get.front() == received_block_iter->block_id)
-            {
-              potential_first_block = true;
+        // the next block we can hand directly to the client must be the first item on some sync peer's
+        // list.  Those are the only candidates, so look each of them up in the backlog instead of
+        // searching the backlog for them.  Sync item ids are bare block ids with no block number, and
+        // peers on a fork may disagree about what comes next, so these list fronts are our next-expected
+        // pointers rather than a single position of our own
+        auto received_block_iter = _received_sync_items.end();
+        for (const peer_connection_ptr& peer : _active_connections)
+          if (!peer->ids_of_items_to_get.empty())
+          {
+            received_block_iter = _received_sync_items.find(peer->ids_of_items_to_get.front());
+            if (received_block_iter != _received_sync_items.end())
               break;
-            }
+          }
+        if (received_block_iter == _received_sync_items.end())
+          break;
 
-          // if it is, process it, remove it from all sync peers lists
-          if (potential_first_block)
-          {
-            bts::client::block_message block_message_to_process = *received_block_iter;
-            _received_sync_items.erase(received_block_iter);
+        // process it, remove it from all sync peers lists
+        bts::client::block_message block_message_to_process = std::move(received_block_iter->second);
+        _received_sync_items.erase(received_block_iter);
 
-            bool client_accepted_block = false;
-            try
-            {
-              ilog("sync: this block is a potential first block, passing it to the client");
-
-              // we can get into an intersting situation near the end of synchronization.  We can be in
-              // sync with one peer who is sending us the last block on the chain via a regular inventory
-              // message, while at the same time still be synchronizing with a peer who is sending us the
-              // block through the sync mechanism.  Further, we must request both blocks because 
-              // we don't know they're the same (for the peer in normal operation, it has only told us the
-              // message id, for the peer in the sync case we only known the block_id).
-              if (std::find(_most_recent_blocks_accepted.begin(), _most_recent_blocks_accepted.end(),
-                            block_message_to_process.block_id) == _most_recent_blocks_accepted.end())
-              {
-                _delegate->handle_message(block_message_to_process);
-                // TODO: only record as accepted if it has a valid signature.
-                _most_recent_blocks_accepted.push_back(block_message_to_process.block_id);
-              }
-              else
-                ilog("Already received and accepted this block (presumably through normal inventory mechanism), treating it as accepted");
+        bool client_accepted_block = false;
+        try
+        {
+          ilog("sync: this block is a potential first block, passing it to the client");
 
-              client_accepted_block = true;
-            }
-            catch (fc::exception&)
-            {
-              wlog("sync: client rejected sync block sent by peer");
-            }
+          // we can get into an intersting situation near the end of synchronization.  We can be in
+          // sync with one peer who is sending us the last block on the chain via a regular inventory
+          // message, while at the same time still be synchronizing with a peer who is sending us the
+          // block through the sync mechanism.  Further, we must request both blocks because 
+          // we don't know they're the same (for the peer in normal operation, it has only told us the
+          // message id, for the peer in the sync case we only known the block_id).
+          if (std::find(_most_recent_blocks_accepted.begin(), _most_recent_blocks_accepted.end(),
+                        block_message_to_process.block_id) == _most_recent_blocks_accepted.end())
+          {
+            _delegate->handle_message(block_message_to_process);
+            // TODO: only record as accepted if it has a valid signature.
+            _most_recent_blocks_accepted.push_back(block_message_to_process.block_id);
+          }
+          else
+            ilog("Already received and accepted this block (presumably through normal inventory mechanism), treating it as accepted");
+
+          client_accepted_block = true;
+        }
+        catch (fc::exception&)
+        {
+          wlog("sync: client rejected sync block sent by peer");
+        }
 
-            if (client_accepted_block)
+        if (client_accepted_block)
+        {
+          --_total_number_of_unfetched_items;
+          ilog("sync: client accpted the block, we now have only ${count} items left to fetch before we're in sync", ("count", _total_number_of_unfetched_items));
+          std::set<peer_connection_ptr> peers_with_newly_empty_item_lists;
+          std::set<peer_connection_ptr> peers_we_need_to_sync_to;
+          for (const peer_connection_ptr& peer : _active_connections)
+          {
+            if (peer->ids_of_items_to_get.empty())
             {
-              --_total_number_of_unfetched_items;
-              block_processed_this_iteration = true;
-              ilog("sync: client accpted the block, we now have only ${count} items left to fetch before we're in sync", ("count", _total_number_of_unfetched_items));
-              std::set<peer_connection_ptr> peers_with_newly_empty_item_lists;
-              std::set<peer_connection_ptr> peers_we_need_to_sync_to;
-              for (const peer_connection_ptr& peer : _active_connections)
+              ilog("Cannot pop first element off peer ${peer}'s list, its list is empty", ("peer", peer->get_remote_endpoint()));
+              // we don't know for sure that this peer has the item we just received.
+              // If peer is still syncing to us, we know they will ask us for
+              // sync item ids at least one more time and we'll notify them about
+              // the item then, so there's no need to do anything.  If we still need items
+              // from them, we'll be asking them for more items at some point, and
+              // that will clue them in that they are out of sync.  If we're fully in sync 
+              // we need to kick off another round of synchronization with them so they can 
+              // find out about the new item.
+              if (!peer->peer_needs_sync_items_from_us && !peer->we_need_sync_items_from_peer)
               {
-                if (peer->ids_of_items_to_get.empty())
-                {
-                  ilog("Cannot pop first element off peer ${peer}'s list, its list is empty", ("peer", peer->get_remote_endpoint()));
-                  // we don't know for sure that this peer has the item we just received.
-                  // If peer is still syncing to us, we know they will ask us for
-                  // sync item ids at least one more time and we'll notify them about
-                  // the item then, so there's no need to do anything.  If we still need items
-                  // from them, we'll be asking them for more items at some point, and
-                  // that will clue them in that they are out of sync.  If we're fully in sync 
-                  // we need to kick off another round of synchronization with them so they can 
-                  // find out about the new item.
-                  if (!peer->peer_needs_sync_items_from_us && !peer->we_need_sync_items_from_peer)
-                  {
-                    ilog("We will be restarting synchronization with peer ${peer}", ("peer", peer->get_remote_endpoint()));
-                    peers_we_need_to_sync_to.insert(peer);
-                  }
-                }
-                else
-                {
-                  if (peer->ids_of_items_to_get.front() == block_message_to_process.block_id)
-                  {
-                    peer->ids_of_items_to_get.pop_front();
-                    ilog("Popped item from front of ${endpoint}'s sync list, new list length is ${len}", ("endpoint", peer->get_remote_endpoint())("len", peer->ids_of_items_to_get.size()));
-
-                    // if we just received the last item in our list from this peer, we will want to 
-                    // send another request to find out if we are in sync, but we can't do this yet
-                    // (we don't want to allow a fiber swap in the middle of popping items off the list)
-                    if (peer->ids_of_items_to_get.empty() && peer->number_of_unfetched_item_ids == 0)
-                      peers_with_newly_empty_item_lists.insert(peer);
-
-                    // in this case, we know the peer was offering us this exact item, no need to 
-                    // try to inform them of its existence
-                  }
-                  else
-                  {
-                    // the peer's of sync items is nonempty, and its first item doesn't match
-                    // the one we just accepted.
-                    // 
-                    // This probably means that this peer is offering us garbage (its blockchain
-                    // should match everyone else's blockchain).  We could see this during a fork,
-                    // though.  I'm not certain if we've settled on what a fork looks like at this
-                    // level, so I'm just leaving the peer connected here.  If it turns out
-                    // that forks are impossible or won't effect sync behavior, we should disconnect 
-                    // the offending peer here.
-                    ilog("Cannot pop first element off peer ${peer}'s list, its first is ${hash}", ("peer", peer->get_remote_endpoint())("hash", peer->ids_of_items_to_get.front()));
-                  }
-                }
+                ilog("We will be restarting synchronization with peer ${peer}", ("peer", peer->get_remote_endpoint()));
+                peers_we_need_to_sync_to.insert(peer);
               }
-              for (const peer_connection_ptr& peer : peers_with_newly_empty_item_lists)
-                fetch_next_batch_of_item_ids_from_peer(peer.get(), item_id(bts::client::block_message_type, block_message_to_process.block_id));
-
-              for (const peer_connection_ptr& peer : peers_we_need_to_sync_to)
-                start_synchronizing_with_peer(peer);
             }
             else
             {
-              // invalid message received
-              std::list<peer_connection_ptr> peers_to_disconnect;
-              for (const peer_connection_ptr& peer : _active_connections)
-                if (!peer->ids_of_items_to_get.empty() &&
-                    peer->ids_of_items_to_get.front() == block_message_to_process.block_id)
-                  peers_to_disconnect.push_back(peer);
-              for (const peer_connection_ptr& peer : peers_to_disconnect)
+              if (peer->ids_of_items_to_get.front() == block_message_to_process.block_id)
               {
-                wlog("disconnecting client ${endpoint} because it offered us the rejected block", ("endpoint", peer->get_remote_endpoint()));
-                disconnect_from_peer(peer.get());
+                peer->ids_of_items_to_get.pop_front();
+                ilog("Popped item from front of ${endpoint}'s sync list, new list length is ${len}", ("endpoint", peer->get_remote_endpoint())("len", peer->ids_of_items_to_get.size()));
+
+                // if we just received the last item in our list from this peer, we will want to 
+                // send another request to find out if we are in sync, but we can't do this yet
+                // (we don't want to allow a fiber swap in the middle of popping items off the list)
+                if (peer->ids_of_items_to_get.empty() && peer->number_of_unfetched_item_ids == 0)
+                  peers_with_newly_empty_item_lists.insert(peer);
+
+                // in this case, we know the peer was offering us this exact item, no need to 
+                // try to inform them of its existence
               }
-              break;
-            }              
+              else
+              {
+                // the peer's of sync items is nonempty, and its first item doesn't match
+                // the one we just accepted.
+                // 
+                // This probably means that this peer is offering us garbage (its blockchain
+                // should match everyone else's blockchain).  We could see this during a fork,
+                // though.  I'm not certain if we've settled on what a fork looks like at this
+                // level, so I'm just leaving the peer connected here.  If it turns out
+                // that forks are impossible or won't effect sync behavior, we should disconnect 
+                // the offending peer here.
+                ilog("Cannot pop first element off peer ${peer}'s list, its first is ${hash}", ("peer", peer->get_remote_endpoint())("hash", peer->ids_of_items_to_get.front()));
+              }
+            }
+          }
+          for (const peer_connection_ptr& peer : peers_with_newly_empty_item_lists)
+            fetch_next_batch_of_item_ids_from_peer(peer.get(), item_id(bts::client::block_message_type, block_message_to_process.block_id));
 
-            break; // start iterating _received_sync_items from the beginning
-          } // end if potential_first_block
-        } // end for each block in _received_sync_items
-      } while (block_processed_this_iteration);
+          for (const peer_connection_ptr& peer : peers_we_need_to_sync_to)
+            start_synchronizing_with_peer(peer);
+        }
+        else
+        {
+          // invalid message received
+          std::list<peer_connection_ptr> peers_to_disconnect;
+          for (const peer_connection_ptr& peer : _active_connections)
+            if (!peer->ids_of_items_to_get.empty() &&
+                peer->ids_of_items_to_get.front() == block_message_to_process.block_id)
+              peers_to_disconnect.push_back(peer);
+          for (const peer_connection_ptr& peer : peers_to_disconnect)
+          {
+            wlog("disconnecting client ${endpoint} because it offered us the rejected block", ("endpoint", peer->get_remote_endpoint()));
+            disconnect_from_peer(peer.get());
+          }
+          break;
+        }              
+      } // end for each block we can process
       ilog("Currently backlog is ${count} blocks", ("count", _received_sync_items.size()));
     }
 
-    void node_impl::process_block_during_sync(peer_connection* originating_peer, const message& message_to_process, const message_hash_type& message_hash)
+    /**
+     *  Hashing and unpacking a block are most of the work of receiving it and don't touch the node, so they
+     *  happen on the peer's I/O thread while the node's thread handles other peers.
+     */
+    void node_impl::on_block_message(peer_connection* originating_peer, const message& received_message)
+    {
+      peer_connection_ptr peer = originating_peer->shared_from_this(); // kept alive until the I/O thread is done
+      bool peer_was_active = _active_connections.find(peer) != _active_connections.end();
+      message_hash_type message_hash;
+      bts::client::block_message block_message_received;
+      peer->run_on_io_thread([&](){
+        message_hash = received_message.id();
+        block_message_received = received_message.as<bts::client::block_message>();
+      });
+
+      // the peer may have been disconnected and its requests handed to other peers while we waited
+      if (peer_was_active && _active_connections.find(peer) == _active_connections.end())
+        return;
+      if (originating_peer->we_need_sync_items_from_peer)
+        process_block_during_sync(originating_peer, block_message_received, received_message);
+      else
+        process_block_during_normal_operation(originating_peer, block_message_received, received_message, message_hash);
+    }
+
+    void node_impl::process_block_during_sync(peer_connection* originating_peer, bts::client::block_message& block_message_to_process,
+                                              const message& message_to_process)
     {
       assert(originating_peer->we_need_sync_items_from_peer);
-      assert(message_to_process.msg_type == bts::client::message_type_enum::block_message_type);
-      bts::client::block_message block_message_to_process(message_to_process.as<bts::client::block_message>());
       
       // only process it if we asked for it
-      auto iter = originating_peer->sync_items_requested_from_peer.find(item_id(bts::client::block_message_type, block_message_to_process.block_id));
-      if (iter == originating_peer->sync_items_requested_from_peer.end())
+      item_id block_item_id(bts::client::block_message_type, block_message_to_process.block_id);
+      auto iter = originating_peer->sync_items_requested_from_peer.find(block_item_id);
+      bool arrived_after_timeout = false;
+      if (iter != originating_peer->sync_items_requested_from_peer.end())
+      {
+        ilog("received a sync block from peer ${endpoint}", ("endpoint", originating_peer->get_remote_endpoint()));
+        fc::microseconds latency = fc::time_point::now() - iter->second;
+        originating_peer->sync_items_requested_from_peer.erase(iter);
+        originating_peer->update_sync_request_window(latency, message_to_process.size);
+        originating_peer->record_item_delivered(latency);
+      }
+      else if (originating_peer->timed_out_requests.erase(block_item_id))
+      {
+        ilog("received a sync block from peer ${endpoint} after its request timed out", ("endpoint", originating_peer->get_remote_endpoint()));
+        arrived_after_timeout = true;
+      }
+      else
       {
         wlog("received a sync block I didn't ask for from peer ${endpoint}, disconnecting from peer", ("endpoint", originating_peer->get_remote_endpoint()));
         disconnect_from_peer(originating_peer);
         return;
       }
-      else
+
+      // if we re-requested it from another peer, that copy is now the late one
+      for (const peer_connection_ptr& peer : _active_connections)
+        if (peer.get() != originating_peer && peer->sync_items_requested_from_peer.erase(block_item_id))
+          peer->remember_timed_out_request(block_item_id);
+      _active_sync_requests.erase(block_message_to_process.block_id);
+
+      if (arrived_after_timeout && !is_sync_item_still_needed(block_message_to_process.block_id))
       {
-        ilog("received a sync block from peer ${endpoint}", ("endpoint", originating_peer->get_remote_endpoint()));
-        originating_peer->sync_items_requested_from_peer.erase(iter);
+        ilog("already have sync block ${id}, dropping the late copy", ("id", block_message_to_process.block_id));
+        trigger_fetch_sync_items_loop();
+        return;
       }
 
-      // add it to the front of _received_sync_items, then process _received_sync_items to try to 
+      // add it to _received_sync_items, then process _received_sync_items to try to 
       // pass as many messages as possible to the client.
-      _received_sync_items.push_front(block_message_to_process);
+      _received_sync_items.insert(received_sync_items_map::value_type(block_message_to_process.block_id, std::move(block_message_to_process)));
       process_backlog_of_sync_blocks();
 
       // we should be ready to request another block now
       trigger_fetch_sync_items_loop();
     }
 
-    void node_impl::process_block_during_normal_operation(peer_connection* originating_peer, const message& message_to_process, const message_hash_type& message_hash)
+    void node_impl::process_block_during_normal_operation(peer_connection* originating_peer, const bts::client::block_message& block_message_to_process,
+                                                          const message& message_to_process, const message_hash_type& message_hash)
     {
       //std::ostringstream bytes;
       //for (const unsigned char& byte : message_to_process.data)
@@ -1314,12 +1878,13 @@ namespace bts { namespace net {
       dump_node_status();
 
       assert(!originating_peer->we_need_sync_items_from_peer);
-      assert(message_to_process.msg_type == bts::client::message_type_enum::block_message_type);
-      bts::client::block_message block_message_to_process(message_to_process.as<bts::client::block_message>());
       
-      // only process it if we asked for it
-      auto iter = originating_peer->items_requested_from_peer.find(item_id(bts::client::block_message_type, message_hash));
-      if (iter == originating_peer->items_requested_from_peer.end())
+      // only process it if we asked for it.  If the request timed out we've asked another peer too,
+      // whichever copy arrives second is recognized as already accepted below
+      item_id block_item_id(bts::client::block_message_type, message_hash);
+      auto iter = originating_peer->items_requested_from_peer.find(block_item_id);
+      if (iter == originating_peer->items_requested_from_peer.end() &&
+          !originating_peer->timed_out_requests.erase(block_item_id))
       {
         wlog("received a block I didn't ask for from peer ${endpoint}, disconnecting from peer", ("endpoint", originating_peer->get_remote_endpoint()));
         disconnect_from_peer(originating_peer);
@@ -1328,7 +1893,11 @@ namespace bts { namespace net {
       else
       {
         ilog("received a block from peer ${endpoint}, passing it to client", ("endpoint", originating_peer->get_remote_endpoint()));
-        originating_peer->items_requested_from_peer.erase(iter);
+        if (iter != originating_peer->items_requested_from_peer.end())
+        {
+          originating_peer->record_item_delivered(fc::time_point::now() - iter->second);
+          originating_peer->items_requested_from_peer.erase(iter);
+        }
         try
         {
           // we can get into an intersting situation near the end of synchronization.  We can be in
@@ -1353,14 +1922,13 @@ namespace bts { namespace net {
           for (const peer_connection_ptr& peer : _active_connections)
           {
             item_id block_message_item_id(bts::client::message_type_enum::block_message_type, message_hash);
-            auto iter = peer->inventory_peer_advertised_to_us.find(block_message_item_id);
-            if (iter != peer->inventory_peer_advertised_to_us.end())
+            if (peer->inventory.get(block_message_item_id) & peer_inventory::advertised_to_us)
             {
               // this peer offered us the item; remove it from the list of items they offered us, and 
               // add it to the list of items we've offered them.  That will prevent us from offering them
               // the same item back (no reason to do that; we already know they have it)
-              peer->inventory_peer_advertised_to_us.erase(iter);
-              peer->inventory_advertised_to_peer.insert(block_message_item_id);
+              peer->inventory.clear(block_message_item_id, peer_inventory::advertised_to_us);
+              peer->inventory.set(block_message_item_id, peer_inventory::advertised_to_peer);
             }
           }
           broadcast(message_to_process);
@@ -1421,7 +1989,7 @@ namespace bts { namespace net {
     {
       while (!_accept_loop_complete.canceled())
       {
-        peer_connection_ptr new_peer(std::make_shared<peer_connection>(std::ref(*this)));
+        peer_connection_ptr new_peer(std::make_shared<peer_connection>(std::ref(*this), choose_io_thread()));
         try
         {
           _tcp_server.accept(new_peer->get_socket());
@@ -1473,10 +2041,16 @@ namespace bts { namespace net {
 
         throw except;
       }
-      hello_message hello(_user_agent_string, core_protocol_version, _node_configuration.listen_endpoint, _node_id);
-      new_peer->state = peer_connection::hello_sent;
-      new_peer->send_message(message(hello));
-      ilog("Sent \"hello\" to remote peer ${peer}", ("peer", new_peer->get_remote_endpoint()));
+      send_hello_message(new_peer);
+    }
+
+    void node_impl::send_hello_message(const peer_connection_ptr& peer)
+    {
+      hello_message hello(_user_agent_string, core_protocol_version, _node_configuration.listen_endpoint, _node_id,
+                          compressed_messages_capability);
+      peer->state = peer_connection::hello_sent;
+      peer->send_message(pack_hello_message(hello));
+      ilog("Sent \"hello\" to remote peer ${peer}", ("peer", peer->get_remote_endpoint()));
     }
 
     // methods implementing node's public interface
@@ -1541,6 +2115,32 @@ namespace bts { namespace net {
       } 
     }
 
+    void node_impl::connect_to_simulated_network(const fc::ip::endpoint& simulated_endpoint)
+    {
+      // peers are paired by connect_to_simulated_node() instead of being accepted or
+      // dialed, so only the loops that move items are started
+      _node_configuration.listen_endpoint = simulated_endpoint;
+      _fetch_sync_items_loop_done = fc::async([=]() { fetch_sync_items_loop(); });
+      _fetch_item_loop_done = fc::async([=]() { fetch_items_loop(); });
+      _advertise_inventory_loop_done = fc::async([=]() { advertise_inventory_loop(); });
+    }
+
+    void node_impl::connect_to_simulated_node(node_impl& remote_node, const simulated_link_properties& outbound_link, const simulated_link_properties& inbound_link)
+    {
+      const fc::ip::endpoint& remote_endpoint = remote_node._node_configuration.listen_endpoint;
+      if (is_connection_to_endpoint_in_progress(remote_endpoint))
+        FC_THROW("already connected to requested endpoint ${endpoint}", ("endpoint", remote_endpoint));
+
+      peer_connection_ptr new_peer(std::make_shared<peer_connection>(std::ref(*this)));
+      peer_connection_ptr new_remote_peer(std::make_shared<peer_connection>(std::ref(remote_node)));
+      new_peer->set_remote_endpoint(remote_endpoint);
+      new_remote_peer->set_remote_endpoint(_node_configuration.listen_endpoint);
+      peer_connection::connect_simulated(*new_peer, *new_remote_peer, outbound_link, inbound_link);
+      _handshaking_connections.insert(new_peer);
+      remote_node._handshaking_connections.insert(new_remote_peer);
+      send_hello_message(new_peer);
+    }
+
     void node_impl::add_node(const fc::ip::endpoint& ep)
     {
       // TODO
@@ -1552,7 +2152,7 @@ namespace bts { namespace net {
         FC_THROW("already connected to requested endpoint ${endpoint}", ("endpoint", remote_endpoint));
 
       ilog("node_impl::connect_to(${endpoint})", ("endpoint", remote_endpoint));
-      peer_connection_ptr new_peer(std::make_shared<peer_connection>(std::ref(*this)));
+      peer_connection_ptr new_peer(std::make_shared<peer_connection>(std::ref(*this), choose_io_thread()));
       new_peer->set_remote_endpoint(remote_endpoint);
       _handshaking_connections.insert(new_peer);
       fc::async([=](){ connect_to_task(new_peer, remote_endpoint); });
@@ -1588,6 +2188,9 @@ namespace bts { namespace net {
              ("in_sync_with_us", !peer->peer_needs_sync_items_from_us)("in_sync_with_them", !peer->we_need_sync_items_from_peer));
         if (peer->we_need_sync_items_from_peer)
           ilog("              above peer has ${count} sync items we might need", ("count", peer->ids_of_items_to_get.size()));
+        ilog("              delivered ${delivered} items, average latency ${latency}us, ${not_available} not available, ${timeouts} timed out",
+             ("delivered", peer->items_delivered)("latency", peer->average_delivery_latency.count())
+             ("not_available", peer->items_not_available)("timeouts", peer->request_timeouts));
       }
       for (const peer_connection_ptr& peer : _handshaking_connections)
       {
@@ -1633,6 +2236,62 @@ namespace bts { namespace net {
       dump_node_status();
     }
 
+    void node_impl::set_compression_level(int32_t compression_level)
+    {
+      FC_ASSERT(compression_level >= 0 && compression_level <= 9, "compression level must be between 0 and 9");
+      _node_configuration.compression_level = compression_level;
+      // the cached items were compressed at the old level
+      _compressed_items.clear();
+      _compressed_item_order.clear();
+      _compressed_item_bytes = 0;
+      save_node_configuration();
+    }
+
+    void node_impl::set_io_thread_count(uint32_t io_thread_count)
+    {
+      _node_configuration.io_thread_count = io_thread_count;
+      save_node_configuration();
+    }
+
+    /** the I/O thread for a new connection, connections are spread over the threads in turn */
+    fc::thread* node_impl::choose_io_thread()
+    {
+      if (!_node_configuration.io_thread_count)
+        return nullptr;
+      while (_io_threads.size() < _node_configuration.io_thread_count)
+        _io_threads.emplace_back(new fc::thread("p2p io " + fc::to_string(int64_t(_io_threads.size()))));
+      return _io_threads[_next_io_thread++ % _node_configuration.io_thread_count].get();
+    }
+
+    message_compression_statistics node_impl::get_compression_statistics() const
+    {
+      return _compression_statistics;
+    }
+
+    network_statistics node_impl::get_network_statistics() const
+    {
+      network_statistics statistics;
+      statistics.messages_by_type = _message_statistics;
+      statistics.fetch_item_latency = _fetch_item_latency;
+      statistics.fetch_blockchain_item_ids_latency = _fetch_blockchain_item_ids_latency;
+      statistics.active_connections = _active_connections.size();
+      statistics.handshaking_connections = _handshaking_connections.size();
+      for (const peer_connection_ptr& peer : _active_connections)
+      {
+        uint64_t queued_bytes = peer->get_queued_bytes();
+        statistics.queued_send_bytes += queued_bytes;
+        statistics.max_peer_queued_send_bytes = std::max(statistics.max_peer_queued_send_bytes, queued_bytes);
+        statistics.deferred_sync_item_requests += peer->deferred_sync_item_requests.size();
+        statistics.items_requested += peer->items_requested_from_peer.size();
+      }
+      statistics.items_to_fetch = _items_to_fetch.size();
+      statistics.new_inventory = _new_inventory.size();
+      statistics.active_sync_requests = _active_sync_requests.size();
+      statistics.sync_backlog = _received_sync_items.size();
+      statistics.unfetched_sync_items = _total_number_of_unfetched_items;
+      return statistics;
+    }
+
     void node_impl::sync_from(const item_id& last_item_id_seen)
     {
       _most_recent_blocks_accepted.clear();
@@ -1676,6 +2335,16 @@ namespace bts { namespace net {
     my->connect_to_p2p_network();
   }
 
+  void node::connect_to_simulated_network(const fc::ip::endpoint& simulated_endpoint)
+  {
+    my->connect_to_simulated_network(simulated_endpoint);
+  }
+
+  void node::connect_to_simulated_node(node& remote_node, const simulated_link_properties& outbound_link, const simulated_link_properties& inbound_link)
+  {
+    my->connect_to_simulated_node(*remote_node.my, outbound_link, inbound_link);
+  }
+
   void node::add_node(const fc::ip::endpoint& ep)
   {
     my->add_node(ep);
@@ -1701,6 +2370,38 @@ namespace bts { namespace net {
     return my->get_connected_peers();
   }
 
+  void node::set_compression_level(int32_t compression_level)
+  {
+    my->set_compression_level(compression_level);
+  }
+
+  void node::set_io_thread_count(uint32_t io_thread_count)
+  {
+    my->set_io_thread_count(io_thread_count);
+  }
+
+  message_compression_statistics node::get_compression_statistics() const
+  {
+    return my->get_compression_statistics();
+  }
+
+  network_statistics node::get_network_statistics() const
+  {
+    return my->get_network_statistics();
+  }
+
+  void latency_histogram::record(const fc::microseconds& latency)
+  {
+    uint64_t latency_us = std::max<int64_t>(latency.count(), 0);
+    ++sample_count;
+    total_latency_us += latency_us;
+    max_latency_us = std::max(max_latency_us, latency_us);
+    uint32_t bucket = 0;
+    for (uint64_t latency_ms = latency_us / 1000; latency_ms && bucket < number_of_buckets - 1; latency_ms >>= 1)
+      ++bucket;
+    ++buckets[bucket];
+  }
+
   void node::broadcast(const message& msg)
   {
     my->broadcast(msg);
@@ -13,8 +13,19 @@
 
 namespace bts { namespace net {
 
+namespace
+{
+   std::shared_ptr<char> new_recv_buffer()
+   {
+      return std::shared_ptr<char>( new char[BTS_NET_STCP_RECV_BUFFER_SIZE], std::default_delete<char[]>() );
+   }
+}
+
 stcp_socket::stcp_socket()
-:_buf_len(0)
+:_recv_buffer( new_recv_buffer() ),
+ _recv_pos(0),
+ _recv_end(0),
+ _send_buffer( new char[BTS_NET_STCP_SEND_BUFFER_SIZE] )
 {
 }
 stcp_socket::~stcp_socket()
@@ -52,26 +63,93 @@ void stcp_socket::connect_to( const fc::ip::endpoint& remote_endpoint, const fc:
 }
 
 /**
- *   This method must read at least 16 bytes at a time from
- *   the underlying TCP socket so that it can decrypt them. It
- *   will buffer any left-over.
+ *   Decrypted data is returned from the receive buffer, which is refilled with
+ *   everything the TCP socket has available (up to its size) once it is empty,
+ *   so reading a message header and then its body usually costs one socket read.
+ *   Reads at least as large as the buffer skip it and decrypt in the caller's memory.
  */
 size_t stcp_socket::readsome( char* buffer, size_t len )
 { try {
     assert( (len % 16) == 0 );
     assert( len >= 16 );
-    char crypt_buf[4096];
-    len = std::min<size_t>(sizeof(crypt_buf),len);
 
-    size_t s = _sock.readsome( crypt_buf, len );
+    if( _recv_pos == _recv_end )
+    {
+       if( len >= BTS_NET_STCP_RECV_BUFFER_SIZE )
+          return read_and_decrypt( buffer, len );
+       // messages from read_shared() may still point into the old buffer
+       if( _recv_buffer.use_count() > 1 )
+          _recv_buffer = new_recv_buffer();
+       _recv_pos = 0;
+       _recv_end = 0; // stays empty if the read throws
+       _recv_end = read_and_decrypt( _recv_buffer.get(), BTS_NET_STCP_RECV_BUFFER_SIZE );
+    }
+
+    // both ends stay multiples of 16, so this does too
+    size_t s = std::min<size_t>( len, _recv_end - _recv_pos );
+    memcpy( buffer, _recv_buffer.get() + _recv_pos, s );
+    _recv_pos += s;
+    return s;
+} FC_RETHROW_EXCEPTIONS( warn, "", ("len",len) ) }
+
+/**
+ *   Reads into the free space after _recv_end, which is never shared, and only
+ *   moves the unread bytes when the message would run past the end of the buffer.
+ */
+const char* stcp_socket::peek( size_t len )
+{ try {
+    FC_ASSERT( len % 16 == 0 );
+    FC_ASSERT( len <= BTS_NET_STCP_RECV_BUFFER_SIZE );
+    if( _recv_end - _recv_pos < len )
+    {
+       if( _recv_pos + len > BTS_NET_STCP_RECV_BUFFER_SIZE )
+          compact_recv_buffer();
+       while( _recv_end - _recv_pos < len )
+          _recv_end += read_and_decrypt( _recv_buffer.get() + _recv_end, BTS_NET_STCP_RECV_BUFFER_SIZE - _recv_end );
+    }
+    return _recv_buffer.get() + _recv_pos;
+} FC_RETHROW_EXCEPTIONS( warn, "", ("len",len) ) }
+
+std::shared_ptr<const char> stcp_socket::read_shared( size_t len )
+{
+    peek( len );
+    std::shared_ptr<const char> result( _recv_buffer, _recv_buffer.get() + _recv_pos );
+    _recv_pos += len;
+    return result;
+}
+
+void stcp_socket::compact_recv_buffer()
+{
+    size_t unread = _recv_end - _recv_pos;
+    if( _recv_buffer.use_count() > 1 )
+    {
+       auto fresh = new_recv_buffer();
+       memcpy( fresh.get(), _recv_buffer.get() + _recv_pos, unread );
+       _recv_buffer = fresh;
+    }
+    else
+    {
+       memmove( _recv_buffer.get(), _recv_buffer.get() + _recv_pos, unread );
+    }
+    _recv_pos = 0;
+    _recv_end = unread;
+}
+
+/**
+ *   The cipher works on 16 byte blocks, so a partial block is completed with
+ *   a blocking read before decrypting.
+ */
+size_t stcp_socket::read_and_decrypt( char* buffer, size_t len )
+{
+    size_t s = _sock.readsome( buffer, len );
     if( s % 16 ) 
     {
-        _sock.read( crypt_buf + s, 16 - (s%16) );
+        _sock.read( buffer + s, 16 - (s%16) );
         s += 16-(s%16);
     }
-    _recv_aes.decode( crypt_buf, s, buffer );
+    _recv_aes.decode( buffer, s, buffer );
     return s;
-} FC_RETHROW_EXCEPTIONS( warn, "", ("len",len) ) }
+}
 
 bool stcp_socket::eof()const
 {
@@ -82,24 +160,22 @@ size_t stcp_socket::writesome( const char* buffer, size_t len )
 { try {
     assert( len % 16 == 0 );
     assert( len > 0 );
-    char crypt_buf[4096];
-    len = std::min<size_t>(sizeof(crypt_buf),len);
-    memcpy( crypt_buf, buffer, len );
-    /**
-     * every sizeof(crypt_buf) bytes the aes channel
-     * has an error and doesn't decrypt properly...  disable
-     * for now because we are going to upgrade to something
-     * better.
-     */
-    //auto cipher_len =
-    _send_aes.encode( buffer, len, crypt_buf );
+    len = std::min<size_t>( BTS_NET_STCP_SEND_BUFFER_SIZE, len );
+    _send_aes.encode( buffer, len, _send_buffer.get() );
     FC_ASSERT( len >= 16 );
     FC_ASSERT( len % 16 == 0);
-   // memcpy( crypt_buf, buffer, len );
-    _sock.write( (char*)crypt_buf, len );
+    _sock.write( _send_buffer.get(), len );
     return len;
 } FC_RETHROW_EXCEPTIONS( warn, "", ("len",len) ) }
 
+void stcp_socket::encrypt_and_write( char* buffer, size_t len )
+{ try {
+    FC_ASSERT( len % 16 == 0 );
+    if( !len ) return;
+    _send_aes.encode( buffer, len, buffer );
+    _sock.write( buffer, len );
+} FC_RETHROW_EXCEPTIONS( warn, "", ("len",len) ) }
+
 void stcp_socket::flush()
 {
    _sock.flush();
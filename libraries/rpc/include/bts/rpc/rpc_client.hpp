@@ -4,6 +4,8 @@
 #include <bts/blockchain/address.hpp>
 #include <bts/blockchain/transaction.hpp>
 #include <bts/blockchain/block.hpp>
+#include <bts/blockchain/fee_estimator.hpp>
+#include <bts/net/node.hpp>
 
 #include <fc/network/ip.hpp>
 #include <fc/filesystem.hpp>
@@ -32,6 +34,9 @@ namespace bts { namespace rpc {
     bts::blockchain::asset getbalance(bts::blockchain::asset_type asset_type);
     bts::blockchain::signed_transaction get_transaction(bts::blockchain::transaction_id_type trascaction_id);
     bts::blockchain::signed_block_header getblock(uint32_t block_num);
+    uint64_t estimate_fee_rate(uint32_t target_blocks = 1);
+    bts::blockchain::fee_statistics get_fee_statistics();
+    bts::net::network_statistics get_network_statistics();
     bool validateaddress(bts::blockchain::address address);
     bool rescan(uint32_t block_num = 0);
     bool import_bitcoin_wallet(const fc::path& wallet_filename, const std::string& password);
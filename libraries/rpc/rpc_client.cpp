@@ -2,6 +2,7 @@
 #include <bts/blockchain/address.hpp>
 #include <bts/blockchain/transaction.hpp>
 #include <bts/blockchain/block.hpp>
+#include <bts/blockchain/fee_estimator.hpp>
 #include <fc/reflect/variant.hpp>
 #include <fc/network/tcp_socket.hpp>
 #include <fc/rpc/json_connection.hpp>
@@ -29,6 +30,9 @@ namespace bts { namespace rpc {
       bts::blockchain::asset getbalance(bts::blockchain::asset_type asset_type);
       bts::blockchain::signed_transaction get_transaction(bts::blockchain::transaction_id_type trascaction_id);
       bts::blockchain::signed_block_header getblock(uint32_t block_num);
+      uint64_t estimate_fee_rate(uint32_t target_blocks);
+      bts::blockchain::fee_statistics get_fee_statistics();
+      bts::net::network_statistics get_network_statistics();
       bool validateaddress(bts::blockchain::address address);
       bool rescan(uint32_t block_num);
       bool import_bitcoin_wallet(const fc::path& wallet_filename, const std::string& password);
@@ -96,6 +100,21 @@ namespace bts { namespace rpc {
       return _json_connection->call<bts::blockchain::signed_block_header>("getblock", fc::variant(block_num));
     }
 
+    uint64_t rpc_client_impl::estimate_fee_rate(uint32_t target_blocks)
+    {
+      return _json_connection->call<uint64_t>("estimate_fee_rate", fc::variant(target_blocks));
+    }
+
+    bts::blockchain::fee_statistics rpc_client_impl::get_fee_statistics()
+    {
+      return _json_connection->call<bts::blockchain::fee_statistics>("get_fee_statistics");
+    }
+
+    bts::net::network_statistics rpc_client_impl::get_network_statistics()
+    {
+      return _json_connection->call<bts::net::network_statistics>("get_network_statistics");
+    }
+
     bool rpc_client_impl::validateaddress(bts::blockchain::address address)
     {
       return _json_connection->call<bool>("getblock", fc::variant(address));
@@ -173,6 +192,21 @@ namespace bts { namespace rpc {
     return my->getblock(block_num);
   }
 
+  uint64_t rpc_client::estimate_fee_rate(uint32_t target_blocks /* = 1 */)
+  {
+    return my->estimate_fee_rate(target_blocks);
+  }
+
+  bts::blockchain::fee_statistics rpc_client::get_fee_statistics()
+  {
+    return my->get_fee_statistics();
+  }
+
+  bts::net::network_statistics rpc_client::get_network_statistics()
+  {
+    return my->get_network_statistics();
+  }
+
   bool rpc_client::validateaddress(bts::blockchain::address address)
   {
     return my->validateaddress(address);
@@ -127,6 +127,31 @@ namespace bts { namespace rpc {
                 return fc::variant( _client->get_chain()->fetch_block( (uint32_t)params[0].as_int64() )  ); 
             });
 
+            con->add_method( "estimate_fee_rate", [=]( const fc::variants& params ) -> fc::variant 
+            {
+                check_login( capture_con );
+                FC_ASSERT( params.size() == 0 || params.size() == 1 );
+                uint32_t target_blocks = 1;
+                if( params.size() == 1 )
+                  target_blocks = (uint32_t)params[0].as_int64();
+                return fc::variant( _client->get_chain()->estimate_fee_rate( target_blocks ) ); 
+            });
+
+            con->add_method( "get_fee_statistics", [=]( const fc::variants& params ) -> fc::variant 
+            {
+                check_login( capture_con );
+                FC_ASSERT( params.size() == 0 );
+                return fc::variant( _client->get_chain()->get_fee_statistics() ); 
+            });
+
+            con->add_method( "get_network_statistics", [=]( const fc::variants& params ) -> fc::variant 
+            {
+                check_login( capture_con );
+                FC_ASSERT( params.size() == 0 );
+                FC_ASSERT( _client->get_node(), "not connected to the p2p network" );
+                return fc::variant( _client->get_node()->get_network_statistics() ); 
+            });
+
             con->add_method( "validateaddress", [=]( const fc::variants& params ) -> fc::variant 
             {
                 check_login( capture_con );
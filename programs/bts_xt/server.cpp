@@ -12,7 +12,8 @@ int main( int argc, char** argv )
    // parse command-line options
    boost::program_options::options_description option_config("Allowed options");
    option_config.add_options()("help", "display this help message")
-                              ("trustee-address", boost::program_options::value<std::string>(), "trust the given BTS address to generate blocks");
+                              ("trustee-address", boost::program_options::value<std::string>(), "trust the given BTS address to generate blocks")
+                              ("io-threads", boost::program_options::value<uint32_t>(), "threads that read and write subscriber connections (default: none, use the main thread)");
    boost::program_options::variables_map option_variables;
    try
    {
@@ -39,6 +40,8 @@ int main( int argc, char** argv )
        bts::net::chain_server cserv;
        bts::net::chain_server::config cfg;
        cfg.port = 4569;
+       if (option_variables.count("io-threads"))
+         cfg.io_threads = option_variables["io-threads"].as<uint32_t>();
        cserv.configure(cfg);
 
        if (option_variables.count("trustee-address"))
@@ -0,0 +1,257 @@
+#include <boost/program_options.hpp>
+
+#include <bts/blockchain/momentum.hpp>
+#include <bts/blockchain/difficulty.hpp>
+#include <bts/blockchain/small_hash.hpp>
+#include <fc/crypto/sha224.hpp>
+#include <fc/io/json.hpp>
+#include <fc/reflect/variant.hpp>
+#include <fc/exception/exception.hpp>
+#include <fc/time.hpp>
+
+#include <iostream>
+#include <iomanip>
+
+using namespace bts::blockchain;
+
+/**
+ *  All inputs are derived from fixed seeds so that every run measures
+ *  exactly the same work and the numbers can be compared across builds.
+ */
+struct benchmark_results
+{
+   benchmark_results()
+   :threads(1),searches(0),canceled_searches(0),nonces_hashed_per_sec(0),kernel_nonces_per_sec(0),
+    partitions_scanned_per_sec(0),collisions_per_search(0),momentum_verify_per_sec(0),
+    difficulty_sha256_per_sec(0),difficulty_sha224_per_sec(0),difficulty_uint160_per_sec(0),
+    small_hash_per_sec(0){}
+
+   std::string  kernel;
+   uint32_t     threads;
+   uint32_t     searches;
+   /** searches stopped by --search-time-limit-ms before they finished */
+   uint32_t     canceled_searches;
+   /** hashing phase of momentum_search, including bucketing */
+   double       nonces_hashed_per_sec;
+   /** the same rate for each search thread, from momentum_workspace::get_nonces_hashed */
+   std::vector<double> thread_nonces_hashed_per_sec;
+   /** the sha512 kernel alone */
+   double       kernel_nonces_per_sec;
+   double       partitions_scanned_per_sec;
+   double       collisions_per_search;
+   double       momentum_verify_per_sec;
+   double       difficulty_sha256_per_sec;
+   double       difficulty_sha224_per_sec;
+   double       difficulty_uint160_per_sec;
+   double       small_hash_per_sec;
+};
+
+FC_REFLECT( benchmark_results, (kernel)(threads)(searches)(canceled_searches)(nonces_hashed_per_sec)
+                               (thread_nonces_hashed_per_sec)(kernel_nonces_per_sec)
+                               (partitions_scanned_per_sec)(collisions_per_search)(momentum_verify_per_sec)
+                               (difficulty_sha256_per_sec)(difficulty_sha224_per_sec)(difficulty_uint160_per_sec)
+                               (small_hash_per_sec) )
+
+const char* kernel_name( momentum_kernel_type k )
+{
+   switch( k )
+   {
+      case avx512_momentum_kernel: return "avx512";
+      case avx2_momentum_kernel:   return "avx2";
+      default:                     return "scalar";
+   }
+}
+
+pow_seed_type benchmark_seed( uint32_t i )
+{
+   std::string s = "bts_benchmarks " + fc::to_string( int64_t(i) );
+   return fc::sha256::hash( s.c_str(), s.size() );
+}
+
+double per_second( uint64_t count, const fc::microseconds& elapsed )
+{
+   if( elapsed.count() <= 0 ) return 0;
+   return double(count) * 1000000 / elapsed.count();
+}
+
+/** prevents the compiler from discarding the results of the timed calls */
+volatile uint64_t benchmark_sink = 0;
+
+template<typename HashType>
+double benchmark_difficulty( uint64_t iterations )
+{
+   std::vector<HashType> hashes;
+   hashes.reserve( 1024 );
+   for( uint32_t i = 0; i < 1024; ++i )
+   {
+      std::string s = "bts_benchmarks difficulty " + fc::to_string( int64_t(i) );
+      hashes.push_back( HashType::hash( s.c_str(), s.size() ) );
+   }
+
+   uint64_t sum = 0;
+   auto start = fc::time_point::now();
+   for( uint64_t i = 0; i < iterations; ++i )
+      sum += difficulty( hashes[i & 1023] );
+   auto end = fc::time_point::now();
+
+   benchmark_sink += sum;
+   return per_second( iterations, end - start );
+}
+
+int main( int argc, char** argv )
+{
+   boost::program_options::options_description option_config("Allowed options");
+   option_config.add_options()("help", "display this help message")
+                              ("json", "print the results as JSON")
+                              ("searches", boost::program_options::value<uint32_t>()->default_value(3), "number of full momentum searches")
+                              ("threads", boost::program_options::value<uint32_t>()->default_value(1), "momentum search threads")
+                              ("search-time-limit-ms", boost::program_options::value<uint32_t>(), "cancel momentum searches that run longer than this")
+                              ("iterations", boost::program_options::value<uint64_t>()->default_value(1000000), "calls to time for momentum_verify, difficulty and small_hash")
+                              ("huge-pages", "back the momentum workspace with transparent huge pages");
+
+   boost::program_options::variables_map option_variables;
+   try
+   {
+     boost::program_options::store(boost::program_options::parse_command_line(argc, argv, option_config), option_variables);
+     boost::program_options::notify(option_variables);
+   }
+   catch (boost::program_options::error&)
+   {
+     std::cerr << "Error parsing command-line options\n\n";
+     std::cerr << option_config << "\n";
+     return 1;
+   }
+
+   if (option_variables.count("help"))
+   {
+     std::cout << option_config << "\n";
+     return 0;
+   }
+
+   try {
+      benchmark_results results;
+      uint64_t iterations = option_variables["iterations"].as<uint64_t>();
+      results.searches    = option_variables["searches"].as<uint32_t>();
+      results.kernel      = kernel_name( best_momentum_kernel() );
+
+      // raw sha512 kernel throughput over the whole nonce space
+      {
+         const uint32_t batch = 4096;
+         std::vector<fc::sha512> hashes( batch );
+         const momentum_hasher hasher( best_momentum_kernel(), benchmark_seed( 0 ) );
+         auto start = fc::time_point::now();
+         for( uint32_t n = 0; n < MAX_MOMENTUM_NONCE; n += batch * BIRTHDAYS_PER_HASH )
+         {
+            hasher.hash_blocks( n, batch, hashes.data() );
+            benchmark_sink += hashes[0]._hash[0];
+         }
+         results.kernel_nonces_per_sec = per_second( MAX_MOMENTUM_NONCE, fc::time_point::now() - start );
+      }
+
+      // full momentum searches, the workspace is allocated once like the miner does
+      std::vector< std::pair<pow_seed_type,std::pair<uint32_t,uint32_t> > > collisions;
+      {
+         auto huge_pages = option_variables.count("huge-pages") ? momentum_workspace::transparent_huge_pages
+                                                                 : momentum_workspace::no_huge_pages;
+         momentum_workspace workspace( option_variables["threads"].as<uint32_t>(), huge_pages, true );
+         results.threads = workspace.get_num_threads();
+
+         fc::microseconds time_limit = fc::microseconds::maximum();
+         if( option_variables.count("search-time-limit-ms") )
+            time_limit = fc::milliseconds( option_variables["search-time-limit-ms"].as<uint32_t>() );
+
+         uint64_t nonces = 0, partitions = 0, found = 0;
+         int64_t  hash_time = 0, scan_time = 0;
+         for( uint32_t i = 0; i < results.searches; ++i )
+         {
+            auto seed     = benchmark_seed( i );
+            auto deadline = time_limit == fc::microseconds::maximum() ? fc::time_point::maximum()
+                                                                      : fc::time_point::now() + time_limit;
+            auto pairs    = workspace.search( seed, [deadline]() { return fc::time_point::now() > deadline; } );
+            for( auto p : pairs )
+               collisions.push_back( std::make_pair( seed, p ) );
+
+            const momentum_search_stats& stats = workspace.get_last_search_stats();
+            results.canceled_searches += stats.canceled;
+            nonces     += stats.nonces;
+            partitions += stats.partitions;
+            found      += stats.collisions;
+            hash_time  += stats.hash_time_us;
+            scan_time  += stats.scan_time_us;
+         }
+         results.nonces_hashed_per_sec      = per_second( nonces, fc::microseconds( hash_time ) );
+         for( uint32_t t = 0; t < workspace.get_num_threads(); ++t )
+            results.thread_nonces_hashed_per_sec.push_back( per_second( workspace.get_nonces_hashed( t ), fc::microseconds( hash_time ) ) );
+         results.partitions_scanned_per_sec = per_second( partitions, fc::microseconds( scan_time ) );
+         if( results.searches )
+            results.collisions_per_search = double(found) / results.searches;
+      }
+
+      // momentum_verify, alternating between real collisions and misses
+      {
+         auto seed = benchmark_seed( 0 );
+         uint64_t valid = 0;
+         auto start = fc::time_point::now();
+         for( uint64_t i = 0; i < iterations; ++i )
+         {
+            if( collisions.size() && (i & 1) )
+            {
+               const auto& c = collisions[ (i >> 1) % collisions.size() ];
+               valid += momentum_verify( c.first, c.second.first, c.second.second );
+            }
+            else
+            {
+               uint32_t a = uint32_t(i * 2654435761u) & (MAX_MOMENTUM_NONCE-1);
+               valid += momentum_verify( seed, a, a ^ 1 );
+            }
+         }
+         results.momentum_verify_per_sec = per_second( iterations, fc::time_point::now() - start );
+         benchmark_sink += valid;
+      }
+
+      results.difficulty_sha256_per_sec  = benchmark_difficulty<fc::sha256>( iterations );
+      results.difficulty_sha224_per_sec  = benchmark_difficulty<fc::sha224>( iterations );
+      results.difficulty_uint160_per_sec = benchmark_difficulty<fc::uint160>( iterations );
+
+      {
+         fc::sha512 seed = fc::sha512::hash( "bts_benchmarks small_hash", 25 );
+         auto start = fc::time_point::now();
+         for( uint64_t i = 0; i < iterations; ++i )
+         {
+            seed._hash[0] = i;
+            benchmark_sink += small_hash( seed )._hash[0];
+         }
+         results.small_hash_per_sec = per_second( iterations, fc::time_point::now() - start );
+      }
+
+      if( option_variables.count("json") )
+      {
+         std::cout << fc::json::to_pretty_string( results ) << "\n";
+      }
+      else
+      {
+         std::cout << std::fixed << std::setprecision(1);
+         std::cout << "sha512 kernel:               " << results.kernel << "\n";
+         std::cout << "search threads:              " << results.threads << "\n";
+         std::cout << "nonces hashed / sec:         " << results.nonces_hashed_per_sec << "\n";
+         for( uint32_t t = 0; t < results.thread_nonces_hashed_per_sec.size(); ++t )
+            std::cout << "  thread " << std::setw(2) << t << " nonces / sec:   " << results.thread_nonces_hashed_per_sec[t] << "\n";
+         if( results.canceled_searches )
+            std::cout << "canceled searches:           " << results.canceled_searches << "\n";
+         std::cout << "kernel nonces / sec:         " << results.kernel_nonces_per_sec << "\n";
+         std::cout << "partitions scanned / sec:    " << results.partitions_scanned_per_sec << "\n";
+         std::cout << "collisions / search:         " << results.collisions_per_search << "\n";
+         std::cout << "momentum_verify / sec:       " << results.momentum_verify_per_sec << "\n";
+         std::cout << "difficulty(sha256) / sec:    " << results.difficulty_sha256_per_sec << "\n";
+         std::cout << "difficulty(sha224) / sec:    " << results.difficulty_sha224_per_sec << "\n";
+         std::cout << "difficulty(uint160) / sec:   " << results.difficulty_uint160_per_sec << "\n";
+         std::cout << "small_hash / sec:            " << results.small_hash_per_sec << "\n";
+      }
+   }
+   catch ( const fc::exception& e )
+   {
+      std::cerr << e.to_detail_string() << "\n";
+      return 1;
+   }
+   return 0;
+}
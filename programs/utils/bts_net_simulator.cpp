@@ -0,0 +1,383 @@
+#include <boost/program_options.hpp>
+
+#include <bts/net/node.hpp>
+#include <bts/client/messages.hpp>
+#include <fc/filesystem.hpp>
+#include <fc/io/json.hpp>
+#include <fc/reflect/variant.hpp>
+#include <fc/exception/exception.hpp>
+#include <fc/thread/thread.hpp>
+#include <fc/time.hpp>
+
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <unordered_map>
+
+using namespace bts::blockchain;
+using bts::client::block_message;
+
+/**
+ *  Runs a network of p2p nodes in this process, joined by in-memory links instead of
+ *  sockets, and measures how fast they move blocks.  Node 0 starts with the whole
+ *  chain and every other node syncs it, then node 0 produces new blocks and we time
+ *  how long each one takes to reach every node.
+ *
+ *  Time is real time, so latencies and block intervals should be kept short.
+ */
+struct simulation_results
+{
+   simulation_results()
+   :nodes(0),connections(0),slow_connections(0),initial_blocks(0),block_size(0),nodes_synced(0),
+    sync_seconds(0),mean_sync_seconds(0),new_blocks(0),missed_deliveries(0),
+    propagation_p50_ms(0),propagation_p90_ms(0),propagation_p99_ms(0),propagation_max_ms(0),
+    items_served(0),duplicate_items_served(0),duplicate_blocks_received(0){}
+
+   uint32_t                           nodes;
+   uint32_t                           connections;
+   uint32_t                           slow_connections;
+   bts::net::simulated_link_properties link;
+   uint32_t                           initial_blocks;
+   uint32_t                           block_size;
+   uint32_t                           nodes_synced;
+   /** until the last node had the initial chain */
+   double                             sync_seconds;
+   double                             mean_sync_seconds;
+   uint32_t                           new_blocks;
+   /** new blocks that had not reached a node when the run ended */
+   uint32_t                           missed_deliveries;
+   double                             propagation_p50_ms;
+   double                             propagation_p90_ms;
+   double                             propagation_p99_ms;
+   double                             propagation_max_ms;
+   uint64_t                           items_served;
+   /** blocks sent to a node beyond the one copy it needed */
+   uint64_t                           duplicate_items_served;
+   /** blocks handed to a node's delegate after it already had them */
+   uint64_t                           duplicate_blocks_received;
+};
+
+FC_REFLECT( simulation_results, (nodes)(connections)(slow_connections)(link)(initial_blocks)(block_size)(nodes_synced)
+                                (sync_seconds)(mean_sync_seconds)(new_blocks)(missed_deliveries)
+                                (propagation_p50_ms)(propagation_p90_ms)(propagation_p99_ms)(propagation_max_ms)
+                                (items_served)(duplicate_items_served)(duplicate_blocks_received) )
+
+/**
+ *  Stands in for the client: keeps a chain of blocks in memory and accepts any block that
+ *  extends it, without validating transactions.
+ */
+class simulated_client : public bts::net::node_delegate
+{
+   public:
+      simulated_client( const block_id_type& genesis_id )
+      :items_served(0),duplicate_blocks_received(0),connection_count(0)
+      {
+         chain.push_back( genesis_id );
+      }
+
+      bool has_block( const block_id_type& id )const { return blocks_by_id.find( id ) != blocks_by_id.end(); }
+
+      void add_block( const block_id_type& id, const bts::net::message& block_msg )
+      {
+         chain.push_back( id );
+         blocks_by_id[id] = block_msg;
+         block_ids_by_message_id[block_msg.id()] = id;
+         arrival_times[id] = fc::time_point::now();
+      }
+
+      virtual bool has_item( const bts::net::item_id& id ) override
+      {
+         return has_block( id.item_hash ) || block_ids_by_message_id.find( id.item_hash ) != block_ids_by_message_id.end();
+      }
+
+      virtual void handle_message( const bts::net::message& msg ) override
+      {
+         FC_ASSERT( msg.msg_type == bts::client::block_message_type );
+         block_message blk = msg.as<block_message>();
+         if( has_block( blk.block_id ) )
+         {
+            ++duplicate_blocks_received;
+            return;
+         }
+         FC_ASSERT( blk.block.prev == chain.back(), "block ${num} does not extend our chain", ("num", blk.block.block_num) );
+         add_block( blk.block_id, msg );
+      }
+
+      virtual std::vector<bts::net::item_hash_t> get_item_ids( const bts::net::item_id& from_id,
+                                                               uint32_t& remaining_item_count,
+                                                               uint32_t limit = 2000 ) override
+      {
+         std::vector<bts::net::item_hash_t> result;
+         auto from = std::find( chain.begin(), chain.end(), from_id.item_hash );
+         if( from == chain.end() )
+         {
+            remaining_item_count = 0;
+            return result;
+         }
+         for( auto itr = from + 1; itr != chain.end() && result.size() < limit; ++itr )
+            result.push_back( *itr );
+         remaining_item_count = uint32_t( chain.end() - (from + 1) ) - result.size();
+         return result;
+      }
+
+      virtual bts::net::message get_item( const bts::net::item_id& id ) override
+      {
+         auto msg_itr = block_ids_by_message_id.find( id.item_hash );
+         auto itr = blocks_by_id.find( msg_itr != block_ids_by_message_id.end() ? msg_itr->second : id.item_hash );
+         if( itr == blocks_by_id.end() )
+            FC_THROW_EXCEPTION( fc::key_not_found_exception, "no block with id ${id}", ("id", id.item_hash) );
+         ++items_served;
+         return itr->second;
+      }
+
+      virtual void sync_status( uint32_t item_type, uint32_t item_count ) override {}
+      virtual void connection_count_changed( uint32_t c ) override { connection_count = c; }
+
+      std::vector<block_id_type>                                  chain;
+      std::unordered_map<block_id_type, bts::net::message>        blocks_by_id;
+      std::unordered_map<bts::net::item_hash_t, block_id_type>    block_ids_by_message_id;
+      std::unordered_map<block_id_type, fc::time_point>           arrival_times;
+      uint64_t                                                    items_served;
+      uint64_t                                                    duplicate_blocks_received;
+      uint32_t                                                    connection_count;
+};
+
+/** a block of trxs_per_block distinct transactions, each about 80 bytes packed */
+bts::net::message make_block( const block_id_type& prev, uint32_t block_num, uint32_t trxs_per_block )
+{
+   trx_block blk;
+   blk.block_num = block_num;
+   blk.prev      = prev;
+   blk.timestamp = fc::time_point::now();
+   for( uint32_t i = 0; i < trxs_per_block; ++i )
+   {
+      signed_transaction trx;
+      trx.vote  = int32_t(block_num);
+      trx.stake = i;
+      fc::ecc::compact_signature sig;
+      for( uint32_t j = 0; j < sizeof(sig.data); ++j )
+         sig.data[j] = (unsigned char)((block_num * 31 + i * 7 + j) & 0xff);
+      trx.sigs.insert( sig );
+      blk.trxs.push_back( trx );
+   }
+   return bts::net::message( block_message( blk.id(), blk, fc::ecc::compact_signature() ) );
+}
+
+double percentile_ms( const std::vector<int64_t>& sorted_us, double fraction )
+{
+   if( sorted_us.empty() ) return 0;
+   size_t index = std::min( sorted_us.size() - 1, size_t(fraction * sorted_us.size()) );
+   return sorted_us[index] / 1000.0;
+}
+
+int main( int argc, char** argv )
+{
+   boost::program_options::options_description option_config("Allowed options");
+   option_config.add_options()("help", "display this help message")
+                              ("json", "print the results as JSON")
+                              ("nodes", boost::program_options::value<uint32_t>()->default_value(10), "number of nodes")
+                              ("degree", boost::program_options::value<uint32_t>()->default_value(2), "outbound connections made by each node to earlier nodes")
+                              ("seed", boost::program_options::value<uint32_t>()->default_value(1), "seed for choosing the topology")
+                              ("initial-blocks", boost::program_options::value<uint32_t>()->default_value(200), "blocks every node syncs from node 0")
+                              ("new-blocks", boost::program_options::value<uint32_t>()->default_value(10), "blocks node 0 broadcasts after sync")
+                              ("block-interval-ms", boost::program_options::value<uint32_t>()->default_value(2000), "time between new blocks")
+                              ("trxs-per-block", boost::program_options::value<uint32_t>()->default_value(100), "transactions in each block")
+                              ("latency-ms", boost::program_options::value<uint32_t>()->default_value(50), "one way latency of every link")
+                              ("bandwidth-kbps", boost::program_options::value<uint64_t>()->default_value(0), "bandwidth of every link in kilobytes per second, 0 for unlimited")
+                              ("loss", boost::program_options::value<double>()->default_value(0), "fraction of writes lost and retransmitted")
+                              ("slow-links", boost::program_options::value<double>()->default_value(0), "fraction of links that use the slow link settings instead")
+                              ("slow-latency-ms", boost::program_options::value<uint32_t>()->default_value(1000), "one way latency of slow links")
+                              ("slow-bandwidth-kbps", boost::program_options::value<uint64_t>()->default_value(16), "bandwidth of slow links in kilobytes per second")
+                              ("timeout-seconds", boost::program_options::value<uint32_t>()->default_value(300), "give up waiting for sync after this long");
+
+   boost::program_options::variables_map option_variables;
+   try
+   {
+     boost::program_options::store(boost::program_options::parse_command_line(argc, argv, option_config), option_variables);
+     boost::program_options::notify(option_variables);
+   }
+   catch (boost::program_options::error&)
+   {
+     std::cerr << "Error parsing command-line options\n\n";
+     std::cerr << option_config << "\n";
+     return 1;
+   }
+
+   if (option_variables.count("help"))
+   {
+     std::cout << option_config << "\n";
+     return 0;
+   }
+
+   try {
+      simulation_results results;
+      results.nodes                 = std::max<uint32_t>( 2, option_variables["nodes"].as<uint32_t>() );
+      results.initial_blocks        = option_variables["initial-blocks"].as<uint32_t>();
+      results.new_blocks            = option_variables["new-blocks"].as<uint32_t>();
+      results.link.latency          = fc::milliseconds( option_variables["latency-ms"].as<uint32_t>() );
+      results.link.bytes_per_second = option_variables["bandwidth-kbps"].as<uint64_t>() * 1024;
+      results.link.loss_rate        = option_variables["loss"].as<double>();
+      bts::net::simulated_link_properties slow_link = results.link;
+      slow_link.latency             = fc::milliseconds( option_variables["slow-latency-ms"].as<uint32_t>() );
+      slow_link.bytes_per_second    = option_variables["slow-bandwidth-kbps"].as<uint64_t>() * 1024;
+      double slow_link_fraction     = option_variables["slow-links"].as<double>();
+      uint32_t degree               = option_variables["degree"].as<uint32_t>();
+      uint32_t trxs_per_block       = option_variables["trxs-per-block"].as<uint32_t>();
+      fc::microseconds block_interval = fc::milliseconds( option_variables["block-interval-ms"].as<uint32_t>() );
+      fc::microseconds timeout        = fc::seconds( option_variables["timeout-seconds"].as<uint32_t>() );
+
+      // every node starts from the same genesis block, which is never sent
+      bts::net::message genesis = make_block( block_id_type(), 0, 0 );
+      block_id_type genesis_id = genesis.as<block_message>().block_id;
+
+      fc::temp_directory data_dir;
+      std::vector< std::unique_ptr<simulated_client> > clients;
+      std::vector< bts::net::node_ptr >                nodes;
+      for( uint32_t i = 0; i < results.nodes; ++i )
+      {
+         clients.emplace_back( new simulated_client( genesis_id ) );
+         nodes.push_back( std::make_shared<bts::net::node>() );
+         fc::path node_dir = data_dir.path() / fc::to_string( int64_t(i) );
+         fc::create_directories( node_dir );
+         nodes[i]->set_delegate( clients[i].get() );
+         nodes[i]->load_configuration( node_dir );
+         nodes[i]->connect_to_simulated_network( fc::ip::endpoint( fc::ip::address( 0x0a000000 + i + 1 ), 5678 ) );
+      }
+
+      for( uint32_t i = 1; i <= results.initial_blocks; ++i )
+      {
+         bts::net::message blk = make_block( clients[0]->chain.back(), i, trxs_per_block );
+         clients[0]->add_block( blk.as<block_message>().block_id, blk );
+      }
+      results.block_size = clients[0]->blocks_by_id[clients[0]->chain.back()].size;
+
+      for( uint32_t i = 0; i < results.nodes; ++i )
+         nodes[i]->sync_from( bts::net::item_id( bts::client::block_message_type, clients[i]->chain.back() ) );
+
+      // each node connects to up to `degree` earlier nodes, which keeps the graph connected
+      std::mt19937 topology_generator( option_variables["seed"].as<uint32_t>() );
+      std::uniform_real_distribution<double> link_quality( 0, 1 );
+      for( uint32_t i = 1; i < results.nodes; ++i )
+      {
+         std::vector<uint32_t> earlier_nodes;
+         for( uint32_t j = 0; j < i; ++j )
+            earlier_nodes.push_back( j );
+         std::shuffle( earlier_nodes.begin(), earlier_nodes.end(), topology_generator );
+         for( uint32_t j = 0; j < std::min<uint32_t>( degree, i ); ++j )
+         {
+            if( link_quality( topology_generator ) < slow_link_fraction )
+            {
+               nodes[i]->connect_to_simulated_node( *nodes[earlier_nodes[j]], slow_link, slow_link );
+               ++results.slow_connections;
+            }
+            else
+               nodes[i]->connect_to_simulated_node( *nodes[earlier_nodes[j]], results.link, results.link );
+            ++results.connections;
+         }
+      }
+
+      // sync: every node fetches the initial chain from node 0, directly or through its peers
+      auto sync_start = fc::time_point::now();
+      size_t synced_chain_length = clients[0]->chain.size();
+      auto all_synced = [&]() {
+         for( auto& c : clients )
+            if( c->chain.size() < synced_chain_length )
+               return false;
+         return true;
+      };
+      while( !all_synced() && fc::time_point::now() - sync_start < timeout )
+         fc::usleep( fc::milliseconds(10) );
+
+      double total_sync_seconds = 0;
+      for( uint32_t i = 1; i < results.nodes; ++i )
+      {
+         if( clients[i]->chain.size() < synced_chain_length )
+            continue;
+         ++results.nodes_synced;
+         double seconds = results.initial_blocks ?
+                          (clients[i]->arrival_times[clients[i]->chain.back()] - sync_start).count() / 1000000.0 : 0;
+         results.sync_seconds = std::max( results.sync_seconds, seconds );
+         total_sync_seconds += seconds;
+      }
+      if( results.nodes_synced )
+         results.mean_sync_seconds = total_sync_seconds / results.nodes_synced;
+
+      // propagation: node 0 broadcasts new blocks, we note when each reaches each node
+      std::vector< std::pair<block_id_type, fc::time_point> > new_blocks;
+      for( uint32_t i = 0; i < results.new_blocks; ++i )
+      {
+         bts::net::message blk = make_block( clients[0]->chain.back(), uint32_t(clients[0]->chain.size()), trxs_per_block );
+         block_id_type id = blk.as<block_message>().block_id;
+         clients[0]->add_block( id, blk );
+         new_blocks.push_back( std::make_pair( id, fc::time_point::now() ) );
+         nodes[0]->broadcast( blk );
+         fc::usleep( block_interval );
+      }
+      // give the last block as long as the others had to spread
+      synced_chain_length = clients[0]->chain.size();
+      auto drain_start = fc::time_point::now();
+      while( !all_synced() && fc::time_point::now() - drain_start < block_interval )
+         fc::usleep( fc::milliseconds(10) );
+
+      std::vector<int64_t> delays_us;
+      uint64_t deliveries = 0;
+      for( uint32_t i = 1; i < results.nodes; ++i )
+      {
+         deliveries += clients[i]->chain.size() - 1;
+         for( const auto& blk : new_blocks )
+         {
+            auto itr = clients[i]->arrival_times.find( blk.first );
+            if( itr == clients[i]->arrival_times.end() )
+               ++results.missed_deliveries;
+            else
+               delays_us.push_back( (itr->second - blk.second).count() );
+         }
+      }
+      std::sort( delays_us.begin(), delays_us.end() );
+      results.propagation_p50_ms = percentile_ms( delays_us, 0.50 );
+      results.propagation_p90_ms = percentile_ms( delays_us, 0.90 );
+      results.propagation_p99_ms = percentile_ms( delays_us, 0.99 );
+      results.propagation_max_ms = delays_us.empty() ? 0 : delays_us.back() / 1000.0;
+
+      for( auto& c : clients )
+      {
+         results.items_served              += c->items_served;
+         results.duplicate_blocks_received += c->duplicate_blocks_received;
+      }
+      if( results.items_served > deliveries )
+         results.duplicate_items_served = results.items_served - deliveries;
+
+      if( option_variables.count("json") )
+      {
+         std::cout << fc::json::to_pretty_string( results ) << "\n";
+      }
+      else
+      {
+         std::cout << std::fixed << std::setprecision(1);
+         std::cout << "nodes / connections:         " << results.nodes << " / " << results.connections << "\n";
+         std::cout << "slow connections:            " << results.slow_connections << "\n";
+         std::cout << "link latency (ms):           " << results.link.latency.count() / 1000 << "\n";
+         std::cout << "link bandwidth (bytes/sec):  " << results.link.bytes_per_second << "\n";
+         std::cout << "link loss rate:              " << results.link.loss_rate << "\n";
+         std::cout << "block size (bytes):          " << results.block_size << "\n";
+         std::cout << "nodes synced:                " << results.nodes_synced << " of " << results.nodes - 1 << "\n";
+         std::cout << "sync time, last node (s):    " << results.sync_seconds << "\n";
+         std::cout << "sync time, mean (s):         " << results.mean_sync_seconds << "\n";
+         std::cout << "propagation p50 (ms):        " << results.propagation_p50_ms << "\n";
+         std::cout << "propagation p90 (ms):        " << results.propagation_p90_ms << "\n";
+         std::cout << "propagation p99 (ms):        " << results.propagation_p99_ms << "\n";
+         std::cout << "propagation max (ms):        " << results.propagation_max_ms << "\n";
+         std::cout << "missed deliveries:           " << results.missed_deliveries << "\n";
+         std::cout << "items served:                " << results.items_served << "\n";
+         std::cout << "duplicate items served:      " << results.duplicate_items_served << "\n";
+         std::cout << "duplicate blocks received:   " << results.duplicate_blocks_received << "\n";
+      }
+   }
+   catch ( const fc::exception& e )
+   {
+      std::cerr << e.to_detail_string() << "\n";
+      return 1;
+   }
+   return 0;
+}
@@ -3,6 +3,9 @@
 #include <bts/wallet/wallet.hpp>
 #include <bts/blockchain/chain_database.hpp>
 #include <bts/blockchain/block_miner.hpp>
+#include <bts/blockchain/fee_estimator.hpp>
+#include <bts/blockchain/momentum.hpp>
+#include <bts/blockchain/difficulty.hpp>
 #include <bts/blockchain/config.hpp>
 #include <fc/filesystem.hpp>
 #include <fc/log/logger.hpp>
@@ -10,6 +13,7 @@
 #include <fc/reflect/variant.hpp>
 #include <fc/thread/thread.hpp>
 
+#include <atomic>
 #include <iostream>
 using namespace bts::wallet;
 using namespace bts::blockchain;
@@ -55,6 +59,60 @@ trx_block generate_genesis_block( const std::vector<address>& addr )
     return genesis;
 }
 
+/**
+ *  A wallet holding the genesis delegates' keys and 80 addresses, and a chain
+ *  whose genesis block pays those addresses, signed by auth.
+ */
+struct test_chain
+{
+   test_chain()
+   :auth( fc::ecc::private_key::generate() ),
+    sim_validator( std::make_shared<sim_pow_validator>( fc::time_point::now() ) )
+   {
+       wall.create( dir.path() / "wallet.dat", "password", "password", true );
+       for( uint32_t i = 0; i < 100; ++i )
+       {
+          auto name     = "delegate-"+fc::to_string( int64_t(i+1) );
+          auto key_hash = fc::sha256::hash( name.c_str(), name.size() );
+          wall.import_delegate( i+1, fc::ecc::private_key::regenerate(key_hash) );
+       }
+       for( uint32_t i = 0; i < 80; ++i )
+          addrs.push_back( wall.new_recv_address() );
+
+       db.set_trustee( auth.get_public_key() );
+       db.set_pow_validator( sim_validator );
+       db.open( dir.path() / "chain" );
+       auto genblk = generate_genesis_block( addrs );
+       genblk.sign( auth );
+       db.push_block( genblk );
+       wall.scan_chain( db );
+   }
+
+   /** pushes count blocks of trxs_per_block transfers between our own addresses */
+   void push_blocks( uint32_t count, uint32_t trxs_per_block )
+   {
+       for( uint32_t i = 0; i < count; ++i )
+       {
+          signed_transactions trxs;
+          for( uint32_t t = 0; t < trxs_per_block; ++t )
+             trxs.push_back( wall.transfer( asset( double( rand() % 1000 ) ), addrs[ rand()%addrs.size() ] ) );
+          sim_validator->skip_time( fc::seconds(60*5) );
+          auto next_block = wall.generate_next_block( db, trxs );
+          sim_validator->skip_time( fc::seconds(30) );
+          next_block.sign( auth );
+          db.push_block( next_block );
+          wall.scan_chain( db );
+       }
+   }
+
+   fc::temp_directory                 dir;
+   wallet                             wall;
+   fc::ecc::private_key               auth;
+   std::vector<address>               addrs;
+   std::shared_ptr<sim_pow_validator> sim_validator;
+   chain_database                     db;
+};
+
 /**
  *  The purpose of this test is to make sure that the network will
  *  not stall even with random transactions executing as quickly
@@ -139,6 +197,7 @@ BOOST_AUTO_TEST_CASE( blockchain_simple_chain )
           }
           db.dump_delegates();
        }
+
    }
    catch ( const fc::exception& e )
    {
@@ -149,6 +208,83 @@ BOOST_AUTO_TEST_CASE( blockchain_simple_chain )
 } // blockchain_simple_chain
 
 
+/**
+ *  fetch_block_ids() and fetch_trx_blocks() return the blocks in the requested
+ *  range, clipped to the head block, and the ids survive closing the database.
+ */
+BOOST_AUTO_TEST_CASE( chain_fetch_block_ranges )
+{
+   try {
+       test_chain chain;
+       chain.push_blocks( 30, 2 );
+       auto& db = chain.db;
+
+       auto block_ids = db.fetch_block_ids( 0, 2000 );
+       BOOST_REQUIRE_EQUAL( block_ids.size(), db.head_block_num() + 1 );
+       for( uint32_t i = 0; i < block_ids.size(); ++i )
+          BOOST_CHECK( block_ids[i] == db.fetch_block( i ).id() );
+       BOOST_CHECK( block_ids.back() == db.head_block_id() );
+       BOOST_CHECK( db.fetch_block_ids( 5, 3 ) == std::vector<block_id_type>( block_ids.begin() + 5, block_ids.begin() + 8 ) );
+
+       auto trx_blocks = db.fetch_trx_blocks( 1, 10 );
+       BOOST_REQUIRE_EQUAL( trx_blocks.size(), 10 );
+       for( uint32_t i = 0; i < trx_blocks.size(); ++i )
+       {
+          auto expected = db.fetch_trx_block( i + 1 );
+          BOOST_CHECK( trx_blocks[i].id() == expected.id() );
+          BOOST_CHECK_EQUAL( trx_blocks[i].trxs.size(), expected.trxs.size() );
+       }
+       BOOST_CHECK_EQUAL( db.fetch_trx_blocks( db.head_block_num(), 10 ).size(), 1 );
+       BOOST_CHECK( db.fetch_trx_blocks( db.head_block_num() + 1, 10 ).empty() );
+
+       db.close();
+       db.open( chain.dir.path() / "chain" );
+       BOOST_CHECK( db.fetch_block_ids( 0, 2000 ) == block_ids );
+       BOOST_CHECK( db.fetch_block_ids( db.head_block_num() + 1, 10 ).empty() );
+   }
+   catch ( const fc::exception& e )
+   {
+      elog( "${e}", ( "e", e.to_detail_string() ) );
+      throw;
+   }
+}
+
+/**
+ *  A database written before blk_num2id existed has no block id index, opening
+ *  it must rebuild the index from the block headers.
+ */
+BOOST_AUTO_TEST_CASE( chain_rebuilds_block_id_index )
+{
+   try {
+       test_chain chain;
+       chain.push_blocks( 20, 1 );
+       auto& db = chain.db;
+       auto block_ids = db.fetch_block_ids( 0, 2000 );
+       BOOST_REQUIRE_EQUAL( block_ids.size(), db.head_block_num() + 1 );
+
+       db.close();
+       fc::remove_all( chain.dir.path() / "chain" / "blk_num2id" );
+       db.open( chain.dir.path() / "chain" );
+       BOOST_CHECK( db.fetch_block_ids( 0, 2000 ) == block_ids );
+
+       // the rebuilt index was stored, so it is read back rather than rebuilt again
+       db.close();
+       db.open( chain.dir.path() / "chain" );
+       BOOST_CHECK( db.fetch_block_ids( 0, 2000 ) == block_ids );
+
+       // and blocks pushed after the rebuild extend it
+       chain.push_blocks( 1, 1 );
+       auto extended = db.fetch_block_ids( 0, 2000 );
+       BOOST_REQUIRE_EQUAL( extended.size(), block_ids.size() + 1 );
+       BOOST_CHECK( extended.back() == db.head_block_id() );
+   }
+   catch ( const fc::exception& e )
+   {
+      elog( "${e}", ( "e", e.to_detail_string() ) );
+      throw;
+   }
+}
+
 /**
  *  This test case will generate two wallets, generate
  *  a years worth of transactions from one wallet and
@@ -169,6 +305,31 @@ BOOST_AUTO_TEST_CASE( blockchain_doublespend )
 
 }
 
+/**
+ *  evaluate_transactions() must reject a transaction that spends outputs an
+ *  earlier one in the same batch already spent.
+ */
+BOOST_AUTO_TEST_CASE( chain_evaluate_transactions_doublespend )
+{
+   try {
+       test_chain chain;
+       auto trx = chain.wall.transfer( asset( 1000.0 ), chain.addrs[0] );
+
+       signed_transactions trxs;
+       trxs.push_back( trx );
+       trxs.push_back( trx );
+       auto errors = chain.db.evaluate_transactions( trxs );
+       BOOST_REQUIRE_EQUAL( errors.size(), 2 );
+       BOOST_CHECK( !errors[0] );
+       BOOST_CHECK( !!errors[1] );
+   }
+   catch ( const fc::exception& e )
+   {
+      elog( "${e}", ( "e", e.to_detail_string() ) );
+      throw;
+   }
+}
+
 /**
  *  This test case verifies that the head block can be replaced by
  *  a better block.  A better block is one that contains more votes.
@@ -177,3 +338,189 @@ BOOST_AUTO_TEST_CASE( blockchain_replace_head_block )
 {
 
 }
+
+/**
+ *  Transactions that pay a high fee are included in the next block while
+ *  those paying the minimum wait several blocks, the estimator should
+ *  require the high fee for a 1 block target and the low fee otherwise.
+ */
+BOOST_AUTO_TEST_CASE( blockchain_fee_estimator )
+{
+   fee_estimator estimator;
+   BOOST_CHECK_EQUAL( estimator.estimate_fee_rate( 1 ), 0 );
+
+   int32_t next_vote = 0;
+   for( uint32_t block_num = 1; block_num <= 20; ++block_num )
+   {
+      trx_block blk;
+      blk.block_num = block_num;
+      std::vector<int64_t> fees;
+
+      for( uint32_t i = 0; i < 5; ++i )
+      {
+         signed_transaction fast;
+         fast.vote = ++next_vote;
+         estimator.observe_transaction( fast.id(), block_num - 1 );
+         fees.push_back( fast.size() * 50 );
+         blk.trxs.push_back( fast );
+
+         signed_transaction slow;
+         slow.vote = ++next_vote;
+         estimator.observe_transaction( slow.id(), block_num > 3 ? block_num - 3 : 0 );
+         fees.push_back( slow.size() );
+         blk.trxs.push_back( slow );
+      }
+      estimator.record_block( blk, fees );
+   }
+
+   BOOST_CHECK_GE( estimator.estimate_fee_rate( 1 ), 40000 );
+   BOOST_CHECK_LE( estimator.estimate_fee_rate( 3 ), block_header::min_fee() );
+   BOOST_CHECK_EQUAL( estimator.get_statistics().blocks_sampled, 20 );
+   BOOST_CHECK_EQUAL( estimator.get_statistics().transactions_sampled, 200 );
+}
+
+/**
+ *  Signing keys recovered on another thread are cached, and the cached keys
+ *  must be the same ones recovered directly.
+ */
+BOOST_AUTO_TEST_CASE( transaction_signing_keys )
+{
+   auto k1 = fc::ecc::private_key::generate();
+   auto k2 = fc::ecc::private_key::generate();
+   signed_transaction trx;
+   trx.vote = 7;
+   trx.sign( k1 );
+   trx.sign( k2 );
+
+   fc::thread recovery_thread( "recovery" );
+   auto keys = recovery_thread.async( [&](){ return trx.get_signing_keys(); } ).wait();
+   BOOST_REQUIRE_EQUAL( keys.size(), 2 );
+
+   auto addresses = trx.get_signed_addresses();
+   BOOST_CHECK( addresses.count( address( k1.get_public_key() ) ) );
+   BOOST_CHECK( addresses.count( address( k2.get_public_key() ) ) );
+   for( const auto& key : keys )
+      BOOST_CHECK( addresses.count( address( key ) ) );
+}
+
+/**
+ *  The multi-threaded momentum search must find exactly the same
+ *  collisions as the single threaded search.
+ */
+BOOST_AUTO_TEST_CASE( momentum_search_parallel )
+{
+   auto seed = fc::sha256::hash( "momentum_search_parallel", 24 );
+   auto expected = momentum_search( seed );
+   auto found    = momentum_search( seed, 4 );
+
+   BOOST_REQUIRE_EQUAL( expected.size(), found.size() );
+   BOOST_CHECK( expected == found );
+   for( auto collision : found )
+   {
+      BOOST_CHECK( momentum_verify( seed, collision.first, collision.second ) );
+   }
+}
+
+/**
+ *  A canceled search must stop early and report that it was canceled
+ *  without disturbing the next search on the same workspace.
+ */
+BOOST_AUTO_TEST_CASE( momentum_search_cancel )
+{
+   auto seed = fc::sha256::hash( "momentum_search_cancel", 22 );
+   momentum_workspace workspace( 2, momentum_workspace::no_huge_pages, false );
+
+   std::atomic<uint32_t> checks( 0 );
+   auto canceled = workspace.search( seed, [&](){ return ++checks > 4; } );
+   BOOST_CHECK( canceled.empty() );
+   BOOST_CHECK( workspace.get_last_search_stats().canceled );
+   BOOST_CHECK( workspace.get_nonces_hashed( 0 ) < MAX_MOMENTUM_NONCE / 2 );
+
+   auto found = workspace.search( seed, [](){ return false; } );
+   BOOST_CHECK( !workspace.get_last_search_stats().canceled );
+   BOOST_CHECK( found == momentum_search( seed ) );
+}
+
+/**
+ *  Every sha512 kernel supported by this CPU must produce exactly the
+ *  hash that momentum_verify computes with fc::sha512::encoder.
+ */
+BOOST_AUTO_TEST_CASE( momentum_sha512_kernels )
+{
+   auto seed = fc::sha256::hash( "momentum_sha512_kernels", 23 );
+
+   // odd count so the SIMD kernels also finish a partial batch
+   const uint32_t count       = 1001;
+   const uint32_t first_nonce = MAX_MOMENTUM_NONCE - count * BIRTHDAYS_PER_HASH;
+
+   std::vector<fc::sha512> expected( count );
+   for( uint32_t i = 0; i < count; ++i )
+   {
+      uint32_t nonce = first_nonce + i * BIRTHDAYS_PER_HASH;
+      fc::sha512::encoder enc;
+      enc.write( (char*)&nonce, sizeof(nonce) );
+      enc.write( (char*)&seed, sizeof(seed) );
+      expected[i] = enc.result();
+   }
+
+   const momentum_kernel_type kernels[] = { scalar_momentum_kernel, avx2_momentum_kernel, avx512_momentum_kernel };
+   for( auto kernel : kernels )
+   {
+      if( !momentum_kernel_supported( kernel ) )
+      {
+         BOOST_TEST_MESSAGE( "skipping unsupported momentum kernel " << int(kernel) );
+         continue;
+      }
+      std::vector<fc::sha512> results( count );
+      momentum_hash_blocks( kernel, seed, first_nonce, count, results.data() );
+      for( uint32_t i = 0; i < count; ++i )
+      {
+         BOOST_REQUIRE( results[i] == expected[i] );
+      }
+
+      // a hasher prepared once gives the same hashes when a search reuses it across batches
+      const momentum_hasher hasher( kernel, seed );
+      std::vector<fc::sha512> reused( count );
+      hasher.hash_blocks( first_nonce, 500, reused.data() );
+      hasher.hash_blocks( first_nonce + 500 * BIRTHDAYS_PER_HASH, count - 500, reused.data() + 500 );
+      BOOST_REQUIRE( reused == expected );
+
+      // nonces whose kernel birthdays collide must pass momentum_verify
+      uint32_t a = first_nonce + 3;
+      uint32_t b = first_nonce + 5 * BIRTHDAYS_PER_HASH + 1;
+      bool same_birthday = (results[0]._hash[3] >> 14) == (results[5]._hash[1] >> 14);
+      BOOST_CHECK_EQUAL( momentum_verify( seed, a, b ), same_birthday );
+   }
+}
+
+/**
+ *  meets_target must agree with comparing difficulty() for every hash width.
+ */
+BOOST_AUTO_TEST_CASE( difficulty_meets_target )
+{
+   for( uint32_t i = 0; i < 1000; ++i )
+   {
+      std::string s = "difficulty_meets_target " + fc::to_string( int64_t(i) );
+      auto h256 = fc::sha256::hash( s.c_str(), s.size() );
+      auto h224 = fc::sha224::hash( s.c_str(), s.size() );
+      auto h160 = fc::uint160::hash( s.c_str(), s.size() );
+      // zeroing the leading bytes makes the hashes harder, so the difficulties are around
+      // 2^32 rather than the 1s and 2s random hashes give, yet still fit in an int64
+      memset( (char*)&h256, 0, 4 );
+      memset( (char*)&h224, 0, 4 );
+      memset( (char*)&h160, 0, 4 );
+
+      uint64_t d256 = difficulty( h256 );
+      uint64_t d224 = difficulty( h224 );
+      uint64_t d160 = difficulty( h160 );
+
+      BOOST_CHECK( meets_target( h256, target_from_difficulty( d256, 256 ) ) );
+      BOOST_CHECK( !meets_target( h256, target_from_difficulty( d256 + 1, 256 ) ) );
+      BOOST_CHECK( meets_target( h224, target_from_difficulty( d224, 224 ) ) );
+      BOOST_CHECK( !meets_target( h224, target_from_difficulty( d224 + 1, 224 ) ) );
+      BOOST_CHECK( meets_target( h160, target_from_difficulty( d160, 160 ) ) );
+      BOOST_CHECK( !meets_target( h160, target_from_difficulty( d160 + 1, 160 ) ) );
+   }
+   BOOST_CHECK( meets_target( fc::sha256(), target_from_difficulty( uint64_t(-1), 256 ) ) );
+   BOOST_CHECK( meets_target( fc::sha256::hash( "x", 1 ), target_from_difficulty( 0, 256 ) ) );
+}
@@ -0,0 +1,820 @@
+#define BOOST_TEST_MODULE NetTests
+#include <boost/test/unit_test.hpp>
+#include <bts/net/core_messages.hpp>
+#include <bts/net/message.hpp>
+#include <bts/net/chain_client.hpp>
+#include <bts/net/chain_connection.hpp>
+#include <bts/net/chain_messages.hpp>
+#include <bts/net/node.hpp>
+#include <bts/net/peer_inventory.hpp>
+#include <bts/client/messages.hpp>
+#include <bts/wallet/wallet.hpp>
+#include <bts/blockchain/pow_validator.hpp>
+#include <fc/filesystem.hpp>
+#include <fc/crypto/ripemd160.hpp>
+#include <fc/network/tcp_socket.hpp>
+#include <fc/string.hpp>
+#include <fc/log/logger.hpp>
+#include <fc/thread/thread.hpp>
+
+#include <algorithm>
+#include <iostream>
+#include <unordered_map>
+using namespace bts::net;
+using namespace bts::blockchain;
+
+/**
+ *  Peers from before core_protocol_version 2 must still be able to read our
+ *  hellos, and theirs, which have no capabilities, must still unpack here.
+ */
+BOOST_AUTO_TEST_CASE( hello_capabilities_are_backward_compatible )
+{
+   auto node_id  = fc::ripemd160::hash( "hello", 5 );
+   auto endpoint = fc::ip::endpoint::from_string( "127.0.0.1:4567" );
+
+   hello_message hello( "net_tests", core_protocol_version, endpoint, node_id, compressed_messages_capability );
+   message packed = pack_hello_message( hello );
+   // as<> reads the fields an older peer knows about and ignores the rest
+   hello_message as_old_peer = packed.as<hello_message>();
+   BOOST_CHECK_EQUAL( as_old_peer.user_agent, "net_tests" );
+   BOOST_CHECK( as_old_peer.node_id == node_id );
+   BOOST_CHECK_EQUAL( unpack_hello_message( packed ).capabilities, uint32_t(compressed_messages_capability) );
+
+   // an older peer packs its hello without capabilities
+   message old_hello( hello );
+   hello_message unpacked = unpack_hello_message( old_hello );
+   BOOST_CHECK_EQUAL( unpacked.capabilities, 0u );
+   BOOST_CHECK_EQUAL( unpacked.core_protocol_version, core_protocol_version );
+   BOOST_CHECK( unpacked.node_id == node_id );
+
+   hello_reply_message reply( "net_tests", core_protocol_version, endpoint, node_id, compressed_messages_capability );
+   BOOST_CHECK_EQUAL( unpack_hello_reply_message( pack_hello_reply_message( reply ) ).capabilities,
+                      uint32_t(compressed_messages_capability) );
+   BOOST_CHECK_EQUAL( unpack_hello_reply_message( message( reply ) ).capabilities, 0u );
+}
+
+namespace
+{
+   /** records what a chain_connection hands its delegate */
+   class recording_chain_delegate : public chain_connection_delegate
+   {
+      public:
+        recording_chain_delegate():subscribes(0),disconnected(false){}
+        virtual void on_connection_message( chain_connection& c, const message& m ) override
+        {
+           if( m.msg_type == trx_err_message::type )
+              errors.push_back( m.as<trx_err_message>().err );
+           else if( m.msg_type == block_message::type )
+              block_nums.push_back( m.as<block_message>().block_data.block_num );
+           else if( m.msg_type == subscribe_message::type )
+              ++subscribes;
+           else if( m.msg_type == get_block_trxs_message::type )
+              trx_requests.push_back( m.as<get_block_trxs_message>() );
+        }
+        virtual void on_connection_disconnected( chain_connection& c ) override
+        {
+           disconnected = true;
+        }
+
+        std::vector<std::string>            errors;
+        std::vector<uint32_t>               block_nums;
+        uint32_t                            subscribes;
+        std::vector<get_block_trxs_message> trx_requests;
+        bool                                disconnected;
+   };
+
+   template<typename Predicate>
+   bool wait_until( Predicate done, fc::microseconds timeout = fc::seconds(10) )
+   {
+      fc::time_point give_up = fc::time_point::now() + timeout;
+      while( !done() && fc::time_point::now() < give_up )
+         fc::usleep( fc::milliseconds(10) );
+      return done();
+   }
+}
+
+/**
+ *  Messages sent from the owner thread of a connection with an I/O thread are batched over
+ *  to it, they must still arrive in order, and destroying the connection while some are
+ *  still queued must neither hang nor leave the remote connected.
+ */
+BOOST_AUTO_TEST_CASE( chain_connection_io_thread_teardown )
+{
+   fc::tcp_server server;
+   server.listen( 0 ); // any free port, so concurrent test runs don't collide
+   const uint16_t port = server.get_port();
+
+   fc::thread io_thread( "chain io" );
+   recording_chain_delegate server_delegate;
+   recording_chain_delegate client_delegate;
+
+   stcp_socket_ptr server_socket = std::make_shared<stcp_socket>();
+   fc::future<void> accepted = fc::async( [&]()
+   {
+      server.accept( server_socket->get_socket() );
+      io_thread.async( [&](){ server_socket->accept(); } ).wait();
+   });
+
+   auto client = std::make_shared<chain_connection>( &client_delegate );
+   client->connect( fc::ip::endpoint( fc::ip::address( "127.0.0.1" ), port ) );
+   accepted.wait();
+   auto server_connection = std::make_shared<chain_connection>( server_socket, &server_delegate, &io_thread );
+
+   const uint32_t message_count = 500;
+   for( uint32_t i = 0; i < message_count; ++i )
+   {
+      trx_err_message err;
+      err.err = fc::to_string( int64_t(i) );
+      server_connection->send( message( err ) );
+   }
+   BOOST_REQUIRE( wait_until( [&](){ return client_delegate.errors.size() == message_count; } ) );
+   for( uint32_t i = 0; i < message_count; ++i )
+      BOOST_CHECK_EQUAL( client_delegate.errors[i], fc::to_string( int64_t(i) ) );
+
+   // tear down with messages still on their way to the I/O thread
+   for( uint32_t i = 0; i < message_count; ++i )
+      server_connection->send( message( trx_err_message() ) );
+   server_connection.reset();
+
+   BOOST_CHECK( wait_until( [&](){ return client_delegate.disconnected; } ) );
+   BOOST_CHECK( !server_delegate.disconnected );
+   client.reset();
+   server.close();
+}
+
+namespace
+{
+   /** keeps a chain of blocks in memory and accepts any block that extends it */
+   class test_node_client : public node_delegate
+   {
+      public:
+        test_node_client( const block_id_type& genesis_id )
+        :items_served(0),out_of_order_blocks(0),duplicate_blocks(0)
+        {
+           chain.push_back( genesis_id );
+        }
+
+        void add_block( const block_id_type& id, const message& block_msg )
+        {
+           chain.push_back( id );
+           blocks_by_id[id] = block_msg;
+           block_ids_by_message_id[block_msg.id()] = id;
+        }
+
+        virtual bool has_item( const item_id& id ) override
+        {
+           return blocks_by_id.find( id.item_hash ) != blocks_by_id.end() ||
+                  block_ids_by_message_id.find( id.item_hash ) != block_ids_by_message_id.end();
+        }
+
+        virtual void handle_message( const message& msg ) override
+        {
+           bts::client::block_message blk = msg.as<bts::client::block_message>();
+           if( blocks_by_id.find( blk.block_id ) != blocks_by_id.end() )
+           {
+              ++duplicate_blocks;
+              return;
+           }
+           if( blk.block.prev != chain.back() )
+           {
+              ++out_of_order_blocks;
+              FC_THROW( "block ${num} does not extend our chain", ("num", blk.block.block_num) );
+           }
+           add_block( blk.block_id, msg );
+        }
+
+        virtual std::vector<item_hash_t> get_item_ids( const item_id& from_id, uint32_t& remaining_item_count,
+                                                       uint32_t limit = 2000 ) override
+        {
+           std::vector<item_hash_t> result;
+           auto from = std::find( chain.begin(), chain.end(), from_id.item_hash );
+           if( from == chain.end() )
+           {
+              remaining_item_count = 0;
+              return result;
+           }
+           for( auto itr = from + 1; itr != chain.end() && result.size() < limit; ++itr )
+              result.push_back( *itr );
+           remaining_item_count = uint32_t( chain.end() - (from + 1) ) - result.size();
+           return result;
+        }
+
+        virtual message get_item( const item_id& id ) override
+        {
+           auto msg_itr = block_ids_by_message_id.find( id.item_hash );
+           auto itr = blocks_by_id.find( msg_itr != block_ids_by_message_id.end() ? msg_itr->second : id.item_hash );
+           if( itr == blocks_by_id.end() )
+              FC_THROW_EXCEPTION( fc::key_not_found_exception, "no block with id ${id}", ("id", id.item_hash) );
+           ++items_served;
+           return itr->second;
+        }
+
+        virtual void sync_status( uint32_t item_type, uint32_t item_count ) override {}
+        virtual void connection_count_changed( uint32_t c ) override {}
+
+        std::vector<block_id_type>                      chain;
+        std::unordered_map<block_id_type, message>      blocks_by_id;
+        std::unordered_map<item_hash_t, block_id_type>  block_ids_by_message_id;
+        uint64_t                                        items_served;
+        uint64_t                                        out_of_order_blocks;
+        uint64_t                                        duplicate_blocks;
+   };
+
+   message make_block( const block_id_type& prev, uint32_t block_num, uint32_t trxs_per_block )
+   {
+      trx_block blk;
+      blk.block_num = block_num;
+      blk.prev      = prev;
+      blk.timestamp = fc::time_point::now();
+      for( uint32_t i = 0; i < trxs_per_block; ++i )
+      {
+         signed_transaction trx;
+         trx.vote  = int32_t(block_num);
+         trx.stake = i;
+         blk.trxs.push_back( trx );
+      }
+      return message( bts::client::block_message( blk.id(), blk, fc::ecc::compact_signature() ) );
+   }
+
+   /**
+    *  Nodes joined by in-memory links, each with a test_node_client.  Every node starts from the
+    *  same genesis block, and node 0 can be given a chain for the others to sync.
+    */
+   struct simulated_network
+   {
+      simulated_network( uint32_t node_count )
+      {
+         genesis_id = make_block( block_id_type(), 0, 0 ).as<bts::client::block_message>().block_id;
+         for( uint32_t i = 0; i < node_count; ++i )
+         {
+            clients.emplace_back( new test_node_client( genesis_id ) );
+            nodes.push_back( std::make_shared<node>() );
+            fc::path node_dir = data_dir.path() / fc::to_string( int64_t(i) );
+            fc::create_directories( node_dir );
+            nodes[i]->set_delegate( clients[i].get() );
+            nodes[i]->load_configuration( node_dir );
+            nodes[i]->connect_to_simulated_network( fc::ip::endpoint( fc::ip::address( 0x0a000000 + i + 1 ), 5678 ) );
+         }
+      }
+
+      ~simulated_network()
+      {
+         nodes.clear();
+      }
+
+      /** gives each of the given nodes the same chain of block_count blocks */
+      void make_chain( const std::vector<uint32_t>& holders, uint32_t block_count, uint32_t trxs_per_block )
+      {
+         for( uint32_t i = 1; i <= block_count; ++i )
+         {
+            message blk = make_block( clients[holders[0]]->chain.back(), i, trxs_per_block );
+            for( uint32_t holder : holders )
+               clients[holder]->add_block( blk.as<bts::client::block_message>().block_id, blk );
+         }
+      }
+
+      void start_sync()
+      {
+         for( uint32_t i = 0; i < nodes.size(); ++i )
+            nodes[i]->sync_from( item_id( bts::client::block_message_type, clients[i]->chain.back() ) );
+      }
+
+      void connect( uint32_t from, uint32_t to, fc::microseconds latency )
+      {
+         simulated_link_properties link;
+         link.latency = latency;
+         nodes[from]->connect_to_simulated_node( *nodes[to], link, link );
+      }
+
+      bool synced( uint32_t i )const { return clients[i]->chain.size() >= clients[0]->chain.size(); }
+
+      fc::temp_directory                              data_dir;
+      block_id_type                                   genesis_id;
+      std::vector< std::unique_ptr<test_node_client> > clients;
+      std::vector< node_ptr >                         nodes; ///< destroyed before the clients they call
+   };
+}
+
+/**
+ *  Over a link with a 100ms round trip, fetching one sync block per round trip would take
+ *  20 seconds for 200 blocks.  The adaptive window keeps several requests in flight.
+ */
+BOOST_AUTO_TEST_CASE( node_sync_window_keeps_several_requests_in_flight )
+{
+   simulated_network net( 2 );
+   net.make_chain( {0}, 200, 10 );
+   net.start_sync();
+   net.connect( 1, 0, fc::milliseconds(50) );
+
+   uint32_t most_requests_in_flight = 0;
+   BOOST_REQUIRE( wait_until( [&](){
+      most_requests_in_flight = std::max( most_requests_in_flight, net.nodes[1]->get_network_statistics().active_sync_requests );
+      return net.synced( 1 );
+   }, fc::seconds(30) ) );
+
+   BOOST_CHECK( net.clients[1]->chain == net.clients[0]->chain );
+   // the window starts at BTS_NET_INITIAL_SYNC_REQUEST_WINDOW (2) and never grows past
+   // BTS_NET_MAX_SYNC_REQUEST_WINDOW (64), and with one peer every request in flight is in its window
+   BOOST_CHECK_GT( most_requests_in_flight, 2u );
+   BOOST_CHECK_LE( most_requests_in_flight, 64u );
+}
+
+/**
+ *  Syncing from a fast and a slow peer, blocks from the fast peer arrive ahead of earlier
+ *  blocks still on their way from the slow one.  They wait in the backlog and must reach the
+ *  client in chain order once the gap is filled.
+ */
+BOOST_AUTO_TEST_CASE( node_sync_backlog_drains_in_order )
+{
+   simulated_network net( 3 );
+   net.make_chain( {0, 1}, 300, 10 );
+   net.start_sync();
+   net.connect( 2, 0, fc::milliseconds(10) );
+   net.connect( 2, 1, fc::milliseconds(150) );
+
+   uint32_t largest_backlog = 0;
+   BOOST_REQUIRE( wait_until( [&](){
+      largest_backlog = std::max( largest_backlog, net.nodes[2]->get_network_statistics().sync_backlog );
+      return net.synced( 2 );
+   }, fc::seconds(30) ) );
+
+   BOOST_CHECK( net.clients[2]->chain == net.clients[0]->chain );
+   BOOST_CHECK_GT( largest_backlog, 0u );
+   BOOST_CHECK_EQUAL( net.clients[2]->out_of_order_blocks, 0u );
+   BOOST_CHECK_EQUAL( net.clients[2]->duplicate_blocks, 0u );
+   BOOST_CHECK_EQUAL( net.nodes[2]->get_network_statistics().sync_backlog, 0u );
+}
+
+/**
+ *  A peer's inventory keeps two generations: an item survives one rotation, is forgotten
+ *  after the second unless it was set again, and setting flags on it again keeps the old ones.
+ */
+BOOST_AUTO_TEST_CASE( peer_inventory_rotates_generations )
+{
+   auto make_id = []( uint32_t i ) {
+      return item_id( bts::client::block_message_type, fc::ripemd160::hash( (const char*)&i, sizeof(i) ) );
+   };
+
+   peer_inventory inventory( 10, fc::seconds(3600) );
+   inventory.set( make_id(0), peer_inventory::advertised_to_us );
+   for( uint32_t i = 1; i < 10; ++i )
+      inventory.set( make_id(i), peer_inventory::advertised_to_peer );
+   BOOST_CHECK_EQUAL( inventory.size(), 10u );
+
+   // the 11th item rotates the full generation into the previous one
+   inventory.set( make_id(10), peer_inventory::advertised_to_peer );
+   BOOST_CHECK_EQUAL( inventory.size(), 11u );
+   BOOST_CHECK_EQUAL( inventory.get( make_id(0) ), uint8_t(peer_inventory::advertised_to_us) );
+
+   // refreshing an item from the previous generation merges its flags into the current one
+   inventory.set( make_id(0), peer_inventory::advertised_to_peer );
+   BOOST_CHECK_EQUAL( inventory.get( make_id(0) ), uint8_t(peer_inventory::advertised_to_us | peer_inventory::advertised_to_peer) );
+   inventory.clear( make_id(0), peer_inventory::advertised_to_us );
+   BOOST_CHECK_EQUAL( inventory.get( make_id(0) ), uint8_t(peer_inventory::advertised_to_peer) );
+
+   // filling the current generation again drops everything that was not refreshed
+   for( uint32_t i = 11; i < 20; ++i )
+      inventory.set( make_id(i), peer_inventory::advertised_to_peer );
+   inventory.set( make_id(20), peer_inventory::advertised_to_peer );
+   BOOST_CHECK_EQUAL( inventory.get( make_id(1) ), 0 );
+   BOOST_CHECK_EQUAL( inventory.get( make_id(9) ), 0 );
+   BOOST_CHECK_NE( inventory.get( make_id(0) ), 0 );
+   BOOST_CHECK_NE( inventory.get( make_id(10) ), 0 );
+   BOOST_CHECK_LE( inventory.size(), 20u );
+
+   // a generation also rotates once it is older than the interval
+   peer_inventory short_lived( 10000, fc::milliseconds(50) );
+   short_lived.set( make_id(0), peer_inventory::advertised_to_us );
+   fc::usleep( fc::milliseconds(60) );
+   short_lived.set( make_id(1), peer_inventory::advertised_to_us );
+   BOOST_CHECK_NE( short_lived.get( make_id(0) ), 0 );
+   fc::usleep( fc::milliseconds(60) );
+   short_lived.set( make_id(2), peer_inventory::advertised_to_us );
+   BOOST_CHECK_EQUAL( short_lived.get( make_id(0) ), 0 );
+   BOOST_CHECK_NE( short_lived.get( make_id(1) ), 0 );
+}
+
+namespace
+{
+   /** records the messages a message_oriented_connection delivers, by the sequence number in them */
+   class recording_connection_delegate : public message_oriented_connection_delegate
+   {
+      public:
+        recording_connection_delegate()
+        :batches_sent(0),closed(false),owner_thread(&fc::thread::current()),called_on_other_thread(false){}
+
+        virtual void on_message( message_oriented_connection* c, const message& m ) override
+        {
+           called_on_other_thread |= !owner_thread->is_current();
+           uint32_t sequence = 0;
+           memcpy( &sequence, m.payload(), sizeof(sequence) );
+           received.push_back( std::make_pair( m.msg_type, sequence ) );
+        }
+        virtual void on_connection_closed( message_oriented_connection* c ) override { closed = true; }
+        virtual void on_queued_messages_sent( message_oriented_connection* c ) override { ++batches_sent; }
+
+        std::vector< std::pair<uint32_t, uint32_t> > received; ///< message type and sequence number
+        uint32_t                                     batches_sent;
+        bool                                         closed;
+        fc::thread*                                  owner_thread;
+        bool                                         called_on_other_thread;
+   };
+
+   /** a message of the given size whose first four bytes are the sequence number */
+   message make_test_message( uint32_t msg_type, uint32_t sequence, size_t size )
+   {
+      message m;
+      m.msg_type = msg_type;
+      m.data.resize( std::max( size, sizeof(sequence) ) );
+      memcpy( m.data.data(), &sequence, sizeof(sequence) );
+      m.size = m.data.size();
+      return m;
+   }
+}
+
+/**
+ *  Messages queued back to back go out in a few coalesced writes rather than one write per
+ *  message, arrive in the order they were sent, and a message queued right before the
+ *  connection is closed still reaches the peer.
+ */
+BOOST_AUTO_TEST_CASE( send_queue_coalesces_writes )
+{
+   recording_connection_delegate sender_delegate;
+   recording_connection_delegate receiver_delegate;
+   message_oriented_connection sender( &sender_delegate );
+   message_oriented_connection receiver( &receiver_delegate );
+   simulated_link_properties link;
+   link.latency = fc::milliseconds(5);
+   message_oriented_connection::connect_simulated( sender, receiver, link, link );
+
+   const uint32_t message_count = 1000;
+   for( uint32_t i = 0; i < message_count; ++i )
+      sender.send_message( make_test_message( 1000, i, 20 + i % 200 ) );
+   BOOST_CHECK_GT( sender.get_queued_bytes(), 0u );
+
+   BOOST_REQUIRE( wait_until( [&](){ return receiver_delegate.received.size() == message_count; } ) );
+   for( uint32_t i = 0; i < message_count; ++i )
+      BOOST_CHECK_EQUAL( receiver_delegate.received[i].second, i );
+   BOOST_CHECK_EQUAL( sender.get_queued_bytes(), 0u );
+   BOOST_CHECK_GT( sender_delegate.batches_sent, 0u );
+   BOOST_CHECK_LT( sender_delegate.batches_sent, message_count / 10 );
+
+   sender.send_message( make_test_message( 1001, message_count, 20 ) );
+   sender.close_connection();
+   BOOST_REQUIRE( wait_until( [&](){ return receiver_delegate.closed; } ) );
+   BOOST_REQUIRE_EQUAL( receiver_delegate.received.size(), message_count + 1 );
+   BOOST_CHECK_EQUAL( receiver_delegate.received.back().first, 1001u );
+}
+
+/**
+ *  On a slow link, a new block queued behind a long run of sync blocks waits for at most
+ *  the batch being written, and closing with data still queued gives up after the close
+ *  timeout instead of waiting for the queue to drain.
+ */
+BOOST_AUTO_TEST_CASE( send_priority_lanes_and_close_timeout )
+{
+   recording_connection_delegate sender_delegate;
+   recording_connection_delegate receiver_delegate;
+   message_oriented_connection sender( &sender_delegate );
+   message_oriented_connection receiver( &receiver_delegate );
+   simulated_link_properties link;
+   link.latency = fc::milliseconds(5);
+   link.bytes_per_second = 100 * 1024;
+   message_oriented_connection::connect_simulated( sender, receiver, link, link );
+
+   const uint32_t sync_message_count = 60;
+   const uint32_t new_block_type = 1002;
+   for( uint32_t i = 0; i < sync_message_count; ++i )
+      sender.send_message( make_test_message( 1000, i, 8 * 1024 ), sync_send_priority );
+   // let the first batch start on its way before the block arrives
+   fc::usleep( fc::milliseconds(50) );
+   sender.send_message( make_test_message( new_block_type, 0, 8 * 1024 ), new_block_send_priority );
+
+   auto new_block_position = [&]() {
+      for( uint32_t i = 0; i < receiver_delegate.received.size(); ++i )
+         if( receiver_delegate.received[i].first == new_block_type )
+            return i;
+      return uint32_t(-1);
+   };
+   BOOST_REQUIRE( wait_until( [&](){ return new_block_position() != uint32_t(-1); } ) );
+   // one 64KB batch of sync blocks is 7 of them
+   BOOST_CHECK_LT( new_block_position(), 8u );
+   for( uint32_t i = 0; i < receiver_delegate.received.size(); ++i )
+      if( i != new_block_position() )
+         BOOST_CHECK_EQUAL( receiver_delegate.received[i].second, i < new_block_position() ? i : i - 1 );
+
+   // several seconds of sync blocks are still queued
+   BOOST_REQUIRE_GT( sender.get_queued_bytes(), 100u * 1024 );
+   auto close_start = fc::time_point::now();
+   sender.close_connection();
+   auto close_time = fc::time_point::now() - close_start;
+   BOOST_CHECK_GE( close_time.count(), fc::milliseconds( BTS_NET_SEND_QUEUE_CLOSE_TIMEOUT_MS / 2 ).count() );
+   BOOST_CHECK_LT( close_time.count(), fc::milliseconds( BTS_NET_SEND_QUEUE_CLOSE_TIMEOUT_MS * 2 ).count() );
+   BOOST_CHECK( wait_until( [&](){ return receiver_delegate.closed; } ) );
+   BOOST_CHECK_LT( receiver_delegate.received.size(), sync_message_count + 1 );
+}
+
+/**
+ *  Syncing from a fast peer and one forty times slower, the slow peer is held to a single
+ *  probe request once both have been measured, so nearly every block comes from the fast one.
+ */
+BOOST_AUTO_TEST_CASE( node_sync_prefers_fast_peers )
+{
+   simulated_network net( 3 );
+   net.make_chain( {0, 1}, 300, 10 );
+   net.start_sync();
+   net.connect( 2, 0, fc::milliseconds(10) );
+   net.connect( 2, 1, fc::milliseconds(400) );
+
+   BOOST_REQUIRE( wait_until( [&](){ return net.synced( 2 ); }, fc::seconds(30) ) );
+   BOOST_CHECK( net.clients[2]->chain == net.clients[0]->chain );
+   BOOST_CHECK_GT( net.clients[0]->items_served, 4 * net.clients[1]->items_served );
+}
+
+/**
+ *  With I/O threads on both ends of a real socket, messages are still delivered on the
+ *  thread that owns each connection and in the order they were sent, and a connection can
+ *  be destroyed with messages still queued on its I/O thread.
+ */
+BOOST_AUTO_TEST_CASE( message_connection_io_threads )
+{
+   fc::tcp_server server;
+   server.listen( 0 ); // any free port, so concurrent test runs don't collide
+   const uint16_t port = server.get_port();
+
+   fc::thread server_io_thread( "server io" );
+   fc::thread client_io_thread( "client io" );
+   recording_connection_delegate server_delegate;
+   recording_connection_delegate client_delegate;
+   std::unique_ptr<message_oriented_connection> server_connection( new message_oriented_connection( &server_delegate, &server_io_thread ) );
+   std::unique_ptr<message_oriented_connection> client_connection( new message_oriented_connection( &client_delegate, &client_io_thread ) );
+
+   fc::future<void> accepted = fc::async( [&]()
+   {
+      server.accept( server_connection->get_socket() );
+      server_connection->accept();
+   });
+   client_connection->connect_to( fc::ip::endpoint( fc::ip::address( "127.0.0.1" ), port ) );
+   accepted.wait();
+
+   const uint32_t message_count = 2000;
+   for( uint32_t i = 0; i < message_count; ++i )
+   {
+      client_connection->send_message( make_test_message( 1000, i, 20 + i % 500 ) );
+      server_connection->send_message( make_test_message( 1000, i, 20 + i % 500 ) );
+   }
+   BOOST_REQUIRE( wait_until( [&](){ return server_delegate.received.size() == message_count &&
+                                            client_delegate.received.size() == message_count; } ) );
+   for( uint32_t i = 0; i < message_count; ++i )
+   {
+      BOOST_CHECK_EQUAL( server_delegate.received[i].second, i );
+      BOOST_CHECK_EQUAL( client_delegate.received[i].second, i );
+   }
+   BOOST_CHECK( !server_delegate.called_on_other_thread );
+   BOOST_CHECK( !client_delegate.called_on_other_thread );
+
+   // tear the server end down while it still has messages on their way to its I/O thread
+   for( uint32_t i = 0; i < message_count; ++i )
+      server_connection->send_message( make_test_message( 1001, i, 1000 ) );
+   server_connection.reset();
+   BOOST_CHECK( wait_until( [&](){ return client_delegate.closed; } ) );
+   BOOST_CHECK( !server_delegate.closed );
+   client_connection.reset();
+   server.close();
+}
+
+namespace
+{
+   /** a genesis block that registers the 100 test delegates and gives each of them the votes of one address */
+   trx_block make_genesis_block( const std::vector<address>& addrs )
+   {
+      trx_block genesis;
+      genesis.version      = 0;
+      genesis.block_num    = 0;
+      genesis.timestamp    = fc::time_point::now();
+      genesis.next_fee     = block_header::min_fee();
+      genesis.total_shares = 0;
+
+      signed_transaction dtrx;
+      dtrx.vote = 0;
+      for( uint32_t i = 0; i < 100; ++i )
+      {
+         auto name     = "delegate-"+fc::to_string( int64_t(i+1) );
+         auto key_hash = fc::sha256::hash( name.c_str(), name.size() );
+         auto key      = fc::ecc::private_key::regenerate(key_hash);
+         dtrx.outputs.push_back( trx_output( claim_name_output( name, std::string(), i+1, key.get_public_key() ), asset() ) );
+      }
+      genesis.trxs.push_back( dtrx );
+
+      for( uint32_t i = 0; i < 100; ++i )
+      {
+         signed_transaction trx;
+         trx.vote = i + 1;
+         trx.outputs.push_back( trx_output( claim_by_signature_output( addrs[i] ), asset( uint64_t(1000000) ) ) );
+         genesis.total_shares += 1000000;
+         genesis.trxs.push_back( trx );
+      }
+      genesis.trx_mroot = genesis.calculate_merkle_root( signed_transactions() );
+      return genesis;
+   }
+}
+
+/**
+ *  A subscriber that grants sync credit gets exactly as many blocks as it granted, in order,
+ *  and the sync loop picks up where it stopped when more credit arrives.
+ */
+BOOST_AUTO_TEST_CASE( chain_sync_credit_exhaustion_and_refill )
+{
+   fc::temp_directory dir;
+   bts::wallet::wallet wall;
+   wall.create( dir.path() / "wallet.dat", "password", "password", true );
+   std::vector<address> addrs;
+   for( uint32_t i = 0; i < 100; ++i )
+      addrs.push_back( wall.new_recv_address() );
+
+   fc::ecc::private_key trustee = fc::ecc::private_key::generate();
+   chain_database db;
+   db.set_trustee( trustee.get_public_key() );
+   auto sim_validator = std::make_shared<sim_pow_validator>( fc::time_point::now() );
+   db.set_pow_validator( sim_validator );
+   db.open( dir.path() / "chain" );
+   auto genesis = make_genesis_block( addrs );
+   genesis.sign( trustee );
+   db.push_block( genesis );
+
+   const uint32_t block_count = 20;
+   for( uint32_t i = 0; i < block_count; ++i )
+   {
+      sim_validator->skip_time( fc::seconds(60*5) );
+      auto next_block = wall.generate_next_block( db, signed_transactions() );
+      sim_validator->skip_time( fc::seconds(30) );
+      next_block.sign( trustee );
+      db.push_block( next_block );
+   }
+   BOOST_REQUIRE_EQUAL( db.head_block_num(), block_count );
+
+   fc::tcp_server server;
+   server.listen( 0 ); // any free port, so concurrent test runs don't collide
+   const uint16_t port = server.get_port();
+   recording_chain_delegate server_delegate;
+   recording_chain_delegate client_delegate;
+   stcp_socket_ptr server_socket = std::make_shared<stcp_socket>();
+   fc::future<void> accepted = fc::async( [&]()
+   {
+      server.accept( server_socket->get_socket() );
+      server_socket->accept();
+   });
+   auto client = std::make_shared<chain_connection>( &client_delegate );
+   client->connect( fc::ip::endpoint( fc::ip::address( "127.0.0.1" ), port ) );
+   accepted.wait();
+   auto server_connection = std::make_shared<chain_connection>( server_socket, &server_delegate );
+
+   server_connection->set_database( &db );
+   server_connection->set_remote_version( BTS_NET_CHAIN_SYNC_CREDIT_VERSION );
+   server_connection->set_last_block_id( genesis.id() );
+   server_connection->add_sync_credit( 5 );
+   server_connection->exec_sync_loop();
+
+   auto received_exactly = [&]( uint32_t count ) {
+      if( !wait_until( [&](){ return client_delegate.block_nums.size() >= count; } ) )
+         return false;
+      // the sync loop must stop once the credit is spent
+      fc::usleep( fc::milliseconds(300) );
+      return client_delegate.block_nums.size() == count;
+   };
+   BOOST_CHECK( received_exactly( 5 ) );
+   server_connection->add_sync_credit( 7 );
+   BOOST_CHECK( received_exactly( 12 ) );
+   server_connection->add_sync_credit( 100 );
+   BOOST_CHECK( received_exactly( block_count ) );
+
+   for( uint32_t i = 0; i < client_delegate.block_nums.size(); ++i )
+      BOOST_CHECK_EQUAL( client_delegate.block_nums[i], i + 1 );
+
+   server_connection.reset();
+   client.reset();
+   server.close();
+}
+
+namespace
+{
+   class recording_chain_client_delegate : public chain_client_delegate
+   {
+      public:
+        virtual void on_new_block( const trx_block& blk ) override
+        {
+           blocks.push_back( blk );
+        }
+
+        std::vector<trx_block> blocks;
+   };
+
+   /** a block of trx_count trxs that each pay a fresh address, nothing here validates them */
+   trx_block make_unvalidated_block( uint32_t block_num, const block_id_type& prev, uint32_t trx_count )
+   {
+      trx_block blk;
+      blk.block_num = block_num;
+      blk.prev      = prev;
+      blk.timestamp = fc::time_point::now();
+      blk.next_fee  = block_header::min_fee();
+      for( uint32_t i = 0; i < trx_count; ++i )
+      {
+         signed_transaction trx;
+         trx.vote = i + 1;
+         auto owner = address( fc::ecc::private_key::generate().get_public_key() );
+         trx.outputs.push_back( trx_output( claim_by_signature_output( owner ), asset( uint64_t(1000) ) ) );
+         blk.trxs.push_back( trx );
+      }
+      blk.trx_mroot = blk.calculate_merkle_root( signed_transactions() );
+      return blk;
+   }
+
+   block_trxs_message make_block_trxs( const trx_block& blk, const std::vector<uint32_t>& indexes )
+   {
+      block_trxs_message reply;
+      reply.block_id = blk.id();
+      for( auto idx : indexes )
+         reply.trxs.push_back( blk.trxs[idx] );
+      return reply;
+   }
+
+   std::vector<transaction_id_type> trx_ids( const trx_block& blk )
+   {
+      std::vector<transaction_id_type> ids;
+      for( const auto& trx : blk.trxs )
+         ids.push_back( trx.id() );
+      return ids;
+   }
+}
+
+/**
+ *  A chain_client rebuilds compact blocks from the trxs it was relayed, fetches the rest
+ *  with get_block_trxs_message, and resubscribes when the block_trxs_message it gets back
+ *  does not match what it asked for.  The server end is driven by hand so it can send
+ *  the bad reply.
+ */
+BOOST_AUTO_TEST_CASE( chain_client_compact_blocks )
+{
+   fc::temp_directory dir;
+   auto client_chain = std::make_shared<chain_database>();
+   client_chain->open( dir.path() / "client_chain" );
+
+   fc::tcp_server server;
+   server.listen( 0 );
+   const uint16_t port = server.get_port();
+   recording_chain_delegate        server_delegate;
+   recording_chain_client_delegate client_delegate;
+   stcp_socket_ptr server_socket = std::make_shared<stcp_socket>();
+   fc::future<void> accepted = fc::async( [&]()
+   {
+      server.accept( server_socket->get_socket() );
+      server_socket->accept();
+   });
+
+   auto client = std::make_shared<chain_client>();
+   client->set_delegate( &client_delegate );
+   client->set_chain( client_chain );
+   client->add_node( "127.0.0.1:" + fc::to_string( int64_t(port) ) );
+   accepted.wait();
+   auto server_connection = std::make_shared<chain_connection>( server_socket, &server_delegate );
+   BOOST_REQUIRE( wait_until( [&](){ return server_delegate.subscribes == 1; } ) );
+
+   // the client was relayed trxs 0 and 2, so it must fetch 1 and 3
+   auto block1 = make_unvalidated_block( 1, block_id_type(), 4 );
+   server_connection->send( message( trx_message( block1.trxs[0] ) ) );
+   server_connection->send( message( trx_message( block1.trxs[2] ) ) );
+   server_connection->send( message( compact_block_message( digest_block( block1, block1.trxs, signed_transactions() ) ) ) );
+   BOOST_REQUIRE( wait_until( [&](){ return server_delegate.trx_requests.size() == 1; } ) );
+   BOOST_CHECK( server_delegate.trx_requests[0].block_id == block1.id() );
+   BOOST_CHECK( server_delegate.trx_requests[0].trx_indexes == std::vector<uint32_t>( { 1, 3 } ) );
+
+   server_connection->send( message( make_block_trxs( block1, server_delegate.trx_requests[0].trx_indexes ) ) );
+   BOOST_REQUIRE( wait_until( [&](){ return client_delegate.blocks.size() == 1; } ) );
+   BOOST_CHECK( client_delegate.blocks[0].id() == block1.id() );
+   BOOST_CHECK( trx_ids( client_delegate.blocks[0] ) == trx_ids( block1 ) );
+
+   // none of these were relayed, and the reply has them out of order
+   auto block2 = make_unvalidated_block( 2, block1.id(), 3 );
+   auto compact2 = message( compact_block_message( digest_block( block2, block2.trxs, signed_transactions() ) ) );
+   server_connection->send( compact2 );
+   BOOST_REQUIRE( wait_until( [&](){ return server_delegate.trx_requests.size() == 2; } ) );
+   BOOST_CHECK( server_delegate.trx_requests[1].trx_indexes == std::vector<uint32_t>( { 0, 1, 2 } ) );
+   server_connection->send( message( make_block_trxs( block2, { 1, 0, 2 } ) ) );
+   BOOST_REQUIRE( wait_until( [&](){ return server_delegate.subscribes == 2; } ) );
+   BOOST_CHECK_EQUAL( client_delegate.blocks.size(), 1u );
+
+   // the client dropped the block, so the resent one is requested in full again
+   server_connection->send( compact2 );
+   BOOST_REQUIRE( wait_until( [&](){ return server_delegate.trx_requests.size() == 3; } ) );
+   BOOST_CHECK( server_delegate.trx_requests[2].trx_indexes == std::vector<uint32_t>( { 0, 1, 2 } ) );
+   server_connection->send( message( make_block_trxs( block2, server_delegate.trx_requests[2].trx_indexes ) ) );
+   BOOST_REQUIRE( wait_until( [&](){ return client_delegate.blocks.size() == 2; } ) );
+   BOOST_CHECK( client_delegate.blocks[1].id() == block2.id() );
+   BOOST_CHECK( trx_ids( client_delegate.blocks[1] ) == trx_ids( block2 ) );
+   BOOST_CHECK_EQUAL( server_delegate.subscribes, 2u );
+
+   // the client goes first, its connection doesn't call back into it while being destroyed
+   client.reset();
+   server_connection.reset();
+   server.close();
+}
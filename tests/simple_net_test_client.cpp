@@ -88,7 +88,10 @@ void blockchain_tied_message_cache::block_accepted()
 
 void blockchain_tied_message_cache::cache_message(const message& message_to_cache, const message_hash_type& hash_of_message_to_cache)
 {
-  _message_cache.insert(message_info(hash_of_message_to_cache, message_to_cache, block_clock));
+  // a received message would otherwise keep its whole receive buffer alive for as long as it's cached
+  message owned_message(message_to_cache);
+  owned_message.own_payload();
+  _message_cache.insert(message_info(hash_of_message_to_cache, owned_message, block_clock));
 }
 
 message blockchain_tied_message_cache::get_message(const message_hash_type& hash_of_message_to_lookup)
@@ -400,7 +403,7 @@ message simple_net_test_miner::get_item(const item_id& id)
   {
     message result = _message_cache.get_message(id.item_hash);
     ilog("get_item() returning message from _message_cache (id: ${item_hash})", ("item_hash", result.id()));
-    ilog("item's real hash is ${hash}", ("hash", fc::ripemd160::hash(&result.data[0], result.data.size())));
+    ilog("item's real hash is ${hash}", ("hash", fc::ripemd160::hash(result.payload(), result.size)));
     return result;
   }
   catch (const fc::key_not_found_exception&)